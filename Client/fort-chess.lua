@@ -15,6 +15,7 @@ project "Fort-Chess"
         "%{IncludeDir.ASIO}",
         "global",            
         "include",           
+        "../Shared/include",
         "json",
         "src"
     }
@@ -28,6 +29,8 @@ project "Fort-Chess"
 
         "global/**.h",
         "global/**.cpp",
+        "../Shared/include/**.h",
+        "../Shared/src/**.cpp",
 
         "json/**.json",
     }
@@ -1,10 +1,14 @@
 #pragma once
 
 #include <functional>
+#include <mutex>
 #include <thread>
 
 #include <asio.hpp>
 
+#include "loopback.h"
+#include "protocol.h"
+
 namespace client
 {
 	enum class ClientError
@@ -20,8 +24,15 @@ namespace client
 	{
 	public:
 
+		static constexpr std::string_view LocalPrefix = "unix:";
+
+		// A host of the form "unix:<path>" connects to a server's Unix domain socket and ignores the port
 		Client(const std::string& host, unsigned short port, std::function<void()> onConnect = nullptr, std::function<void()> onDisonnect = nullptr);
 
+		// An in-process client on a simulated server's loopback link. It runs no io thread,
+		// the owner calls poll() to take in what the server sent.
+		Client(std::shared_ptr<transport::LoopbackLink> link, std::function<void()> onConnect = nullptr, std::function<void()> onDisonnect = nullptr);
+
 		Client(const Client&) = default;
 		Client& operator=(const Client&) = default;
 		Client(Client&&) = default;
@@ -29,14 +40,35 @@ namespace client
 
 		ClientError connect();
 
+		// Drops the socket and connects again, the server greets it as a new client.
+		// Not for loopback clients, whose link cannot be reopened.
+		ClientError reconnect();
+
 		void set_on_connect(std::function<void()> callback);
 		void set_on_disconnect(std::function<void()> callback);
 
 		template<typename T>
 		void send(const T& data);
 
+		// Sends frames as a player on one of the connection's channels, the first frame opens it.
+		// Bots use channels to play many games over one connection.
+		void send_on(uint16_t channel, std::vector<uint8_t> frames);
+
+		// Ends the channel's player on the server as if it had disconnected
+		void close_channel(uint16_t channel);
+
+		// Called once per complete protocol frame, and with an empty frame when the connection is lost.
+		// Frames of every channel come through here, frame_header(frame).channel tells them apart.
 		void set_on_message_received(std::function<void(const std::vector<uint8_t>&)> callback);
 
+		// Runs `work` on the io thread once `when` is reached, off a steady timer instead of the
+		// render loop. Frames sent from it may interleave with the owner's, never split them.
+		// Loopback clients have no io thread and ignore it.
+		void run_at(std::chrono::steady_clock::time_point when, std::function<void()> work);
+
+		// Loopback clients only: delivers the frames that have arrived and returns how many
+		size_t poll();
+
 		void stop();
 
 		~Client();
@@ -45,11 +77,20 @@ namespace client
 		std::thread _ioThread;
 		asio::io_context _ioContext;
 		
-		asio::ip::tcp::endpoint _endpoint;
-		asio::ip::tcp::socket _socket;
+		// Generic so the same client speaks TCP and Unix domain sockets
+		asio::generic::stream_protocol::endpoint _endpoint;
+		asio::generic::stream_protocol::socket _socket;
+		std::string _address;
+
+		std::shared_ptr<transport::LoopbackLink> _loopback;
+		bool _serverGone = false;
 
 		std::vector<uint8_t> _receiveBuffer; 
 
+		std::mutex _sendMutex;
+
+		protocol::FrameReader _reader;
+
 
 		std::function<void()> _onDisconnect = nullptr;
 		std::function<void()> _onConnect = nullptr;
@@ -59,6 +100,13 @@ namespace client
 		std::function<void(const std::vector<uint8_t>&)> _onMessageReceived;
 		void run(); 
 		void handle_receive(const asio::error_code& error, size_t bytesTransferred);
+
+		// Hands the complete frames among the received bytes to the callback, false on a malformed one
+		bool deliver_frames(size_t bytesTransferred, size_t& delivered);
+
+		void send_bytes(const uint8_t* data, size_t size);
+
+		static asio::generic::stream_protocol::endpoint make_endpoint(const std::string& host, unsigned short port);
 	};
 
 }
@@ -4,9 +4,18 @@
 #include <raylib.h>
 
 #include <array>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <vector>
 #include <utility>
+#include "clock_sync.h"
 #include "engine.h"
+#include "client.h"
+#include "hdr_histogram.h"
+#include "protocol.h"
+#include "spsc_ring.h"
 
 
 
@@ -31,6 +40,53 @@ namespace chess
 		PS_DECIDED
 	};
 
+	enum CommandType : uint8_t
+	{
+		CMD_NONE = 0,
+		CMD_START_WHITE,
+		CMD_START_BLACK,
+		CMD_MOVE,
+		CMD_PROMOTE,
+		CMD_WALL,
+		CMD_EN_PASSENT,
+		CMD_REJECT,
+		CMD_GAME_OVER,
+		CMD_ROOM_CLOSED,
+		CMD_DISCONNECT,
+		CMD_CONNECTION_LOST,
+		CMD_RESUMED,
+		CMD_SNAPSHOT,
+		CMD_CLOCK_SYNC,
+		CMD_PREMOVE_SENT
+	};
+
+	// Decoded on the client io thread, applied on the render thread. Squares are still in
+	// wire orientation, `player` is the side that acted (or won, or was assigned on start).
+	struct GameCommand
+	{
+		CommandType type = CMD_NONE;
+		PromotionResult promotion = PR_NONE;
+		Player player = PL_WHITE;
+		int first = 0;
+		int second = 0;
+		bool relayRoom = false;
+		uint64_t resumeToken = 0;
+		protocol::SnapshotMessage snapshot = {};
+
+		// Server milliseconds: when an event was accepted, or a sync probe was answered
+		uint32_t serverTime = 0;
+		// Our milliseconds when a sync probe left and when its answer came in
+		uint32_t clientTime = 0;
+		uint32_t receivedAt = 0;
+
+		// Room event sequence of accepted events and snapshots, 0 on everything else
+		uint32_t sequence = 0;
+
+		// Moves only: the trace in host byte order and our microseconds when the frame came in
+		protocol::MoveTrace trace = {};
+		uint32_t traceReceivedAt = 0;
+	};
+
 	class Game
 	{
 	public:
@@ -38,6 +94,9 @@ namespace chess
 
 		void run();
 
+		// Where the opponent's moves spent their time on the way to this board, in microseconds
+		void print_latency(std::ostream& out) const;
+
 		~Game();
 
 	private:
@@ -68,8 +127,52 @@ namespace chess
 			Texture2D tex;
 		} texInfo;
 
+		// What the player sees and plays on: the confirmed board with the inputs the server has
+		// not answered yet played on top. Rebuilt from the two whenever the server answers.
 		ChessEngine chessEngine;
 
+		// The board as of the last event the server accepted. Relay rooms do not use it.
+		ChessEngine confirmedEngine;
+		uint32_t confirmedSequence = 0;
+
+		struct PendingInput
+		{
+			CommandType type = CMD_NONE;
+			int first = 0;  // our orientation, as played
+			int second = 0;
+			PromotionResult promotion = PR_NONE;
+			chess::GameClock::time_point playedAt;
+		};
+
+		// The server answers our requests in order, so the front is always the next one answered
+		std::deque<PendingInput> pendingInputs;
+
+		struct Premove
+		{
+			int from;  // our orientation
+			int to;
+		};
+
+		// Moves for pieces still cooling down, by when they are ready. The io thread sends each
+		// one off a timer the moment its piece is, checked against premoveBoard, the board the
+		// render thread last published.
+		std::mutex premoveMutex;
+		std::multimap<chess::GameClock::time_point, Premove> premoves;
+		ChessEngine premoveBoard;
+		ClockSync premoveClockSync;
+
+		// Numbers our move requests for their traces, premoves take theirs on the io thread
+		std::atomic<uint16_t> nextMoveId = 0;
+
+		struct MoveLatency
+		{
+			metrics::HdrHistogram inputToSend;
+			metrics::HdrHistogram sendToServer;
+			metrics::HdrHistogram serverQueue;
+			metrics::HdrHistogram serverToPeer;
+			metrics::HdrHistogram peerToApplied;
+		} moveLatency;
+
 
 		struct PromRects
 		{
@@ -104,6 +207,7 @@ namespace chess
 			std::pair<int, int> pos = { -1, -1 };
 			int hoverPos = -1;
 			bool buildWall = false;
+			chess::GameClock::time_point madeAt; // of the second click
 
 			void reset()
 			{
@@ -119,8 +223,26 @@ namespace chess
 
 		client::Client client;
 
+		transport::SpscRing<GameCommand, 256> inboundCommands;
+
 		bool startGame = false;
 
+		// The server only relays this room, so en passant and wins are announced by the players
+		bool relayRoom = false;
+
+		chess::GameClock::time_point lastHeartbeat;
+
+		// From MSG_START, gets this seat back after a dropped connection. 0 in relay rooms.
+		uint64_t resumeToken = 0;
+
+		// Cooldowns of events start at the server's acceptedAt, read on this clock
+		ClockSync clockSync;
+		chess::GameClock::time_point lastClockSync;
+		static constexpr std::chrono::milliseconds ClockSyncInterval{ 1000 };
+
+		static constexpr int ResumeAttempts = 5;
+		static constexpr std::chrono::milliseconds ResumeRetryDelay{ 1000 };
+
 
 	private:
 
@@ -135,9 +257,45 @@ namespace chess
 		void render_board();
 		void load_assets();
 
-		std::pair<int, int> process_str_to_pair(const std::string& str, unsigned int offset) const;
-		std::pair<ToFrom, PromotionResult> process_promotion(const std::string& str) const;
-		std::pair<int, int> process_str_to_pair_wall(const std::string& str) const;
+		// Converts between this player's board and the wire orientation, both ways
+		int orient(int square) const;
+
+		GameCommand decode_message(const std::vector<uint8_t>& data) const;
+		void apply_pending_commands();
+		void send_heartbeat_if_due();
+		void send_clock_sync_if_due();
+		void apply_command(const GameCommand& cmd);
+		void announce_if_won();
+
+		// Reconnects and asks for the seat back, false if the server could not be reached
+		bool resume();
+
+		void load_snapshot(const protocol::SnapshotMessage& snapshot);
+
+		// Moves the cooldown an event started onto the server's clock, so both players see it end together
+		void sync_cooldown(const GameCommand& cmd);
+
+		// `inputAt` is when the player asked for the move, `sync` the clock to stamp it on
+		protocol::MoveMessage traced_move(int from, int to, chess::GameClock::time_point inputAt, const ClockSync& sync);
+
+		// Splits the opponent's move that is being applied into the legs of its trace
+		void record_move_latency(const GameCommand& cmd);
+
+		void remember_input(CommandType type, int first, int second, PromotionResult result = PR_NONE);
+
+		// Applies an accepted event to the confirmed board and retires the input it answers
+		void confirm(const GameCommand& cmd);
+
+		// Rolls the board back to the confirmed one and plays the pending inputs again
+		void rebuild_prediction();
+
+		void queue_premove(int from, int to, chess::GameClock::time_point ready);
+
+		// Io thread: sends the premoves that are due and still legal
+		void fire_premoves();
+
+		void publish_premove_board();
+		void clear_premoves();
 		// Handles
 		void handle_resize();
 		void handle_clicks();
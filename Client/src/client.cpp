@@ -1,13 +1,15 @@
 #include "headers.h"
 #include "client.h"
+#include "binary_log.h"
 
 
 namespace client
 {
 	Client::Client(const std::string& host, unsigned short port, std::function<void()> onConnect, std::function<void()> onDisonnect)
-		: _ioContext(), _endpoint(asio::ip::make_address(host), port), _socket(_ioContext)
+		: _ioContext(), _endpoint(make_endpoint(host, port)), _socket(_ioContext),
+		_address(host.starts_with(LocalPrefix) ? host : host + ":" + std::to_string(port))
 	{	
-		std::cout << "Client initialized. Connecting to " << host << ":" << port << std::endl;
+		logging::info<"Client initialized. Connecting to {}">(_address);
 
 		if (onConnect != nullptr)
 		{
@@ -19,15 +21,38 @@ namespace client
 		}
 	}
 
+	Client::Client(std::shared_ptr<transport::LoopbackLink> link, std::function<void()> onConnect, std::function<void()> onDisonnect)
+		: _ioContext(), _socket(_ioContext), _address("loopback"), _loopback(std::move(link))
+	{
+		if (onConnect != nullptr)
+		{
+			_onConnect = std::move(onConnect);
+		}
+		if (onDisonnect != nullptr)
+		{
+			_onDisconnect = std::move(onDisonnect);
+		}
+	}
+
 	ClientError Client::connect()
 	{
 		_receiveBuffer.resize(1024);
 
+		// The link is already connected, the client id comes with the first poll
+		if (_loopback)
+		{
+			if (_onConnect != nullptr)
+			{
+				_onConnect();
+			}
+			return ClientError::None;
+		}
+
 		asio::error_code socketEc;
 		_socket.connect(_endpoint, socketEc);
 		if (socketEc)
 		{
-			std::cerr << "Connect failed: " << socketEc.message() << std::endl;
+			logging::error<"Connect failed: {}">(socketEc.message());
 			return ClientError::ConnectFailed;
 		}
 
@@ -36,7 +61,7 @@ namespace client
 		_socket.receive(asio::buffer(&data, sizeof(data)), 0, dataEc);
 		if (dataEc)
 		{
-			std::cerr << "Initial connection failed: " << dataEc.message() << std::endl;
+			logging::error<"Initial connection failed: {}">(dataEc.message());
 			return ClientError::ConnectFailed;
 		}
 		_clientId = ntohl(data);
@@ -60,16 +85,35 @@ namespace client
 				}
 				catch (const std::exception& e)
 				{
-					std::cerr << "IO context error: " << e.what() << std::endl;
+					logging::error<"IO context error: {}">(e.what());
 				}
 			});
 
-		std::cout << "Client started on " << _endpoint.address().to_string() << ":" << _endpoint.port() << std::endl;
+		logging::info<"Client started on {}">(_address);
 
 		return ClientError::None;
 
 	}
 
+	ClientError Client::reconnect()
+	{
+		if (_loopback)
+			return ClientError::Disconnected;
+
+		_ioContext.stop();
+		if (_ioThread.joinable())
+			_ioThread.join();
+
+		asio::error_code ec;
+		_socket.close(ec);
+
+		_ioContext.restart();
+		_reader = protocol::FrameReader();
+		_clientId = 0;
+
+		return connect();
+	}
+
 	void Client::set_on_connect(std::function<void()> callback)
 	{
 		_onConnect = std::move(callback);
@@ -80,13 +124,93 @@ namespace client
 		_onDisconnect = std::move(callback);
 	}
 
+	void Client::send_on(uint16_t channel, std::vector<uint8_t> frames)
+	{
+		protocol::set_channel(frames.data(), frames.size(), channel);
+		send_bytes(frames.data(), frames.size());
+	}
+
+	void Client::close_channel(uint16_t channel)
+	{
+		send_on(channel, protocol::encode_frame(protocol::MSG_CLOSE_CHANNEL));
+	}
+
 	void Client::set_on_message_received(std::function<void(const std::vector<uint8_t>&)> callback)
 	{
 		_onMessageReceived = std::move(callback);
 	}
 
+	void Client::run_at(std::chrono::steady_clock::time_point when, std::function<void()> work)
+	{
+		if (_loopback)
+			return;
+
+		auto timer = std::make_shared<asio::steady_timer>(_ioContext, when);
+		timer->async_wait([timer, work = std::move(work)](const asio::error_code& error)
+			{
+				if (!error)
+					work();
+			});
+	}
+
+	size_t Client::poll()
+	{
+		if (!_loopback || _serverGone)
+			return 0;
+
+		// The server publishes the 4 byte greeting in one go, so it is either all there or not at all
+		if (_clientId == 0)
+		{
+			uint32_t data = 0;
+			if (_loopback->toClient.pop_some(reinterpret_cast<uint8_t*>(&data), sizeof(data)) < sizeof(data))
+				return 0;
+			_clientId = ntohl(data);
+		}
+
+		size_t delivered = 0;
+		size_t received = _loopback->toClient.pop_some(_receiveBuffer.data(), _receiveBuffer.size());
+		if (received > 0 && !deliver_frames(received, delivered))
+		{
+			_serverGone = true;
+			return delivered;
+		}
+
+		if (_loopback->serverClosed.load(std::memory_order_acquire) && _loopback->toClient.empty())
+		{
+			logging::info<"Server disconnected.">();
+			_serverGone = true;
+
+			if (_onMessageReceived)
+				_onMessageReceived({});
+		}
+
+		return delivered;
+	}
+
 	void Client::stop()
 	{
+		// A failed send on the io thread itself, from a handler or a run_at timer, cannot join the
+		// thread it runs on: it only closes the socket from the queue and reports the connection
+		// lost, the owner's stop() joins later
+		if (_ioThread.joinable() && std::this_thread::get_id() == _ioThread.get_id())
+		{
+			asio::post(_ioContext, [this]()
+				{
+					// Reported once however many sends failed
+					if (!_socket.is_open())
+						return;
+
+					asio::error_code ec;
+					_socket.close(ec);
+
+					if (_onMessageReceived)
+						_onMessageReceived({});
+				});
+			return;
+		}
+
+		if (_loopback)
+			_loopback->clientClosed.store(true, std::memory_order_release);
 
 		if (_onDisconnect)
 		{
@@ -106,7 +230,7 @@ namespace client
 
 		_receiveBuffer.clear();
 
-		std::cout << "Client stopped." << std::endl;
+		logging::info<"Client stopped.">();
 	}
 
 	Client::~Client()
@@ -124,29 +248,37 @@ namespace client
 				}
 				catch (const std::exception& e)
 				{
-					std::cerr << "Client IO context error: " << e.what() << std::endl;
+					logging::error<"Client IO context error: {}">(e.what());
 				}
 			});
 	}
 
+	asio::generic::stream_protocol::endpoint Client::make_endpoint(const std::string& host, unsigned short port)
+	{
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		if (host.starts_with(LocalPrefix))
+			return asio::local::stream_protocol::endpoint(host.substr(LocalPrefix.size()));
+#endif
+		return asio::ip::tcp::endpoint(asio::ip::make_address(host), port);
+	}
+
 	void Client::handle_receive(const asio::error_code& error, size_t bytesTransferred)
 	{
-		if (error)
+		if (error || bytesTransferred == 0)
 		{
-			std::cerr << "Receive failed: " << error.message() << std::endl;
-		}
-		if (error == asio::error::eof || bytesTransferred == 0)
-		{
-			std::cout << "Server disconnected." << std::endl;
+			if (error == asio::error::eof || bytesTransferred == 0)
+				logging::info<"Server disconnected.">();
+			else
+				logging::error<"Receive failed: {}">(error.message());
+
+			if (_onMessageReceived && error != asio::error::operation_aborted)
+				_onMessageReceived({});
+			return;
 		}
 
-		
-		std::vector<uint8_t> data(_receiveBuffer.begin(), _receiveBuffer.begin() + bytesTransferred); 
-		
-		// this might copy the buffer from
-		//the beginning to the buffer th the bytes transferred,
-		//and if it was inserted twice, it might read from wrong offset
-		_onMessageReceived(data);
+		size_t delivered = 0;
+		if (!deliver_frames(bytesTransferred, delivered))
+			return;
 
 		_socket.async_receive(asio::buffer(_receiveBuffer),
 			[this](const asio::error_code& error, size_t bytesTransferred)
@@ -155,4 +287,53 @@ namespace client
 			});
 	}
 
-}
+	bool Client::deliver_frames(size_t bytesTransferred, size_t& delivered)
+	{
+		_reader.append(_receiveBuffer.data(), bytesTransferred);
+
+		std::vector<uint8_t> frame;
+		while (_reader.next(frame))
+		{
+			delivered++;
+			if (_onMessageReceived)
+				_onMessageReceived(frame);
+		}
+
+		if (_reader.corrupt())
+		{
+			logging::error<"Server sent a malformed frame.">();
+
+			if (_onMessageReceived)
+				_onMessageReceived({});
+			return false;
+		}
+
+		return true;
+	}
+
+	void Client::send_bytes(const uint8_t* data, size_t size)
+	{
+		if (_loopback)
+		{
+			// A server that stopped reading is treated like a failed socket write
+			if (!_loopback->toServer.try_push_all(data, size))
+			{
+				logging::error<"Send failed: the loopback server is not reading">();
+				stop();
+			}
+			return;
+		}
+
+		try
+		{
+			std::lock_guard lock(_sendMutex);
+			asio::write(_socket, asio::buffer(data, size));
+		}
+		catch (const asio::system_error& e)
+		{
+			logging::error<"Send failed: {}">(e.what());
+			stop(); // Stop the client if sending fails
+		}
+	}
+
+}
\ No newline at end of file
@@ -21,61 +21,14 @@ namespace chess
 
 		client.set_on_message_received([this](const std::vector<uint8_t>& data) 
 		{
-			std::string message(data.begin(), data.end());
-			message.erase(std::remove(message.begin(), message.end(), '\0'), message.end());
+			GameCommand cmd = decode_message(data);
 
-			if (!startGame)
-			{
-				if (message == "BLACK")
-				{
-					chessEngine = ChessEngine(PL_BLACK, 2000);
-					startGame = true;
-					return;
-				}
-				else if (message == "WHITE")
-				{
-					chessEngine = ChessEngine(PL_WHITE, 2000);
-					startGame = true;
-					return;
-				}
-				std::cout << message.size() << std::endl;
-			}
-
-
-			if (message.contains("PROM"))
-			{
-				auto res = process_promotion(message);
-				chessEngine.opponent_promote(res.first, res.second);
-			}
-			else if (message.contains("TO"))
-			{
-				std::pair<int, int> toFrom = process_str_to_pair(message, 3);
-				chessEngine.opponent_move(toFrom.first, toFrom.second);
-			}
-			else if (message.contains("WALL"))
-			{
-				std::pair<int, int> toFrom = process_str_to_pair_wall(message);
-				chessEngine.build_wall_opponent(toFrom.first, toFrom.second);
-			}
-			else if (message.contains("ENPS"))
-			{
-				std::pair<int, int> toFrom = process_str_to_pair(message, 5);
-				chessEngine.add_en_passent_oppertunity(toFrom.first, toFrom.second);
-			}
-			else if (message == "WIN")
-			{
+			if (cmd.type == CMD_NONE)
+				return;
 
-			}
-			else if (message == "LOSE")
-			{
-				isGameOver = true;
-				std::cout << "You Lost!" << std::endl;
-			}
-			else
-			{
-				isGameOver = true;
-				std::cout << "Opponent disconnected" << std::endl;
-			}
+			// The render thread drains the ring every frame, so it is only ever full if that thread stalls
+			while (!inboundCommands.try_push(cmd))
+				std::this_thread::yield();
 		});
 
 		std::string base = "Waiting for Server";
@@ -83,6 +36,13 @@ namespace chess
 
 		while (!startGame)
 		{
+			apply_pending_commands();
+			send_heartbeat_if_due();
+			send_clock_sync_if_due();
+
+			if (startGame)
+				break;
+
 			std::cout << "\r" << dots << std::flush;
 
 			std::this_thread::sleep_for(std::chrono::milliseconds(500));
@@ -107,7 +67,12 @@ namespace chess
 
 		while (!WindowShouldClose() && !isGameOver)
 		{
+			apply_pending_commands();
+			send_heartbeat_if_due();
+			send_clock_sync_if_due();
+
 			process_input();
+			publish_premove_board();
 
 			BeginDrawing();
 			ClearBackground(BLACK);
@@ -117,7 +82,11 @@ namespace chess
 			EndDrawing();
 
 			chessEngine.check_timeouts();
+			confirmedEngine.check_timeouts();
 		}
+
+		if (moveLatency.inputToSend.count() > 0)
+			print_latency(std::cout);
 	}
 
 
@@ -198,6 +167,15 @@ namespace chess
 			}
 		}
 
+		// Queued premoves, outlined on the squares they will move to
+		{
+			int cellSize = screenSize / 8;
+
+			std::lock_guard lock(premoveMutex);
+			for (const auto& [ready, premove] : premoves)
+				DrawRectangleLines((premove.to % 8) * cellSize, (premove.to / 8) * cellSize, cellSize, cellSize, ORANGE);
+		}
+
 		if (promotion.stateActive)
 			render_promotion_options();
 
@@ -207,24 +185,43 @@ namespace chess
 		{
 			if (click.buildWall && chessEngine.build_wall(click.pos.first, click.pos.second) == WL_SUCCESS)
 			{
-				client.send(std::string("WALL ") + std::to_string(chessEngine.reverse(click.pos.first)) + " " + std::to_string(chessEngine.reverse(click.pos.second)));
+				client.send(protocol::encode_frame(protocol::MSG_WALL, protocol::WallMessage{ .player = static_cast<uint8_t>(player), .place = static_cast<uint8_t>(orient(click.pos.first)), .direction = static_cast<uint8_t>(orient(click.pos.second)) }));
+				remember_input(CMD_WALL, click.pos.first, click.pos.second);
+				click.reset();
+			}
+			else if (auto ready = chessEngine.cooldown_expiry(click.pos.first); ready && !relayRoom && chessEngine.valid_piece(click.pos.first))
+			{
+				queue_premove(click.pos.first, click.pos.second, *ready);
 				click.reset();
 			}
 			else
 			{
+				// Applied right away and sent for the server to confirm, the server derives en passant itself
+				protocol::MoveMessage request = traced_move(click.pos.first, click.pos.second, click.madeAt, clockSync);
+
 				switch (chessEngine.move_piece(click.pos.first, click.pos.second))
 				{
-				case MOVE_EN_PASSENT_OPPORTUNITY:
+				case MOVE_PROMOTION:
+				case MOVE_PROMOTION_CAPTURE:
 				{
-					client.send(std::string("ENPS ") + std::to_string(chessEngine.reverse(chessEngine.get_under_position_of(click.pos.second))) + " " + std::to_string(chessEngine.get_game_moves_count()));
-					client.send(std::string("TO ") + std::to_string(chessEngine.reverse(click.pos.first)) + " " + std::to_string(chessEngine.reverse(click.pos.second)));
+					client.send(protocol::encode_frame(protocol::MSG_MOVE, request));
+					remember_input(CMD_MOVE, click.pos.first, click.pos.second);
+					promotion.stateActive = PS_DECIDING;
 					click.reset();
 					break;
 				}
-				case MOVE_PROMOTION:
-				case MOVE_PROMOTION_CAPTURE:
+
+				case MOVE_EN_PASSENT_OPPORTUNITY:
 				{
-					promotion.stateActive = PS_DECIDING;
+					if (relayRoom)
+					{
+						int under = chessEngine.get_under_position_of(click.pos.second);
+						protocol::EnPassantMessage enPassant{ static_cast<uint8_t>(player), static_cast<uint8_t>(orient(under)), protocol::to_wire16(static_cast<uint16_t>(chessEngine.get_game_moves_count())) };
+						client.send(protocol::encode_frame(protocol::MSG_EN_PASSANT, enPassant));
+					}
+
+					client.send(protocol::encode_frame(protocol::MSG_MOVE, request));
+					remember_input(CMD_MOVE, click.pos.first, click.pos.second);
 					click.reset();
 					break;
 				}
@@ -232,8 +229,9 @@ namespace chess
 				case MOVE_SUCCESS:
 				case MOVE_CAPTURE:
 				{
-					client.send(std::string("TO ") + std::to_string(chessEngine.reverse(click.pos.first)) + " " + std::to_string(chessEngine.reverse(click.pos.second)));
-
+					client.send(protocol::encode_frame(protocol::MSG_MOVE, request));
+					remember_input(CMD_MOVE, click.pos.first, click.pos.second);
+					announce_if_won();
 					click.reset();
 					break;
 				}
@@ -248,14 +246,6 @@ namespace chess
 					click.state = FIRST_CLICK;
 				}
 			}
-
-			if (chessEngine.did_other_lose())
-			{
-				client.send<std::string>("LOSE");
-
-				std::cout << "You WON!" << std::endl;
-				isGameOver = true;
-			}
 		}
 
 
@@ -282,81 +272,570 @@ namespace chess
 
 	}
 
-	std::pair<int, int> Game::process_str_to_pair(const std::string& str, unsigned int offset) const
+	int Game::orient(int square) const
+	{
+		return protocol::orient(square, player == PL_WHITE);
+	}
+
+	GameCommand Game::decode_message(const std::vector<uint8_t>& frame) const
+	{
+		GameCommand cmd;
+
+		if (frame.empty())
+		{
+			cmd.type = CMD_CONNECTION_LOST;
+			return cmd;
+		}
+
+		switch (protocol::frame_header(frame).type)
+		{
+		case protocol::MSG_START:
+		{
+			protocol::StartMessage message;
+			if (protocol::decode_payload(frame, message))
+			{
+				uint8_t flags = protocol::frame_header(frame).flags;
+				if (flags & protocol::FLAG_RESUMED)
+					cmd.type = CMD_RESUMED;
+				else
+					cmd.type = message.player == PL_BLACK ? CMD_START_BLACK : CMD_START_WHITE;
+				cmd.player = static_cast<Player>(message.player);
+				cmd.relayRoom = (flags & protocol::FLAG_RELAY) != 0;
+				cmd.resumeToken = protocol::from_wire64(message.token);
+			}
+			break;
+		}
+		case protocol::MSG_MOVE:
+		{
+			protocol::MoveMessage message;
+			if (protocol::decode_payload(frame, message))
+			{
+				cmd = { CMD_MOVE, PR_NONE, static_cast<Player>(message.player), message.from, message.to };
+				cmd.serverTime = protocol::from_wire32(message.acceptedAt);
+				cmd.trace = { protocol::from_wire16(message.trace.moveId), protocol::from_wire32(message.trace.inputToSend), protocol::from_wire32(message.trace.sentAt),
+					protocol::from_wire32(message.trace.serverReceived), protocol::from_wire32(message.trace.serverForwarded) };
+				cmd.traceReceivedAt = ClockSync::micros(chess::GameClock::now());
+			}
+			break;
+		}
+		case protocol::MSG_WALL:
+		{
+			protocol::WallMessage message;
+			if (protocol::decode_payload(frame, message))
+			{
+				cmd = { CMD_WALL, PR_NONE, static_cast<Player>(message.player), message.place, message.direction };
+				cmd.serverTime = protocol::from_wire32(message.acceptedAt);
+			}
+			break;
+		}
+		case protocol::MSG_PROMOTE:
+		{
+			protocol::PromoteMessage message;
+			if (protocol::decode_payload(frame, message))
+				cmd = { CMD_PROMOTE, static_cast<PromotionResult>(message.piece), static_cast<Player>(message.player), message.from, message.to };
+			break;
+		}
+		case protocol::MSG_EN_PASSANT:
+		{
+			protocol::EnPassantMessage message;
+			if (protocol::decode_payload(frame, message))
+				cmd = { CMD_EN_PASSENT, PR_NONE, static_cast<Player>(message.player), message.underPosition, protocol::from_wire16(message.whenImplemented) };
+			break;
+		}
+		case protocol::MSG_REJECT:
+		{
+			protocol::RejectMessage message;
+			if (protocol::decode_payload(frame, message))
+			{
+				cmd = { CMD_REJECT, PR_NONE, PL_WHITE, message.from, message.to };
+
+				// The seat is gone, the game ended while we were away
+				if (message.requestType == protocol::MSG_RESUME)
+					cmd.type = CMD_ROOM_CLOSED;
+			}
+			break;
+		}
+		case protocol::MSG_GAME_OVER:
+		{
+			protocol::GameOverMessage message;
+			if (protocol::decode_payload(frame, message))
+				cmd = { CMD_GAME_OVER, PR_NONE, static_cast<Player>(message.winner), 0, 0 };
+			break;
+		}
+		case protocol::MSG_OPPONENT_LEFT:
+			cmd.type = CMD_DISCONNECT;
+			break;
+		case protocol::MSG_ROOM_CLOSED:
+			cmd.type = CMD_ROOM_CLOSED;
+			break;
+		case protocol::MSG_TIME_SYNC:
+		{
+			// Stamped here on the io thread, the render thread may only see it a frame later
+			protocol::TimeSyncMessage message;
+			if (protocol::decode_payload(frame, message))
+			{
+				cmd.type = CMD_CLOCK_SYNC;
+				cmd.clientTime = protocol::from_wire32(message.clientTime);
+				cmd.serverTime = protocol::from_wire32(message.serverTime);
+				cmd.receivedAt = ClockSync::millis(chess::GameClock::now());
+			}
+			break;
+		}
+		case protocol::MSG_SNAPSHOT:
+			if (protocol::decode_payload(frame, cmd.snapshot))
+				cmd.type = CMD_SNAPSHOT;
+			break;
+		default:
+			break;
+		}
+
+		cmd.sequence = protocol::frame_header(frame).sequence;
+		return cmd;
+	}
+
+	void Game::apply_pending_commands()
+	{
+		inboundCommands.drain([this](const GameCommand& cmd)
+		{
+			apply_command(cmd);
+		});
+	}
+
+	void Game::send_heartbeat_if_due()
+	{
+		auto now = chess::GameClock::now();
+		if (now - lastHeartbeat < std::chrono::milliseconds(protocol::HeartbeatIntervalMs))
+			return;
+
+		lastHeartbeat = now;
+		client.send(protocol::encode_frame(protocol::MSG_HEARTBEAT));
+	}
+
+	void Game::send_clock_sync_if_due()
+	{
+		// A relay room would hand the probe to the opponent, the estimate from the wait has to do
+		if (startGame && relayRoom)
+			return;
+
+		auto now = chess::GameClock::now();
+		if (now - lastClockSync < ClockSyncInterval)
+			return;
+
+		lastClockSync = now;
+		client.send(protocol::encode_frame(protocol::MSG_TIME_SYNC, protocol::TimeSyncMessage{ protocol::to_wire32(ClockSync::millis(now)), 0 }));
+	}
+
+	void Game::apply_command(const GameCommand& cmd)
+	{
+		switch (cmd.type)
+		{
+		case CMD_START_BLACK:
+		case CMD_START_WHITE:
+			if (!startGame)
+			{
+				player = cmd.player;
+				relayRoom = cmd.relayRoom;
+				resumeToken = cmd.resumeToken;
+				chessEngine = ChessEngine(player, protocol::MoveCooldownMs);
+				confirmedEngine = chessEngine;
+				startGame = true;
+			}
+			return;
+		case CMD_RESUMED:
+			// The board comes next in a snapshot, half made moves are forgotten
+			player = cmd.player;
+			resumeToken = cmd.resumeToken;
+			chessEngine = ChessEngine(player, protocol::MoveCooldownMs);
+			confirmedEngine = chessEngine;
+			confirmedSequence = 0;
+			pendingInputs.clear();
+			clear_premoves();
+			click.reset();
+			promotion.reset();
+			std::cout << "Back in the game" << std::endl;
+			return;
+		case CMD_SNAPSHOT:
+			load_snapshot(cmd.snapshot);
+			confirmedSequence = cmd.sequence;
+			rebuild_prediction();
+			return;
+		case CMD_CLOCK_SYNC:
+			clockSync.add_sample(cmd.clientTime, cmd.serverTime, cmd.receivedAt);
+			return;
+		case CMD_PREMOVE_SENT:
+			// Already on its way, the local board catches up and the server's answer retires it as usual
+			chessEngine.expire_timeout(cmd.first);
+			switch (chessEngine.move_piece(cmd.first, cmd.second))
+			{
+			case MOVE_PROMOTION:
+			case MOVE_PROMOTION_CAPTURE:
+				promotion.stateActive = PS_DECIDING;
+				break;
+			default:
+				break;
+			}
+			remember_input(CMD_MOVE, cmd.first, cmd.second);
+			return;
+		case CMD_CONNECTION_LOST:
+			if (startGame && !isGameOver && resumeToken != 0 && resume())
+				return;
+			isGameOver = true;
+			std::cout << "Lost the connection to the server" << std::endl;
+			return;
+		case CMD_REJECT:
+			std::cout << "Server rejected " << cmd.first << " -> " << cmd.second << std::endl;
+
+			// Our oldest unanswered input never happened
+			if (!relayRoom && !pendingInputs.empty())
+			{
+				pendingInputs.pop_front();
+				rebuild_prediction();
+			}
+			return;
+		case CMD_GAME_OVER:
+			isGameOver = true;
+			std::cout << (cmd.player == player ? "You WON!" : "You Lost!") << std::endl;
+			return;
+		case CMD_ROOM_CLOSED:
+			isGameOver = true;
+			std::cout << "Game closed after being idle" << std::endl;
+			return;
+		case CMD_DISCONNECT:
+			isGameOver = true;
+			std::cout << "Opponent disconnected" << std::endl;
+			return;
+		default:
+			break;
+		}
+
+		if (cmd.type == CMD_MOVE && cmd.player != player)
+			record_move_latency(cmd);
+
+		if (!relayRoom)
+		{
+			// Events the snapshot already holds may still be queued behind it
+			if (cmd.sequence != 0 && cmd.sequence <= confirmedSequence)
+				return;
+			if (cmd.sequence != 0)
+				confirmedSequence = cmd.sequence;
+
+			confirm(cmd);
+			rebuild_prediction();
+			return;
+		}
+
+		// A relay room never sends our own events back, they were applied when they were played
+		if (cmd.player == player)
+			return;
+
+		switch (cmd.type)
+		{
+		case CMD_PROMOTE:
+			chessEngine.opponent_promote({ orient(cmd.first), orient(cmd.second) }, cmd.promotion);
+			break;
+		case CMD_MOVE:
+			chessEngine.opponent_move(orient(cmd.first), orient(cmd.second));
+			break;
+		case CMD_WALL:
+			chessEngine.build_wall_opponent(orient(cmd.first), orient(cmd.second));
+			break;
+		case CMD_EN_PASSENT:
+			chessEngine.add_en_passent_oppertunity(orient(cmd.first), cmd.second);
+			break;
+		default:
+			break;
+		}
+	}
+
+	void Game::queue_premove(int from, int to, chess::GameClock::time_point ready)
+	{
+		{
+			std::lock_guard lock(premoveMutex);
+			premoves.emplace(ready, Premove{ from, to });
+			premoveBoard = chessEngine;
+			premoveClockSync = clockSync;
+		}
+
+		// Timers that find nothing due are harmless, so each premove simply brings its own
+		client.run_at(std::chrono::steady_clock::time_point(ready.time_since_epoch()), [this]()
+		{
+			fire_premoves();
+		});
+	}
+
+	void Game::fire_premoves()
+	{
+		struct Due
+		{
+			chess::GameClock::time_point ready;
+			Premove premove;
+		};
+
+		// Only picking the due premoves needs the lock, sending and handing them to the game loop
+		// must not keep queue_premove waiting
+		std::vector<Due> due;
+		ClockSync sync;
+		{
+			std::lock_guard lock(premoveMutex);
+
+			auto now = chess::GameClock::now();
+			while (!premoves.empty() && premoves.begin()->first <= now)
+			{
+				auto [ready, premove] = *premoves.begin();
+				premoves.erase(premoves.begin());
+
+				// The position may have moved on since it was queued, the piece may be gone or blocked
+				premoveBoard.expire_timeout(premove.from);
+				if (premoveBoard.move_piece(premove.from, premove.to) == MOVE_INVALID)
+					continue;
+
+				due.push_back({ ready, premove });
+			}
+			sync = premoveClockSync;
+		}
+
+		for (const Due& fired : due)
+		{
+			// Its input is the piece coming off cooldown, what is measured is how late the timer was
+			client.send(protocol::encode_frame(protocol::MSG_MOVE, traced_move(fired.premove.from, fired.premove.to, fired.ready, sync)));
+
+			GameCommand sent;
+			sent.type = CMD_PREMOVE_SENT;
+			sent.first = fired.premove.from;
+			sent.second = fired.premove.to;
+			while (!inboundCommands.try_push(sent))
+				std::this_thread::yield();
+		}
+	}
+
+	void Game::publish_premove_board()
+	{
+		std::lock_guard lock(premoveMutex);
+		if (!premoves.empty())
+		{
+			premoveBoard = chessEngine;
+			premoveClockSync = clockSync;
+		}
+	}
+
+	void Game::clear_premoves()
+	{
+		std::lock_guard lock(premoveMutex);
+		premoves.clear();
+	}
+
+	protocol::MoveMessage Game::traced_move(int from, int to, chess::GameClock::time_point inputAt, const ClockSync& sync)
+	{
+		auto now = chess::GameClock::now();
+
+		protocol::MoveTrace trace{};
+		trace.moveId = protocol::to_wire16(nextMoveId++);
+		trace.inputToSend = protocol::to_wire32(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - inputAt).count()));
+		if (sync.synced())
+			trace.sentAt = protocol::to_wire32(ClockSync::micros(now) + static_cast<uint32_t>(sync.offset_ms() * 1000));
+
+		return { static_cast<uint8_t>(player), static_cast<uint8_t>(orient(from)), static_cast<uint8_t>(orient(to)), 0, trace };
+	}
+
+	void Game::record_move_latency(const GameCommand& cmd)
 	{
-		std::istringstream iss(str.substr(offset));
-		std::string s;
-		std::vector<std::string> strs;
+		const protocol::MoveTrace& trace = cmd.trace;
 
-		while (getline(iss, s, ' '))
-			strs.push_back(s);
+		// Legs between two clocks lean on both sides' sync estimates, which can make a short one negative
+		auto across = [](uint32_t later, uint32_t earlier)
+		{
+			return static_cast<uint64_t>(std::max<int32_t>(0, static_cast<int32_t>(later - earlier)));
+		};
 
-		if (strs.size() < 2)
-			return { 0, 0 };
+		moveLatency.inputToSend.record(trace.inputToSend);
+		moveLatency.peerToApplied.record(ClockSync::micros(chess::GameClock::now()) - cmd.traceReceivedAt);
 
-		strs.resize(2);
+		// Relay rooms forward the request as it was sent, without the server's stamps
+		if (trace.serverReceived == 0)
+			return;
+
+		if (trace.sentAt != 0)
+			moveLatency.sendToServer.record(across(trace.serverReceived, trace.sentAt));
 
-		return { std::stoi(strs[0]), std::stoi(strs[1]) };
+		moveLatency.serverQueue.record(trace.serverForwarded - trace.serverReceived);
+
+		if (clockSync.synced())
+			moveLatency.serverToPeer.record(across(cmd.traceReceivedAt + static_cast<uint32_t>(clockSync.offset_ms() * 1000), trace.serverForwarded));
 	}
 
-	std::pair<ToFrom, PromotionResult> Game::process_promotion(const std::string& str) const
+	void Game::print_latency(std::ostream& out) const
 	{
-		std::istringstream iss(str.substr(5));
-		std::string s;
-		std::vector<std::string> strs;
+		moveLatency.inputToSend.print(out, "input to send (us)");
+		moveLatency.sendToServer.print(out, "send to server (us)");
+		moveLatency.serverQueue.print(out, "server queueing (us)");
+		moveLatency.serverToPeer.print(out, "server to peer (us)");
+		moveLatency.peerToApplied.print(out, "peer to applied (us)");
+	}
 
-		while (getline(iss, s, ' '))
-			strs.push_back(s);
+	void Game::remember_input(CommandType type, int first, int second, PromotionResult result)
+	{
+		if (!relayRoom)
+			pendingInputs.push_back({ type, first, second, result, chess::GameClock::now() });
+	}
+
+	void Game::confirm(const GameCommand& cmd)
+	{
+		int first = orient(cmd.first);
+		int second = orient(cmd.second);
 
-		if (strs.size() < 3)
-			return { {0, 0}, PR_NONE };
+		if (cmd.player != player)
+		{
+			switch (cmd.type)
+			{
+			case CMD_PROMOTE:
+				confirmedEngine.opponent_promote({ first, second }, cmd.promotion);
+				break;
+			case CMD_MOVE:
+				confirmedEngine.opponent_move(first, second);
+				break;
+			case CMD_WALL:
+				confirmedEngine.build_wall_opponent(first, second);
+				break;
+			case CMD_EN_PASSENT:
+				confirmedEngine.add_en_passent_oppertunity(first, cmd.second);
+				break;
+			default:
+				break;
+			}
 
-		strs.resize(3);
+			sync_cooldown(cmd);
+			return;
+		}
 
-		PromotionResult res = PR_NONE;
+		switch (cmd.type)
+		{
+		case CMD_MOVE:
+			// The server judged the cooldown on its clock, one not quite over here must not refuse the move
+			confirmedEngine.expire_timeout(first);
+			confirmedEngine.move_piece(first, second);
+			break;
+		case CMD_WALL:
+			confirmedEngine.build_wall(first, second);
+			break;
+		case CMD_PROMOTE:
+			confirmedEngine.promote(cmd.promotion);
+			break;
+		default:
+			// Our en passant events are the opponent's chance, nothing we played
+			return;
+		}
 
-		if (strs[2] == "K")
-			res = PR_KNIGHT;
-		else if (strs[2] == "B")
-			res = PR_BISHOP;
-		else if (strs[2] == "R")
-			res = PR_ROOK;
-		else if (strs[2] == "Q")
-			res = PR_QUEEN;
+		if (!pendingInputs.empty())
+			pendingInputs.pop_front();
 
-		return { { std::stoi(strs[0]), std::stoi(strs[1]) }, res };
+		sync_cooldown(cmd);
 	}
 
-	std::pair<int, int> Game::process_str_to_pair_wall(const std::string& str) const
+	void Game::rebuild_prediction()
 	{
-		std::istringstream iss(str.substr(5));
-		std::string s;
-		std::vector<std::string> strs;
-		while (getline(iss, s, ' '))
-			strs.push_back(s);
-		if (strs.size() < 2)
-			return { 0, DIR_NONE };
-		strs.resize(2);
-		
-		return { std::stoi(strs[0]), std::stoi(strs[1]) };
+		chessEngine = confirmedEngine;
+
+		auto now = chess::GameClock::now();
+		auto cooldown = std::chrono::milliseconds(protocol::MoveCooldownMs);
 
+		// An input the confirmed board no longer allows is skipped but kept, the server's reject retires it
+		for (const PendingInput& input : pendingInputs)
+		{
+			switch (input.type)
+			{
+			case CMD_MOVE:
+				if (chessEngine.move_piece(input.first, input.second) != MOVE_INVALID)
+					chessEngine.start_cooldown(input.second, input.playedAt + cooldown - now);
+				break;
+			case CMD_WALL:
+				if (chessEngine.build_wall(input.first, input.second) == WL_SUCCESS)
+					chessEngine.start_cooldown(input.first, input.playedAt + cooldown - now);
+				break;
+			case CMD_PROMOTE:
+				chessEngine.promote(input.promotion);
+				break;
+			default:
+				break;
+			}
+		}
+
+		// The move that wanted a promotion choice may have been taken back
+		if (promotion.stateActive == PS_DECIDING && chessEngine.get_waiting_for_promotion().to == -1)
+			promotion.reset();
 	}
 
-	std::string to_str(PromotionResult res)
+	void Game::sync_cooldown(const GameCommand& cmd)
 	{
-		switch (res)
+		if (cmd.serverTime == 0 || !clockSync.synced())
+			return;
+
+		// The engine started the cooldown when the event arrived, one way latency after the server did
+		int square;
+		switch (cmd.type)
 		{
-		case PR_QUEEN:
-			return "Q";
-		case PR_ROOK:
-			return "R";
-		case PR_BISHOP:
-			return "B";
-		case PR_KNIGHT:
-			return "K";
+		case CMD_MOVE:
+			square = orient(cmd.second);
+			break;
+		case CMD_WALL:
+			// Only the builder's piece cools down after a wall
+			if (cmd.player != player)
+				return;
+			square = orient(cmd.first);
+			break;
 		default:
-			return "N";
+			return;
 		}
+
+		auto expiry = clockSync.to_local(cmd.serverTime) + std::chrono::milliseconds(protocol::MoveCooldownMs);
+		confirmedEngine.start_cooldown(square, expiry - chess::GameClock::now());
+	}
+
+	bool Game::resume()
+	{
+		// The server holds the seat for ResumeGraceMs, the attempts all fit well inside it
+		for (int attempt = 0; attempt < ResumeAttempts; attempt++)
+		{
+			std::this_thread::sleep_for(ResumeRetryDelay);
+
+			if (client.reconnect() != client::ClientError::None)
+				continue;
+
+			client.send(protocol::encode_frame(protocol::MSG_RESUME, protocol::ResumeMessage{ protocol::to_wire64(resumeToken) }));
+			lastHeartbeat = chess::GameClock::now();
+			return true;
+		}
+
+		return false;
+	}
+
+	void Game::load_snapshot(const protocol::SnapshotMessage& snapshot)
+	{
+		std::array<Pieces, 64> pieces;
+		for (int square = 0; square < 64; square++)
+			pieces[square] = static_cast<Pieces>(protocol::snapshot_piece(snapshot, square));
+
+		uint64_t below = 0;
+		uint64_t right = 0;
+		protocol::snapshot_walls(snapshot, below, right);
+		confirmedEngine.load_board(pieces, below, right);
+		pendingInputs.clear();
+
+		size_t count = std::min<size_t>(snapshot.cooldownCount, protocol::MaxSnapshotCooldowns);
+		for (size_t i = 0; i < count; i++)
+		{
+			std::chrono::milliseconds left(snapshot.cooldowns[i][1] * protocol::SnapshotCooldownUnitMs);
+			confirmedEngine.start_cooldown(orient(snapshot.cooldowns[i][0]), left);
+		}
+	}
+
+	void Game::announce_if_won()
+	{
+		if (!relayRoom || !chessEngine.did_other_lose())
+			return;
+
+		client.send(protocol::encode_frame(protocol::MSG_GAME_OVER, protocol::GameOverMessage{ static_cast<uint8_t>(player) }));
+		isGameOver = true;
+		std::cout << "You WON!" << std::endl;
 	}
 
 	void Game::process_input()
@@ -371,9 +850,11 @@ namespace chess
 			break;
 		case PS_DECIDED:
 			auto promPoses = chessEngine.get_waiting_for_promotion();
-			client.send<std::string>(std::string("PROM ") + std::to_string(chessEngine.reverse(promPoses.from)) + " " + std::to_string(chessEngine.reverse(promPoses.to)) + " " + to_str(promotion.result));
+			client.send(protocol::encode_frame(protocol::MSG_PROMOTE, protocol::PromoteMessage{ .player = static_cast<uint8_t>(player), .from = static_cast<uint8_t>(orient(promPoses.from)), .to = static_cast<uint8_t>(orient(promPoses.to)), .piece = static_cast<uint8_t>(promotion.result) }));
 			chessEngine.promote(promotion.result);
+			remember_input(CMD_PROMOTE, promPoses.from, promPoses.to, promotion.result);
 			promotion.reset();
+			announce_if_won();
 		}
 
 		handle_resize();
@@ -423,6 +904,7 @@ namespace chess
 				if (click.pos.first != click.pos.second)
 				{
 					click.state = SECOND_CLICK;
+					click.madeAt = chess::GameClock::now();
 					//boardSetup[click.pos.second] = boardSetup[click.pos.first];
 					//boardSetup[click.pos.first] = EMPTY;
 				}
@@ -0,0 +1 @@
+#include "headers.h"
\ No newline at end of file
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "client.h"
+#include "engine.h"
+#include "scripted_game.h"
+
+namespace loadgen
+{
+	struct LoadConfig
+	{
+		std::string host = "127.0.0.1";
+		unsigned short port = 8080;
+
+		size_t connections = 100;
+		size_t channels = 1;          // players per connection, each on its own channel
+		double movesPerSecond = 0.5;  // per player, capped by the piece cooldowns
+		bool scripted = false;        // white plays a fixed four move win instead of random moves
+		std::chrono::seconds duration{ 30 };
+		unsigned int seed = 1;
+	};
+
+	// Percentiles of a set of latency samples, in microseconds
+	struct LatencySummary
+	{
+		size_t count = 0;
+		uint32_t p50 = 0;
+		uint32_t p99 = 0;
+		uint32_t p999 = 0;
+		uint32_t max = 0;
+
+		static LatencySummary of(std::vector<uint32_t>& samples);
+	};
+
+	// Opens many connections to a server, lets every player get matched and plays until the
+	// duration is up. Each client::Client runs its own io thread, so large player counts come
+	// from channels rather than connections.
+	class LoadGenerator
+	{
+	public:
+		LoadGenerator(const LoadConfig& config);
+
+		LoadGenerator(const LoadGenerator&) = delete;
+		LoadGenerator& operator=(const LoadGenerator&) = delete;
+
+		void run();
+
+		void print_report(std::ostream& out) const;
+
+		~LoadGenerator();
+
+	private:
+
+		using Clock = std::chrono::steady_clock;
+
+		static constexpr std::chrono::milliseconds ActInterval{ 5 };
+		static constexpr size_t MoveAttempts = 64;
+
+		struct Player
+		{
+			uint16_t channel = 0;
+			chess::ChessEngine engine;     // moves are played here before the server answers
+			chess::ChessEngine confirmed;  // only what the server accepted, a reject goes back to it
+			chess::Player side = chess::PL_WHITE;
+			bool playing = false;
+			bool relayRoom = false;
+			bool retired = false;     // channel 0 cannot be reopened, it plays one game only
+			bool awaitingMove = false;
+			chess::ToFrom pendingMove{ -1, -1 }; // the unanswered move, played again after a rollback
+			size_t scriptStep = 0;
+			Clock::time_point moveSent;
+			Clock::time_point nextMove;
+			Clock::time_point nextHeartbeat;
+		};
+
+		struct Connection
+		{
+			std::unique_ptr<client::Client> client;
+			std::mutex mutex;  // players are touched by the io thread and the acting loop
+			std::vector<Player> players;
+			bool lost = false;
+
+			// Merged into the report at the end
+			std::vector<uint32_t> moveRoundTrips;
+			uint64_t movesSent = 0;
+			uint64_t movesAccepted = 0;
+			uint64_t rejects = 0;
+			uint64_t gamesFinished = 0;
+			uint64_t framesSent = 0;
+			uint64_t framesReceived = 0;
+		};
+
+		LoadConfig config;
+		std::mt19937 rng;
+
+		std::vector<std::unique_ptr<Connection>> connections;
+
+		std::vector<uint32_t> connectLatencies;
+		size_t connectFailures = 0;
+		double elapsedSeconds = 0;
+
+		void connect_all();
+
+		void act(Connection& connection, Player& player, Clock::time_point now);
+
+		void handle_frame(Connection& connection, const std::vector<uint8_t>& frame);
+
+		bool play_scripted(Connection& connection, Player& player);
+		bool play_random(Connection& connection, Player& player);
+
+		void game_ended(Connection& connection, Player& player);
+
+		void send(Connection& connection, Player& player, const std::vector<uint8_t>& frame);
+
+		Clock::duration move_interval();
+
+		int orient(const Player& player, int square) const;
+	};
+}
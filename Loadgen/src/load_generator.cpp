@@ -0,0 +1,441 @@
+#include "headers.h"
+#include "load_generator.h"
+
+namespace loadgen
+{
+	LatencySummary LatencySummary::of(std::vector<uint32_t>& samples)
+	{
+		LatencySummary summary;
+		summary.count = samples.size();
+		if (samples.empty())
+			return summary;
+
+		std::sort(samples.begin(), samples.end());
+
+		auto at = [&samples](double quantile)
+			{
+				size_t index = static_cast<size_t>(quantile * samples.size());
+				return samples[std::min(index, samples.size() - 1)];
+			};
+
+		summary.p50 = at(0.5);
+		summary.p99 = at(0.99);
+		summary.p999 = at(0.999);
+		summary.max = samples.back();
+		return summary;
+	}
+
+	LoadGenerator::LoadGenerator(const LoadConfig& config)
+		: config(config), rng(config.seed)
+	{
+	}
+
+	void LoadGenerator::run()
+	{
+		connect_all();
+
+		Clock::time_point start = Clock::now();
+		while (Clock::now() - start < config.duration)
+		{
+			Clock::time_point now = Clock::now();
+
+			for (auto& connection : connections)
+			{
+				std::lock_guard lock(connection->mutex);
+				if (connection->lost)
+					continue;
+
+				for (Player& player : connection->players)
+					act(*connection, player, now);
+			}
+
+			std::this_thread::sleep_for(ActInterval);
+		}
+
+		elapsedSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	void LoadGenerator::print_report(std::ostream& out) const
+	{
+		std::vector<uint32_t> roundTrips;
+		uint64_t movesSent = 0, movesAccepted = 0, rejects = 0, games = 0, framesSent = 0, framesReceived = 0;
+		size_t lost = 0;
+
+		for (const auto& connection : connections)
+		{
+			std::lock_guard lock(connection->mutex);
+			roundTrips.insert(roundTrips.end(), connection->moveRoundTrips.begin(), connection->moveRoundTrips.end());
+			movesSent += connection->movesSent;
+			movesAccepted += connection->movesAccepted;
+			rejects += connection->rejects;
+			games += connection->gamesFinished;
+			framesSent += connection->framesSent;
+			framesReceived += connection->framesReceived;
+			lost += connection->lost;
+		}
+
+		std::vector<uint32_t> connects = connectLatencies;
+		LatencySummary connect = LatencySummary::of(connects);
+		LatencySummary move = LatencySummary::of(roundTrips);
+		double seconds = std::max(elapsedSeconds, 1e-9);
+
+		out << "connections " << connections.size() << " (" << connectFailures << " failed, " << lost << " lost), "
+			<< connections.size() * config.channels << " players, " << elapsedSeconds << "s" << std::endl;
+
+		out << "connect  p50 " << connect.p50 << "us, p99 " << connect.p99 << "us, p999 " << connect.p999 << "us, max " << connect.max << "us" << std::endl;
+
+		out << "move rtt p50 " << move.p50 << "us, p99 " << move.p99 << "us, p999 " << move.p999 << "us, max " << move.max
+			<< "us over " << move.count << " answers" << std::endl;
+
+		out << "moves " << movesSent << " sent, " << movesAccepted << " accepted, " << rejects << " rejected (" << movesAccepted / seconds << " accepted/s), "
+			<< "games " << games << " (" << games / seconds << "/s), frames " << framesSent / seconds << "/s out, " << framesReceived / seconds << "/s in" << std::endl;
+	}
+
+	LoadGenerator::~LoadGenerator()
+	{
+		// Clients go first, their io threads call back into the connections
+		for (auto& connection : connections)
+			connection->client.reset();
+	}
+
+	void LoadGenerator::connect_all()
+	{
+		for (size_t i = 0; i < config.connections; i++)
+		{
+			auto connection = std::make_unique<Connection>();
+			connection->players.resize(config.channels);
+			for (size_t channel = 0; channel < config.channels; channel++)
+				connection->players[channel].channel = static_cast<uint16_t>(channel);
+
+			connection->client = std::make_unique<client::Client>(config.host, config.port);
+
+			Connection* raw = connection.get();
+			connection->client->set_on_message_received([this, raw](const std::vector<uint8_t>& frame)
+				{
+					handle_frame(*raw, frame);
+				});
+
+			Clock::time_point started = Clock::now();
+			if (connection->client->connect() != client::ClientError::None)
+			{
+				connectFailures++;
+				continue;
+			}
+
+			connectLatencies.push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count()));
+
+			// Every player is queued by its first frame, on channels above 0 that also opens the channel
+			std::lock_guard lock(connection->mutex);
+			for (Player& player : connection->players)
+			{
+				player.nextHeartbeat = Clock::now() + std::chrono::milliseconds(protocol::HeartbeatIntervalMs);
+				send(*connection, player, protocol::encode_frame(protocol::MSG_HEARTBEAT));
+			}
+
+			connections.push_back(std::move(connection));
+		}
+	}
+
+	void LoadGenerator::act(Connection& connection, Player& player, Clock::time_point now)
+	{
+		if (now >= player.nextHeartbeat)
+		{
+			send(connection, player, protocol::encode_frame(protocol::MSG_HEARTBEAT));
+			player.nextHeartbeat = now + std::chrono::milliseconds(protocol::HeartbeatIntervalMs);
+		}
+
+		if (!player.playing || player.awaitingMove || now < player.nextMove)
+			return;
+
+		player.engine.check_timeouts();
+
+		bool moved = config.scripted ? play_scripted(connection, player) : play_random(connection, player);
+		if (!moved)
+		{
+			player.nextMove = now + ActInterval;
+			return;
+		}
+
+		connection.movesSent++;
+
+		// Relay rooms echo nothing back, so there is no round trip to time and nothing to confirm
+		if (player.relayRoom)
+		{
+			player.confirmed = player.engine;
+			player.pendingMove = { -1, -1 };
+
+			if (player.engine.did_other_lose())
+			{
+				send(connection, player, protocol::encode_frame(protocol::MSG_GAME_OVER, protocol::GameOverMessage{ static_cast<uint8_t>(player.side) }));
+				connection.gamesFinished++;
+				game_ended(connection, player);
+			}
+		}
+		else
+		{
+			player.awaitingMove = true;
+			player.moveSent = now;
+		}
+
+		player.nextMove = now + move_interval();
+	}
+
+	void LoadGenerator::handle_frame(Connection& connection, const std::vector<uint8_t>& frame)
+	{
+		std::lock_guard lock(connection.mutex);
+
+		if (frame.empty())
+		{
+			connection.lost = true;
+			return;
+		}
+
+		connection.framesReceived++;
+
+		protocol::FrameHeader header = protocol::frame_header(frame);
+		if (header.channel >= connection.players.size())
+			return;
+
+		Player& player = connection.players[header.channel];
+		bool own = false;
+
+		switch (header.type)
+		{
+		case protocol::MSG_START:
+		{
+			protocol::StartMessage start{};
+			if (!protocol::decode_payload(frame, start))
+				break;
+
+			player.side = static_cast<chess::Player>(start.player);
+			player.engine = chess::ChessEngine(player.side, protocol::MoveCooldownMs);
+			player.confirmed = player.engine;
+			player.playing = true;
+			player.relayRoom = (header.flags & protocol::FLAG_RELAY) != 0;
+			player.awaitingMove = false;
+			player.pendingMove = { -1, -1 };
+			player.scriptStep = 0;
+			player.nextMove = Clock::now();
+			break;
+		}
+		case protocol::MSG_MOVE:
+		{
+			protocol::MoveMessage move{};
+			if (!protocol::decode_payload(frame, move))
+				break;
+
+			own = move.player == player.side;
+			if (own)
+			{
+				// The server judged the cooldown on its clock, one not quite over here must not refuse the move
+				connection.movesAccepted++;
+				player.confirmed.expire_timeout(orient(player, move.from));
+				player.confirmed.move_piece(orient(player, move.from), orient(player, move.to));
+				player.pendingMove = { -1, -1 };
+				break;
+			}
+
+			for (chess::ChessEngine* board : { &player.engine, &player.confirmed })
+				board->opponent_move(orient(player, move.from), orient(player, move.to));
+			break;
+		}
+		case protocol::MSG_WALL:
+		{
+			protocol::WallMessage wall{};
+			if (!protocol::decode_payload(frame, wall) || wall.player == player.side)
+				break;
+
+			for (chess::ChessEngine* board : { &player.engine, &player.confirmed })
+				board->build_wall_opponent(orient(player, wall.place), orient(player, wall.direction));
+			break;
+		}
+		case protocol::MSG_PROMOTE:
+		{
+			protocol::PromoteMessage promote{};
+			if (!protocol::decode_payload(frame, promote))
+				break;
+
+			if (promote.player == player.side)
+			{
+				player.confirmed.promote(static_cast<chess::PromotionResult>(promote.piece));
+				break;
+			}
+
+			for (chess::ChessEngine* board : { &player.engine, &player.confirmed })
+				board->opponent_promote({ orient(player, promote.from), orient(player, promote.to) }, static_cast<chess::PromotionResult>(promote.piece));
+			break;
+		}
+		case protocol::MSG_EN_PASSANT:
+		{
+			protocol::EnPassantMessage enPassant{};
+			if (!protocol::decode_payload(frame, enPassant) || enPassant.player == player.side)
+				break;
+
+			for (chess::ChessEngine* board : { &player.engine, &player.confirmed })
+				board->add_en_passent_oppertunity(orient(player, enPassant.underPosition), protocol::from_wire16(enPassant.whenImplemented));
+			break;
+		}
+		case protocol::MSG_REJECT:
+		{
+			// Our board ran ahead of the server's, e.g. the opponent got to a square first
+			protocol::RejectMessage reject{};
+			own = protocol::decode_payload(frame, reject) && reject.requestType == protocol::MSG_MOVE;
+			connection.rejects++;
+
+			// Back to the server's board. A rejected move is dropped, a scripted one is tried again;
+			// one still unanswered after some other request was rejected is played again.
+			player.engine = player.confirmed;
+			if (own)
+			{
+				player.pendingMove = { -1, -1 };
+				if (config.scripted && player.scriptStep > 0)
+					player.scriptStep--;
+			}
+			else if (player.pendingMove.from != -1)
+			{
+				player.engine.move_piece(player.pendingMove.from, player.pendingMove.to);
+			}
+			break;
+		}
+		case protocol::MSG_GAME_OVER:
+		{
+			protocol::GameOverMessage over{};
+			if (protocol::decode_payload(frame, over) && over.winner == player.side)
+				connection.gamesFinished++;
+			game_ended(connection, player);
+			break;
+		}
+		case protocol::MSG_OPPONENT_LEFT:
+		case protocol::MSG_ROOM_CLOSED:
+			game_ended(connection, player);
+			break;
+		case protocol::MSG_CLOSE_CHANNEL:
+		{
+			// The server dropped this player; the next frame on the channel is a new one
+			player.playing = false;
+			player.awaitingMove = false;
+			send(connection, player, protocol::encode_frame(protocol::MSG_HEARTBEAT));
+			break;
+		}
+		default:
+			break;
+		}
+
+		if (own && player.awaitingMove)
+		{
+			player.awaitingMove = false;
+			connection.moveRoundTrips.push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - player.moveSent).count()));
+		}
+	}
+
+	bool LoadGenerator::play_scripted(Connection& connection, Player& player)
+	{
+		if (player.side != chess::PL_WHITE || player.scriptStep >= chess::WhiteScript.size())
+			return false;
+
+		auto [from, to] = chess::WhiteScript[player.scriptStep];
+
+		// The local engine keeps the script to the piece cooldowns
+		if (player.engine.move_piece(from, to) == chess::MOVE_INVALID)
+			return false;
+
+		send(connection, player, protocol::encode_frame(protocol::MSG_MOVE, protocol::MoveMessage{ .player = static_cast<uint8_t>(player.side), .from = from, .to = to }));
+		player.pendingMove = { from, to };
+		player.scriptStep++;
+		return true;
+	}
+
+	bool LoadGenerator::play_random(Connection& connection, Player& player)
+	{
+		chess::ChessEngine& engine = player.engine;
+
+		std::vector<int> pieces;
+		for (int i = 0; i < 64; i++)
+		{
+			if (engine.valid_piece(i))
+				pieces.push_back(i);
+		}
+		if (pieces.empty())
+			return false;
+
+		// Random targets are mostly illegal, a bounded number of tries keeps a blocked side cheap
+		std::uniform_int_distribution<size_t> pickPiece(0, pieces.size() - 1);
+		std::uniform_int_distribution<int> pickSquare(0, 63);
+
+		for (size_t attempt = 0; attempt < MoveAttempts; attempt++)
+		{
+			int from = pieces[pickPiece(rng)];
+			int to = pickSquare(rng);
+
+			chess::MoveState state = engine.move_piece(from, to);
+			if (state == chess::MOVE_INVALID)
+				continue;
+
+			// Relay rooms do not validate, so the mover announces en passant itself like the game does
+			if (player.relayRoom && state == chess::MOVE_EN_PASSENT_OPPORTUNITY)
+			{
+				int under = engine.get_under_position_of(to);
+				protocol::EnPassantMessage enPassant{ static_cast<uint8_t>(player.side), static_cast<uint8_t>(orient(player, under)), protocol::to_wire16(static_cast<uint16_t>(engine.get_game_moves_count())) };
+				send(connection, player, protocol::encode_frame(protocol::MSG_EN_PASSANT, enPassant));
+			}
+
+			send(connection, player, protocol::encode_frame(protocol::MSG_MOVE, protocol::MoveMessage{ .player = static_cast<uint8_t>(player.side), .from = static_cast<uint8_t>(orient(player, from)), .to = static_cast<uint8_t>(orient(player, to)) }));
+			player.pendingMove = { from, to };
+
+			// A pawn on the last rank always becomes a queen
+			chess::ToFrom waiting = engine.get_waiting_for_promotion();
+			if (waiting.to != -1)
+			{
+				engine.promote(chess::PR_QUEEN);
+				protocol::PromoteMessage promote{ .player = static_cast<uint8_t>(player.side), .from = static_cast<uint8_t>(orient(player, waiting.from)), .to = static_cast<uint8_t>(orient(player, waiting.to)), .piece = chess::PR_QUEEN };
+				send(connection, player, protocol::encode_frame(protocol::MSG_PROMOTE, promote));
+			}
+
+			return true;
+		}
+
+		return false;
+	}
+
+	void LoadGenerator::game_ended(Connection& connection, Player& player)
+	{
+		player.playing = false;
+		player.awaitingMove = false;
+		player.pendingMove = { -1, -1 };
+
+		if (player.channel == 0)
+		{
+			player.retired = true;
+			return;
+		}
+
+		// Closing and reopening the channel puts a fresh player in the matchmaking queue
+		send(connection, player, protocol::encode_frame(protocol::MSG_CLOSE_CHANNEL));
+		send(connection, player, protocol::encode_frame(protocol::MSG_HEARTBEAT));
+	}
+
+	void LoadGenerator::send(Connection& connection, Player& player, const std::vector<uint8_t>& frame)
+	{
+		connection.framesSent++;
+
+		if (player.channel == 0)
+			connection.client->send(frame);
+		else
+			connection.client->send_on(player.channel, frame);
+	}
+
+	LoadGenerator::Clock::duration LoadGenerator::move_interval()
+	{
+		if (config.movesPerSecond <= 0)
+			return std::chrono::hours(1);
+
+		// Spread around the mean so players do not move in lockstep
+		double seconds = std::uniform_real_distribution<double>(0.5, 1.5)(rng) / config.movesPerSecond;
+		return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+	}
+
+	int LoadGenerator::orient(const Player& player, int square) const
+	{
+		return protocol::orient(square, player.side == chess::PL_WHITE);
+	}
+}
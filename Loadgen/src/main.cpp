@@ -0,0 +1,33 @@
+#include "headers.h"
+#include "load_generator.h"
+
+int main(int argc, char** argv)
+{
+	loadgen::LoadConfig config;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "--host" && i + 1 < argc)
+			config.host = argv[++i];
+		else if (arg == "--port" && i + 1 < argc)
+			config.port = static_cast<unsigned short>(std::stoul(argv[++i]));
+		else if (arg == "--connections" && i + 1 < argc)
+			config.connections = std::stoul(argv[++i]);
+		else if (arg == "--channels" && i + 1 < argc)
+			config.channels = std::max<size_t>(1, std::stoul(argv[++i]));
+		else if (arg == "--rate" && i + 1 < argc)
+			config.movesPerSecond = std::stod(argv[++i]);
+		else if (arg == "--scripted")
+			config.scripted = true;
+		else if (arg == "--duration" && i + 1 < argc)
+			config.duration = std::chrono::seconds(std::stoul(argv[++i]));
+		else if (arg == "--seed" && i + 1 < argc)
+			config.seed = static_cast<unsigned int>(std::stoul(argv[++i]));
+	}
+
+	loadgen::LoadGenerator generator(config);
+	generator.run();
+	generator.print_report(std::cout);
+}
@@ -14,6 +14,7 @@ project "Server"
         "%{IncludeDir.ASIO}",
         "global",            
         "include",           
+        "../Shared/include",
         "src"
     }
 
@@ -25,7 +26,9 @@ project "Server"
         "include/**.h",           
         "include/**.inl", 
         "global/**.h",
-        "global/**.cpp"
+        "global/**.cpp",
+        "../Shared/include/**.h",
+        "../Shared/src/**.cpp"
     }
 
 
@@ -73,5 +76,14 @@ project "Server"
     filter "system:linux or toolset:gcc or toolset:clang"
         buildoptions { "-include pch.h" }
     
+    -- asio picks its reactor at compile time, so io_uring is a build option rather than a flag
+    filter { "system:linux", "options:io-uring" }
+        defines { "ASIO_HAS_IO_URING", "ASIO_DISABLE_EPOLL" }
+        links { "uring" }
+
+    -- Tracepoints are nops until a tracer attaches, but only exist in builds that ask for them
+    filter { "system:linux", "options:usdt" }
+        defines "FORTCHESS_USDT"
+
     filter "files:global/headers.cpp"   
         buildoptions { "/Ycheaders.h" }
\ No newline at end of file
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace server
+{
+	// What an event's code, a and b hold is noted per kind, client is the session it is about
+	enum FlightEventKind : uint16_t
+	{
+		FE_NONE = 0,          // a slot that was never written
+		FE_ACCEPT,            // a = the connection of a channel
+		FE_CLOSE,
+		FE_FRAME_IN,          // code = frame type, a = frame size
+		FE_RELAYED,           // code = frame type, a = peer
+		FE_REQUEST,           // code = frame type, a = room's verdict, b = room
+		FE_ROOM_CREATE,       // client = white, a = black, b = room
+		FE_ROOM_DESTROY,      // b = room
+		FE_RELAY_START,       // a = peer
+		FE_RELAY_STOP,
+		FE_MIGRATE,           // a = new id, b = target shard
+		FE_READ_ERROR,        // a = error value
+		FE_WRITE_ERROR,       // a = error value
+		FE_MALFORMED_FRAME,
+		FE_OUTBOX_OVERFLOW,   // a = bytes queued
+		FE_KIND_COUNT
+	};
+
+	struct FlightEvent
+	{
+		int64_t time;    // system_clock nanoseconds since the epoch
+		uint32_t client;
+		uint16_t kind;
+		uint16_t code;
+		uint64_t a;
+		uint64_t b;
+	};
+
+	static_assert(sizeof(FlightEvent) == 32, "FlightEvent is written to dumps as is");
+
+	// The last `capacity` events of one shard. Written by its shard's thread only, with no lock
+	// and no read-modify-write; a dump taken while the shard runs may catch one event half written.
+	class alignas(64) ShardRecorder
+	{
+	public:
+		explicit ShardRecorder(size_t capacity);
+
+		void record(FlightEventKind kind, uint32_t client, uint16_t code = 0, uint64_t a = 0, uint64_t b = 0)
+		{
+			uint64_t next = _next.load(std::memory_order_relaxed);
+
+			FlightEvent& event = _events[next & _mask];
+			event.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			event.client = client;
+			event.kind = kind;
+			event.code = code;
+			event.a = a;
+			event.b = b;
+
+			_next.store(next + 1, std::memory_order_release);
+		}
+
+	private:
+		friend class FlightRecorder;
+
+		std::unique_ptr<FlightEvent[]> _events;
+		size_t _mask;
+		std::atomic<uint64_t> _next = 0; // events ever recorded
+	};
+
+	// Always on: every shard keeps its recent protocol events, state changes and errors in a
+	// fixed ring, and all rings can be written to one binary file at any time, including from a
+	// signal handler after a crash. read_dump turns such a file back into text.
+	class FlightRecorder
+	{
+	public:
+		FlightRecorder(size_t shardCount, size_t eventsPerShard);
+
+		FlightRecorder(const FlightRecorder&) = delete;
+		FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+		ShardRecorder& shard(size_t shard);
+
+		// Only calls that are safe in a signal handler
+		bool dump(const char* path) const;
+
+		// Dumps to `path` on a fatal signal before the process dies, and on SIGUSR1 where there is
+		// one. One recorder per process, the last to install it gets it.
+		void install_crash_handler(const std::string& path);
+
+		// Gives the calling thread its own stack to run the crash handler on, so a stack overflow
+		// still gets dumped. Once per thread, every shard thread calls it; nothing on Windows.
+		static void install_signal_stack();
+
+		// Events of all shards in time order, false when the file is not a dump
+		static bool read_dump(const std::string& path, std::ostream& out);
+
+		~FlightRecorder();
+
+	private:
+		std::vector<std::unique_ptr<ShardRecorder>> _shards;
+		size_t _capacity;
+	};
+}
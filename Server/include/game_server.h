@@ -1,7 +1,16 @@
 #pragma once
 
 
+#include "clock_sync.h"
+#include "hdr_histogram.h"
 #include "server.h"
+#include "match_broker.h"
+#include "room_registry.h"
+#include "timing_wheel.h"
+
+#include <list>
+#include <mutex>
+#include <unordered_set>
 
 namespace game
 {
@@ -13,26 +22,186 @@ namespace game
 
 		void remove_player(uint32_t id);
 
-		void set_callback(std::function<void(std::vector<uint32_t>&)> cb);
+		bool contains(uint32_t id) const;
+
+		size_t size() const;
+
+		void set_callback(std::function<void(uint32_t, uint32_t)> cb);
 
 	private:
-		std::vector<uint32_t> players;
-		std::function<void(std::vector<uint32_t>&)> callback;
+		// FIFO of waiting clients, indexed so a disconnect can leave the queue in O(1)
+		std::list<uint32_t> players;
+		std::unordered_map<uint32_t, std::list<uint32_t>::iterator> positions;
+		std::function<void(uint32_t, uint32_t)> callback;
+	};
+
+	enum TimerKind : uint8_t
+	{
+		TM_NONE = 0,
+		TM_HEARTBEAT,   // a client went silent
+		TM_RESUME,      // a dropped player's grace window in room `id` may have run out
+	};
+
+	struct TimerEvent
+	{
+		TimerKind kind = TM_NONE;
+		uint32_t id = 0;
 	};
 
+	using TimerWheel = server::TimingWheel<TimerEvent>;
+
 	class GameServer
 	{
 	public:
-		GameServer(unsigned short port);
-		
-		~GameServer() = default;
+		// With a broker path the server joins a match broker and can pair players with other processes.
+		// Without move validation rooms only relay frames between the players, in the kernel where
+		// both sit on one shard.
+		GameServer(unsigned short port, const server::ServerConfig& config = {}, const std::string& brokerPath = "", bool validateMoves = true);
+
+		// One line of network totals, for benchmarks comparing event backends, and the server's
+		// share of move latency over all sessions
+		void print_stats(std::ostream& out) const;
+
+		// The server's share of move latency per connected session, in microseconds
+		void print_latency(std::ostream& out) const;
+
+		// Simulated servers only (see ServerConfig::simulated): a new player on a loopback link
+		std::shared_ptr<transport::LoopbackLink> connect_loopback();
+
+		// Simulated servers only: turns every shard's timers to GameClock::now() and runs what is ready
+		size_t poll();
+
+		~GameServer();
 
 	private:
 
+		static constexpr std::chrono::milliseconds TimerTick{ 10 };
+		static constexpr std::chrono::minutes IdleRoomTimeout{ 10 };
+		static constexpr std::chrono::seconds IdleScanInterval{ 1 };
+
+		// One wheel per io shard, turned by a single steady_timer on that shard. The same tick
+		// runs the batched room passes. Ticks are counted on the GameClock, so a simulation
+		// turns the wheels by advancing virtual time and calling poll().
+		struct ShardTimers
+		{
+			TimerWheel wheel;
+			std::unordered_map<uint32_t, TimerWheel::Handle> heartbeats;
+			asio::steady_timer ticker;
+			chess::GameClock::time_point start;
+			uint64_t lastIdleScan = 0;
+			std::vector<uint32_t> idleRooms;
+
+			ShardTimers(asio::io_context& context)
+				: ticker(context), start(chess::GameClock::now()) {
+			}
+		};
+
 		server::Server server;
 
-		std::pair<uint32_t, uint32_t> clientIds = { 0, 0 };
+		bool validateMoves = true;
+		bool simulated = false;
 
+		std::vector<RoomRegistry> shardRooms;
+
+		std::vector<std::unique_ptr<ShardTimers>> shardTimers;
+
+		std::mutex matchmakingMutex;
 		Players openPlayerIds;
+
+		// Per shard, clients that have not sent a frame yet and so are in no queue or room
+		std::vector<std::unordered_set<uint32_t>> newcomers;
+
+		// Server side of one player's move latency in microseconds: from its request leaving the
+		// client to the socket read here, and from there to the event leaving the room
+		struct MoveLatency
+		{
+			metrics::HdrHistogram sendToServer;
+			metrics::HdrHistogram serverQueue;
+
+			void merge(const MoveLatency& other);
+		};
+
+		// Per shard of the mover. Recorded on the room's shard and dropped on the mover's, so
+		// guarded; the lock is only ever contended by a stats dump.
+		struct ShardLatency
+		{
+			mutable std::mutex mutex;
+			std::unordered_map<uint32_t, MoveLatency> sessions;
+			MoveLatency closed;
+		};
+
+		std::vector<std::unique_ptr<ShardLatency>> shardLatency;
+
+		void record_move_latency(uint32_t clientId, const protocol::MoveTrace& trace);
+		void close_move_latency(uint32_t clientId);
+
+#ifndef PLATFORM_WINDOWS
+		std::unique_ptr<server::BrokerLink> broker;
+
+		void handle_broker_message(const server::BrokerMessage& message, int attachedFd);
+#endif
+
+		// Call with matchmakingMutex held
+		void enqueue_player(uint32_t clientId);
+		void dequeue_player(uint32_t clientId);
+
+		void begin_match(uint32_t whiteId, uint32_t blackId);
+
+		void start_match(uint32_t whiteId, uint32_t blackId);
+
+		// Runs on the room's shard, so requests from both players are ordered by arrival there
+		void handle_match_request(uint32_t clientId, const RoomRoute& route, const std::vector<uint8_t>& frame, chess::GameClock::time_point received);
+
+		// Runs on the spectator's shard, the room is looked up on its own
+		void handle_spectate(uint32_t clientId, const std::vector<uint8_t>& frame);
+
+		// Runs on the room's shard
+		void add_spectator(uint32_t clientId, const RoomRoute& route);
+
+		void forget_spectator(uint32_t clientId, const RoomRoute& route);
+
+		// Accepted events go to every spectator as one shared buffer, with the board after them
+		// as the resync for spectators too far behind to get them all
+		void send_to_spectators(size_t shard, uint32_t roomIndex, const std::vector<uint8_t>& frames);
+
+		server::Server::SharedFrames snapshot_frame(size_t shard, uint32_t roomIndex) const;
+
+		// Runs on the client's shard, moves it to the room's shard and gives it its seat back
+		void handle_resume(uint32_t clientId, const std::vector<uint8_t>& frame);
+
+		void resume_seat(size_t shard, uint32_t clientId, uint32_t roomIndex, uint32_t secret);
+
+		// Runs on the room's shard: holds the seat for ResumeGraceMs instead of ending the game
+		void seat_left(const RoomRoute& route, uint32_t clientId);
+
+		void expire_seats(size_t shard, uint32_t roomIndex);
+
+		// [room shard 8 | room index 24 | seat secret 32], 0 for rooms past what the layout holds
+		uint64_t resume_token(size_t shard, uint32_t roomIndex, chess::Player side) const;
+
+		// Relay rooms: keeps the room alive and ends it when a player announces game over
+		void handle_relayed_frame(const RoomRoute& route, uint8_t type);
+
+		void finish_match(size_t currentShard, const RoomRoute& route);
+
+		void end_match(size_t shard, uint32_t roomIndex, uint32_t generation);
+
+		void requeue(uint32_t clientId);
+
+		void start_ticker(size_t shard);
+
+		void tick(size_t shard);
+
+		void handle_timer(size_t shard, const TimerEvent& event);
+
+		void run_room_passes(size_t shard, uint64_t tick);
+
+		void close_idle_room(size_t shard, uint32_t roomIndex);
+
+		static uint64_t to_ticks(std::chrono::milliseconds duration);
+
+		// Shard thread only: pushes back the client's heartbeat deadline
+		void touch_client(uint32_t clientId);
+		void forget_client(uint32_t clientId);
 	};
 }
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace server
+{
+	struct ShardLoad
+	{
+		double cpuSeconds = 0;   // CPU time the shard thread has used
+		double wallSeconds = 0;  // time since the shard started
+		uint64_t polls = 0;      // busy poll mode only
+		uint64_t idlePolls = 0;  // polls that found nothing to run
+	};
+
+	// One io_context per shard, each run by exactly one thread. Work posted to a
+	// shard never runs concurrently with other work of the same shard.
+	// In busy poll mode the threads spin on poll() instead of sleeping in run(), trading a full
+	// core per shard for not paying the wake-up on every event.
+	class IoContextPool
+	{
+	public:
+		// A shardCount of 0 means one shard per hardware thread, at most maxDefaultShards
+		IoContextPool(size_t shardCount, bool pinThreads = false, bool busyPoll = false, size_t maxDefaultShards = SIZE_MAX);
+
+		IoContextPool(const IoContextPool&) = delete;
+		IoContextPool& operator=(const IoContextPool&) = delete;
+
+		void run();
+
+		void stop();
+
+		size_t size() const;
+
+		asio::io_context& get_context(size_t shard);
+
+		// Round-robin shard for newly accepted sockets
+		size_t next_shard();
+
+		bool running_in_shard(size_t shard) const;
+
+		ShardLoad load(size_t shard) const;
+
+		~IoContextPool();
+
+	private:
+
+		struct Shard
+		{
+			asio::io_context ioContext;
+			asio::executor_work_guard<asio::io_context::executor_type> workGuard;
+			std::thread thread;
+			std::chrono::steady_clock::time_point started;
+			std::atomic<uint64_t> polls = 0;
+			std::atomic<uint64_t> idlePolls = 0;
+
+			Shard()
+				: ioContext(1), workGuard(asio::make_work_guard(ioContext))
+			{
+			}
+		};
+
+		std::vector<std::unique_ptr<Shard>> _shards;
+
+		std::atomic<size_t> _nextShard = 0;
+
+		bool _pinThreads = false;
+		bool _busyPoll = false;
+
+		static void pin_current_thread(size_t core);
+
+		static void busy_poll(Shard& shard);
+
+		static double thread_cpu_seconds(std::thread& thread);
+	};
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <asio.hpp>
+
+#include <cstdint>
+#include <string>
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+
+namespace server
+{
+	// The socket file a local acceptor's bind created, so that only this file is ever removed and
+	// never one a newer process bound at the same path
+	struct LocalSocketFile
+	{
+		std::string path;
+		uint64_t device = 0;
+		uint64_t inode = 0;
+
+		// Unlinks the path while it is still our file
+		void remove() const;
+	};
+
+	// Opens, binds and listens on `path`. A socket left behind by a process that did not shut down
+	// cleanly is removed first; anything else at the path, or a socket something still accepts on,
+	// is not ours and throws.
+	LocalSocketFile bind_local_acceptor(asio::local::stream_protocol::acceptor& acceptor, const std::string& path);
+}
+
+#endif
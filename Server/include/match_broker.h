@@ -0,0 +1,150 @@
+#pragma once
+
+#include <asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "local_socket.h"
+
+// Cross-process matchmaking for servers sharing a port with SO_REUSEPORT. Every worker
+// process keeps its own sessions and rooms; a small broker on a Unix socket pairs players
+// waiting in different workers and moves one player's socket (SCM_RIGHTS) to the other's.
+
+#ifndef PLATFORM_WINDOWS
+
+namespace server
+{
+	enum BrokerMessageType : uint32_t
+	{
+		BRK_NONE = 0,
+		BRK_WAITING,        // worker -> broker: ticket waits for an opponent
+		BRK_CANCEL,         // worker -> broker: ticket was matched locally or left
+		BRK_SEND,           // broker -> worker: hand ticket over, its opponent is peerTicket
+		BRK_HANDOFF,        // worker -> broker: socket of ticket attached
+		BRK_HANDOFF_FAILED, // worker -> broker: ticket is gone
+		BRK_ADOPT,          // broker -> worker: socket attached, its opponent is peerTicket (0 = none)
+	};
+
+	struct BrokerMessage
+	{
+		uint32_t type = BRK_NONE;
+		uint32_t ticket = 0;
+		uint32_t peerTicket = 0;
+		uint32_t reserved = 0;
+	};
+
+	class MatchBroker
+	{
+	public:
+		MatchBroker(const std::string& path);
+
+		MatchBroker(const MatchBroker&) = delete;
+		MatchBroker& operator=(const MatchBroker&) = delete;
+
+		// Blocks until stop()
+		void run();
+
+		void stop();
+
+		~MatchBroker();
+
+	private:
+
+		struct Waiting
+		{
+			uint32_t worker;
+			uint32_t ticket;
+		};
+
+		asio::io_context _ioContext;
+		asio::local::stream_protocol::acceptor _acceptor;
+		LocalSocketFile _socketFile;
+
+		std::unordered_map<uint32_t, std::shared_ptr<asio::local::stream_protocol::socket>> _workers;
+
+		std::deque<Waiting> _waiting;
+
+		// (worker, ticket) asked to hand over -> the waiting opponent it goes to
+		std::unordered_map<uint64_t, Waiting> _pendingHandoffs;
+
+		uint32_t _nextWorkerId = 0;
+
+		void start_accept();
+
+		void start_read(uint32_t worker);
+
+		void handle_message(uint32_t worker, const BrokerMessage& message, int attachedFd);
+
+		void send(uint32_t worker, const BrokerMessage& message, int attachedFd = -1);
+
+		void drop_worker(uint32_t worker);
+
+		static uint64_t key(uint32_t worker, uint32_t ticket);
+	};
+
+	class BrokerLink
+	{
+	public:
+		BrokerLink(const std::string& path, std::function<void(const BrokerMessage&, int)> onMessage);
+
+		BrokerLink(const BrokerLink&) = delete;
+		BrokerLink& operator=(const BrokerLink&) = delete;
+
+		bool connect();
+
+		// Thread safe and never blocks: the message is queued and written by the link's io thread.
+		// `attachedFd` is duplicated, the caller keeps its copy.
+		void send(const BrokerMessage& message, int attachedFd = -1);
+
+		void stop();
+
+		~BrokerLink();
+
+	private:
+
+		std::string _path;
+
+		std::thread _ioThread;
+		asio::io_context _ioContext;
+		asio::local::stream_protocol::socket _socket;
+
+		struct Outgoing
+		{
+			BrokerMessage message;
+			int attachedFd; // our own duplicate, closed once sent
+		};
+
+		std::mutex _sendMutex;
+		std::deque<Outgoing> _outbox;
+		std::atomic<bool> _linked = false;
+
+		std::function<void(const BrokerMessage&, int)> _onMessage;
+
+		void start_read();
+
+		// Io thread: writes the queued messages, a broker that stops reading ends the link
+		void flush_outbox();
+
+		void close_outbox();
+	};
+
+	// How long either end waits for the other to take a message before giving up on it, so one
+	// stalled process cannot hold up the rest
+	constexpr std::chrono::milliseconds BrokerSendTimeout{ 1000 };
+
+	// Helpers shared by both ends of the broker socket; false when the peer did not take the
+	// message within `timeout` or the link is broken
+	bool send_broker_message(int fd, const BrokerMessage& message, int attachedFd, std::chrono::milliseconds timeout = BrokerSendTimeout);
+
+	// Returns false when the peer closed or the stream broke; `attachedFd` is -1 if nothing was attached
+	bool receive_broker_message(int fd, BrokerMessage& message, int& attachedFd, bool& wouldBlock);
+}
+
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "clock_sync.h"
+#include "engine.h"
+#include "protocol.h"
+
+#include <array>
+#include <vector>
+
+namespace game
+{
+	enum MatchResult
+	{
+		MR_ACCEPTED = 0,
+		MR_REJECTED,
+		MR_GAME_OVER,
+	};
+
+	// Compact copy of a board in white's orientation: one bitboard per piece type (index
+	// piece - 1) and the inner walls as two planes, bit i set when square i has a wall below
+	// or to its right
+	struct BoardPlanes
+	{
+		std::array<uint64_t, 12> pieces{};
+		uint64_t wallsBelow = 0;
+		uint64_t wallsRight = 0;
+	};
+
+	// Authoritative board of one room. Each side keeps its own engine so a request is checked
+	// from the mover's perspective with exactly the rules its client ran, then mirrored to the
+	// other side. Requests are applied in the order the room's shard receives them.
+	class MatchState
+	{
+	public:
+		struct Cooldown
+		{
+			chess::Player player;
+			int position;
+		};
+
+		MatchState();
+
+		MatchState(MatchState&&) noexcept = default;
+		MatchState& operator=(MatchState&&) noexcept = default;
+
+		void reset();
+
+		// Accepted events are appended to `broadcast` for both players, a rejection to `reply`
+		// for the sender only. Both may hold several frames. Events are stamped with the server's
+		// clock so clients start cooldowns at the same moment, and moves carry on their trace
+		// with `received`, when the request came off the socket, and the moment they leave here.
+		MatchResult handle_request(chess::Player player, const std::vector<uint8_t>& frame, chess::GameClock::time_point received, std::vector<uint8_t>& broadcast, std::vector<uint8_t>& reply);
+
+		// Trace of the move the last request made, in host byte order, or nullptr when it was no
+		// accepted move
+		const protocol::MoveTrace* traced_move() const;
+
+		// Piece cooldowns started by the last request. The engines never expire them on their
+		// own, the caller schedules them and calls expire_cooldown when they run out.
+		const std::vector<Cooldown>& started_cooldowns() const;
+
+		void expire_cooldown(chess::Player player, int position);
+
+		void export_board(BoardPlanes& planes) const;
+
+		uint32_t sequence() const;
+
+		bool finished() const;
+
+	private:
+		std::array<chess::ChessEngine, 2> engines;
+
+		std::vector<Cooldown> startedCooldowns;
+
+		uint32_t lastSequence = 0;
+
+		// Of the request being handled, network byte order
+		uint32_t acceptedAt = 0;
+		chess::GameClock::time_point receivedAt;
+
+		protocol::MoveTrace lastTrace{};
+		bool traced = false;
+
+		bool gameOver = false;
+
+		MatchResult handle_move(chess::Player player, const std::vector<uint8_t>& frame, std::vector<uint8_t>& broadcast, std::vector<uint8_t>& reply);
+		MatchResult handle_wall(chess::Player player, const std::vector<uint8_t>& frame, std::vector<uint8_t>& broadcast, std::vector<uint8_t>& reply);
+		MatchResult handle_promote(chess::Player player, const std::vector<uint8_t>& frame, std::vector<uint8_t>& broadcast, std::vector<uint8_t>& reply);
+
+		MatchResult accept(chess::Player player, std::vector<uint8_t>& broadcast);
+
+		MatchResult reject(uint8_t requestType, uint8_t from, uint8_t to, std::vector<uint8_t>& reply);
+
+		template<typename T>
+		void append_event(protocol::MessageType type, const T& payload, std::vector<uint8_t>& broadcast);
+
+		chess::ChessEngine& opponent_of(chess::Player player);
+	};
+}
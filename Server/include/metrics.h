@@ -0,0 +1,150 @@
+#pragma once
+
+#include <asio.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hdr_histogram.h"
+
+namespace server
+{
+	enum MetricCounter : uint8_t
+	{
+		MC_ACCEPTS = 0,
+		MC_DISCONNECTS,
+		MC_FRAMES_IN,
+		MC_FRAMES_OUT,
+		MC_BYTES_IN,
+		MC_BYTES_OUT,
+		MC_COUNT
+	};
+
+	enum MetricGauge : uint8_t
+	{
+		MG_SESSIONS = 0,
+		MG_ROOMS,
+		MG_OUTBOX_BYTES,  // queued to clients and not yet written
+		MG_COUNT
+	};
+
+	// Microseconds
+	enum MetricHistogram : uint8_t
+	{
+		MH_RELAY_LATENCY = 0, // user space relay, a frame read until it is written to the peer
+		MH_ROOM_QUEUE,        // a validated request read until its room's shard picks it up
+		MH_VALIDATION,        // the room checking and applying a request
+		MH_COUNT
+	};
+
+	// Written by its shard's thread only, which never needs a lock or a read-modify-write for
+	// it: every value is an atomic it loads and stores relaxed and any thread may read. Gauges
+	// are the shard's share, the registry sums them. Aligned so shards never share a cache line.
+	struct alignas(64) ShardMetrics
+	{
+		std::array<std::atomic<uint64_t>, MC_COUNT> counters{};
+		std::array<std::atomic<int64_t>, MG_COUNT> gauges{};
+		std::array<metrics::AtomicHdrHistogram, MH_COUNT> histograms;
+
+		void add(MetricCounter counter, uint64_t amount = 1)
+		{
+			counters[counter].store(counters[counter].load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		}
+
+		void add(MetricGauge gauge, int64_t delta)
+		{
+			gauges[gauge].store(gauges[gauge].load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+		}
+
+		void set(MetricGauge gauge, int64_t value)
+		{
+			gauges[gauge].store(value, std::memory_order_relaxed);
+		}
+
+		void record(MetricHistogram histogram, std::chrono::steady_clock::duration elapsed)
+		{
+			histograms[histogram].record(static_cast<uint64_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count())));
+		}
+	};
+
+	class MetricsRegistry
+	{
+	public:
+		explicit MetricsRegistry(size_t shardCount);
+
+		MetricsRegistry(const MetricsRegistry&) = delete;
+		MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+		ShardMetrics& shard(size_t shard);
+
+		uint64_t total(MetricCounter counter) const;
+
+		// A value kept elsewhere, read on whatever thread writes the metrics out, so `read` has
+		// to be safe there. The name goes out as fortchess_<name>.
+		void add_gauge(const std::string& name, const std::string& help, std::function<int64_t()> read);
+
+		// Prometheus text format: counters and gauges per shard, histograms over all shards as summaries
+		void write_text(std::ostream& out) const;
+
+	private:
+		struct GaugeSource
+		{
+			std::string name;
+			std::string help;
+			std::function<int64_t()> read;
+		};
+
+		std::vector<std::unique_ptr<ShardMetrics>> _shards;
+
+		mutable std::mutex _sourcesMutex;
+		std::vector<GaugeSource> _sources;
+	};
+
+	// Serves a registry on its own thread, to plain HTTP GETs on a loopback port and as a file
+	// rewritten every interval. Either is off with port 0 or an empty path.
+	class MetricsExporter
+	{
+	public:
+		// Shorter intervals would rewrite the file back to back, they are raised to this
+		static constexpr std::chrono::seconds MinInterval{ 1 };
+
+		MetricsExporter(const MetricsRegistry& registry, unsigned short port, const std::string& dumpPath, std::chrono::seconds interval);
+
+		MetricsExporter(const MetricsExporter&) = delete;
+		MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+		void stop();
+
+		~MetricsExporter();
+
+	private:
+		static constexpr size_t MaxRequestBytes = 4096;
+
+		const MetricsRegistry& _registry;
+
+		asio::io_context _context;
+		asio::ip::tcp::acceptor _acceptor;
+		asio::steady_timer _dumpTimer;
+		std::thread _thread;
+
+		std::string _dumpPath;
+		std::chrono::seconds _interval;
+
+		void start_accept();
+
+		void serve(std::shared_ptr<asio::ip::tcp::socket> socket);
+
+		void schedule_dump();
+
+		// Written next to the file and renamed over it, a reader never sees half a dump
+		void write_dump();
+	};
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "match_state.h"
+
+#include <array>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace game
+{
+	struct RoomRoute
+	{
+		size_t shard = 0;
+		uint32_t room = 0;
+		uint32_t generation = 0;
+		uint32_t opponent = 0;
+	};
+
+	struct RoomStats
+	{
+		size_t rooms = 0;
+		size_t pieces = 0;
+		size_t cooldowns = 0;
+	};
+
+	// Rooms and routes of one io shard, only ever touched from that shard's thread.
+	// Rooms are stored column-wise: every field is its own array indexed by room slot, so the
+	// per-tick passes stream through just the columns they read. The engines that validate
+	// requests are cold data and only looked at when a request arrives.
+	class RoomRegistry
+	{
+	public:
+		uint32_t create_room(uint32_t white, uint32_t black, uint32_t tick);
+
+		bool destroy_room(uint32_t roomIndex, uint32_t generation);
+
+		uint32_t generation_of(uint32_t roomIndex) const;
+
+		bool is_active(uint32_t roomIndex, uint32_t generation) const;
+
+		uint32_t white_of(uint32_t roomIndex) const;
+		uint32_t black_of(uint32_t roomIndex) const;
+
+		uint32_t player_of(uint32_t roomIndex, chess::Player side) const;
+
+		// A reconnected player takes its seat back under its new id
+		void set_player(uint32_t roomIndex, chess::Player side, uint32_t clientId);
+
+		// Random per seat and room, the part of a resume token that proves who is asking
+		uint32_t secret_of(uint32_t roomIndex, chess::Player side) const;
+
+		// The tick a dropped player's seat is held until, 0 while the player is connected
+		void set_away(uint32_t roomIndex, chess::Player side, uint32_t untilTick);
+		uint32_t away_until(uint32_t roomIndex, chess::Player side) const;
+
+		MatchState& match_of(uint32_t roomIndex);
+
+		// Copies what the match just accepted into the columns and arms its new cooldowns
+		void record_update(uint32_t roomIndex, uint32_t tick, uint32_t cooldownTicks);
+
+		// Calls func(roomIndex, player, square) for every cooldown due at `tick`
+		template<typename Func>
+		void expire_cooldowns(uint32_t tick, Func&& func);
+
+		// Activity without a new board, e.g. a frame passing through a relay room
+		void touch(uint32_t roomIndex, uint32_t tick);
+
+		// Rooms with no accepted request for `idleTicks`
+		void collect_idle(uint32_t tick, uint32_t idleTicks, std::vector<uint32_t>& idleRooms) const;
+
+		RoomStats stats() const;
+
+		void add_route(uint32_t clientId, const RoomRoute& route);
+
+		void remove_route(uint32_t clientId, uint32_t roomIndex, uint32_t generation);
+
+		const RoomRoute* find_route(uint32_t clientId) const;
+
+		// Spectators are cold like the engines, only read when the room has something to send
+		void add_spectator(uint32_t roomIndex, uint32_t clientId);
+
+		void remove_spectator(uint32_t roomIndex, uint32_t generation, uint32_t clientId);
+
+		const std::vector<uint32_t>& spectators_of(uint32_t roomIndex) const;
+
+		// The room a spectator on this shard watches, which may live on another shard
+		void add_watcher(uint32_t clientId, const RoomRoute& route);
+
+		void remove_watcher(uint32_t clientId);
+
+		const RoomRoute* find_watcher(uint32_t clientId) const;
+
+		// The board from the columns, as a spectator or a reconnected player catching up gets it
+		void export_snapshot(uint32_t roomIndex, uint32_t tick, protocol::SnapshotMessage& snapshot) const;
+
+		uint32_t sequence_of(uint32_t roomIndex) const;
+
+		size_t room_count() const;
+
+	private:
+		std::vector<uint32_t> whites;
+		std::vector<uint32_t> blacks;
+		std::vector<uint32_t> generations;
+		std::array<std::vector<uint32_t>, 2> secrets;
+		std::array<std::vector<uint32_t>, 2> awayUntil;
+		std::vector<uint8_t> active;
+		std::vector<MatchState> matches;
+		std::vector<std::vector<uint32_t>> spectators;
+
+		std::vector<uint32_t> lastActivity;
+		std::vector<uint32_t> sequences;
+		std::array<std::vector<uint64_t>, 12> pieceBoards;
+		std::vector<uint64_t> wallsBelow;
+		std::vector<uint64_t> wallsRight;
+
+		// Per side: a bitboard of squares cooling down, and 64 expiry ticks per room
+		std::array<std::vector<uint64_t>, 2> cooldownMasks;
+		std::array<std::vector<uint32_t>, 2> cooldownExpiry;
+
+		std::vector<uint32_t> freeRooms;
+
+		std::unordered_map<uint32_t, RoomRoute> routes;
+		std::unordered_map<uint32_t, RoomRoute> watchers;
+
+		size_t activeRooms = 0;
+
+		std::mt19937 rng{ std::random_device{}() };
+
+		uint32_t add_slot();
+
+		void store_board(uint32_t roomIndex);
+	};
+}
+
+#include "room_registry.inl"
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "room_registry.h"
+
+#include <bit>
+
+namespace game
+{
+	template<typename Func>
+	inline void RoomRegistry::expire_cooldowns(uint32_t tick, Func&& func)
+	{
+		for (size_t side = 0; side < 2; side++)
+		{
+			std::vector<uint64_t>& masks = cooldownMasks[side];
+
+			for (size_t slot = 0; slot < masks.size(); slot++)
+			{
+				if (masks[slot] == 0)
+					continue;
+
+				uint32_t* expiry = &cooldownExpiry[side][slot * 64];
+
+				// Branch free so the compiler can vectorise the compare
+				uint64_t due = 0;
+				for (uint32_t square = 0; square < 64; square++)
+					due |= uint64_t(expiry[square] <= tick) << square;
+
+				due &= masks[slot];
+				if (due == 0)
+					continue;
+
+				masks[slot] &= ~due;
+
+				while (due)
+				{
+					uint32_t square = static_cast<uint32_t>(std::countr_zero(due));
+					due &= due - 1;
+
+					expiry[square] = 0;
+					func(static_cast<uint32_t>(slot), static_cast<chess::Player>(side), static_cast<int>(square));
+				}
+			}
+		}
+	}
+}
@@ -2,32 +2,88 @@
 
 #include <asio.hpp>
 
+#include <deque>
+#include <unordered_map>
+
+#include "flight_recorder.h"
+#include "io_context_pool.h"
+#include "local_socket.h"
+#include "loopback.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "slot_map.h"
+#include "splice_relay.h"
+
 
 
 namespace server
 {
 
+	struct ServerConfig
+	{
+		size_t shardCount = 0; // 0 = one shard per hardware thread, up to Server::MaxShards
+		bool pinThreads = false;
+		bool reusePort = false; // lets several server processes share the port
+
+		// Also accept on this Unix domain socket path, for bots and services on the same host
+		std::string localPath;
+
+		// Low latency mode: shard threads spin on pinned cores and reads ask for quick acks
+		bool busyPoll = false;
+		int busyPollMicros = 0; // SO_BUSY_POLL per session, 0 leaves the kernel default
+
+		// No sockets and no threads: clients come in over loopback links and whoever owns the
+		// server drives every shard with poll(), which makes whole runs deterministic
+		bool simulated = false;
+
+		// Metrics in Prometheus text format on 127.0.0.1:metricsPort and rewritten to
+		// metricsPath every metricsInterval, at least MetricsExporter::MinInterval; 0 and empty
+		// turn either off
+		unsigned short metricsPort = 0;
+		std::string metricsPath;
+		std::chrono::seconds metricsInterval{ 10 };
+
+		// Recent events every shard keeps for post-mortems, written to flightRecorderPath on a
+		// crash or on SIGUSR1; an empty path keeps the events but installs no handler
+		size_t flightRecorderEvents = 8192;
+		std::string flightRecorderPath = "fortchess.flight";
+	};
+
 	class Server
 	{
 	public:
 
-		Server(unsigned short port, std::function<void()> onConnect = nullptr, std::function<void()> onDisconnect = nullptr);
+		// Sessions hold generic sockets so TCP and Unix domain clients share one code path
+		using StreamSocket = asio::generic::stream_protocol::socket;
+		using NativeHandle = StreamSocket::native_handle_type;
+
+		// Immutable bytes shared by every client they go to, e.g. one encoded event for all of a room's spectators
+		using SharedFrames = std::shared_ptr<const std::vector<uint8_t>>;
+
+		Server(unsigned short port, std::function<void(uint32_t)> onConnect = nullptr, std::function<void(uint32_t)> onDisconnect = nullptr);
 
-		void set_on_disconnect(std::function<void()> callback);
+		Server(unsigned short port, const ServerConfig& config, std::function<void(uint32_t)> onConnect = nullptr, std::function<void(uint32_t)> onDisconnect = nullptr);
 
-		void set_on_connect(std::function<void()> callback);
+		void set_on_disconnect(std::function<void(uint32_t)> callback);
+
+		void set_on_connect(std::function<void(uint32_t)> callback);
 
 		size_t client_count() const;
 
-		void add_on_message_received(std::function<void(const std::vector<uint8_t>&)> callback);
+		// Called once per complete protocol frame, header included. Every channel of a connection
+		// is a client of its own with its own id, connect and disconnect callbacks; its frames
+		// arrive with the channel cleared and frames sent to it are put back on the channel.
+		void add_on_message_received(std::function<void(uint32_t, const std::vector<uint8_t>&)> callback);
 
-		void stop_accepting();
+		// Called with the header of every frame a relay moves, instead of the message callback
+		void set_on_relayed_frame(std::function<void(uint32_t, const protocol::FrameHeader&)> callback);
 
-		std::vector<uint32_t> get_all_client_ids() const;
+		void stop_accepting();
 
 		template<typename T>
 		void send_data(size_t clientId, const T& data);
 
+		// Valid inside a message callback, on the thread running it
 		uint32_t get_last_client_sent_data() const;
 
 #ifdef SERVER_SAVE_PREV_DATA
@@ -36,66 +92,302 @@ namespace server
 		template<typename T>
 		void send_data_to_some(const std::vector<size_t>& clientId, const T& data);
 
+		// Encoded once and queued to every client without blocking the shards
 		template<typename T>
 		void send_data_to_all(const T& data);
 
+		// Queues the frames to each client and writes them in the background. A client that falls
+		// MaxOutboxBytes behind has what it has not started receiving replaced by `resync`, e.g. a
+		// snapshot of everything the frames would have told it, or is disconnected without one.
+		void send_shared(const std::vector<uint32_t>& clientIds, SharedFrames frames, SharedFrames resync = nullptr);
+
+		// Valid inside a connect or disconnect callback, on the thread running it
 		uint32_t get_current_client_id() const;
 
 		void disconnect_client(uint32_t clientId);
 
+		// Only meaningful on the client's own shard thread
+		bool has_client(uint32_t clientId);
+
+		// Moves a client's socket onto another shard. `done` runs on the target shard with the
+		// client's new id, with the old id if the platform cannot move the socket, or with 0 if
+		// the client is gone.
+		void migrate_client(uint32_t clientId, size_t targetShard, std::function<void(uint32_t)> done);
+
+		// Takes a client's socket out of the server. `done` runs on the client's shard with the
+		// native handle, now owned by the caller, or InvalidNativeHandle.
+		void detach_client(uint32_t clientId, std::function<void(NativeHandle)> done);
+
+		// Registers a connected socket (e.g. one handed over by another process) as a new client
+		void adopt_client(NativeHandle native, size_t shard, std::function<void(uint32_t)> done);
+
+		void post_to_shard(size_t shard, std::function<void()> work);
+
+		// Connects an in-process client; the session appears on the next poll() of its shard.
+		// The client owns the other end of the link and reads its id from it first, as over TCP.
+		std::shared_ptr<transport::LoopbackLink> connect_loopback();
+
+		// Simulated servers only: runs everything that is ready on every shard, in shard order,
+		// and returns how many handlers ran
+		size_t poll();
+
+		// Linux only, call on the clients' shard: from now on bytes between the two clients are
+		// spliced socket to socket in the kernel. False when the clients or platform cannot.
+		bool start_relay(uint32_t first, uint32_t second);
+
+		// Goes back to delivering frames from this client; a no-op without a relay
+		void stop_relay(uint32_t clientId);
+
+		// For timers that belong to a shard; their handlers run on the shard's thread
+		asio::io_context& shard_context(size_t shard);
+
+		size_t shard_count() const;
+
+		static size_t shard_of(uint32_t clientId);
+
+		// The reactor asio was built with: io_uring, epoll, kqueue, iocp or select
+		static const char* event_backend();
+
+		// Protocol frames read from and written to clients since start, summed over the shards
+		uint64_t frames_received() const;
+		uint64_t frames_sent() const;
+
+		// Shard metrics are written from their shard's thread only
+		MetricsRegistry& metrics();
+
+		// Shard recorders, like shard metrics, are written from their shard's thread only
+		FlightRecorder& recorder();
+
+		ShardLoad shard_load(size_t shard) const;
+
 		asio::ip::tcp::endpoint get_endpoint() const;
 
 		void stop();
 
 		~Server();
 
+#ifdef PLATFORM_WINDOWS
+		static constexpr NativeHandle InvalidNativeHandle = INVALID_SOCKET;
+#else
+		static constexpr NativeHandle InvalidNativeHandle = -1;
+#endif
+
 	private:
 
+		// Client id = [shard | slot generation | slot index], see SlotMap
+		static constexpr uint32_t ShardShift = 26;
+		static constexpr uint32_t LocalIdMask = (1u << ShardShift) - 1;
+
+	public:
+
+		// As many shards as the client id has bits for
+		static constexpr size_t MaxShards = size_t(1) << (32 - ShardShift);
+
+	private:
+
+		static constexpr size_t MaxChannelsPerConnection = 1024;
+
+		static constexpr size_t MaxOutboxBytes = 64 * 1024;
+		static constexpr size_t MaxOutboxGather = 16; // queued buffers per write
+
+		// Accept loop only; sessions live on the shards
 		std::thread _ioThread;
 
-		asio::io_context _ioContext; 
-	
+		asio::io_context _ioContext;
+
 		asio::executor_work_guard<asio::io_context::executor_type> _workGuard;
 
+		IoContextPool _shards;
+
 		asio::ip::tcp::endpoint _endpoint;
-		asio::ip::tcp::acceptor _acceptor; 
+		asio::ip::tcp::acceptor _acceptor;
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		asio::local::stream_protocol::acceptor _localAcceptor;
+		LocalSocketFile _localFile;
+#endif
+
+		bool _busyPoll = false;
+		int _busyPollMicros = 0;
+		bool _simulated = false;
+
+		// Queued bytes and the client they were sent to, a channel's frames sit on its connection
+		struct Outgoing
+		{
+			SharedFrames frames;
+			uint32_t clientId = 0;
+		};
 
+		// A session talks over exactly one of a socket or a loopback link
 		struct ClientSession
 		{
-			std::shared_ptr<asio::ip::tcp::socket> socket;
+			std::shared_ptr<StreamSocket> socket;
+			std::shared_ptr<transport::LoopbackLink> loopback;
 			std::vector<uint8_t> buffer;
-
-			ClientSession(std::shared_ptr<asio::ip::tcp::socket> sock, size_t bufferSize)
-				: socket(std::move(sock)), buffer(bufferSize) {
+			protocol::FrameReader reader;
+			bool migrating = false;
+			bool reading = false;
+
+			// Set while this client's bytes are spliced straight to relayPeer
+			std::unique_ptr<SpliceRelay> relay;
+			uint32_t relayPeer = 0;
+			bool relayReadArmed = false;
+			bool relayWriteArmed = false;
+			size_t discard = 0; // rest of a frame cut off when a relay stopped
+
+			// A channel session has no transport of its own and writes through its parent
+			uint32_t parent = 0;
+			uint16_t channel = 0;
+			std::unordered_map<uint16_t, uint32_t> channels; // open channels of a connection
+
+			// Written in the background, see send_shared and write_bytes. The first outboxInFlight are
+			// on the wire.
+			std::deque<Outgoing> outbox;
+			size_t outboxBytes = 0;
+			size_t outboxInFlight = 0;
+
+			ClientSession(std::shared_ptr<StreamSocket> sock, std::shared_ptr<transport::LoopbackLink> link, size_t bufferSize)
+				: socket(std::move(sock)), loopback(std::move(link)), buffer(bufferSize) {
 			}
 
 			ClientSession() = default;
 		};
 
-		std::unordered_map<uint32_t, ClientSession> _clients;
-
-		uint32_t _lastClientSentData = 0;
-
-		uint32_t _nextClientId = 1;
+		// Only ever touched from the owning shard's thread
+		struct ShardSessions
+		{
+			SlotMap<ClientSession, 16, ShardShift - 16> clients;
 
-		std::function<void()> _onDisconnect = nullptr;
-		std::function<void()> _onConnect = nullptr;
-		std::function<void(const std::vector<uint8_t>&)> _onMessageReceived;
+			// Sessions poll() reads from, loopback links have nothing to wake the shard
+			std::vector<uint32_t> loopbackClients;
 
 #ifdef SERVER_SAVE_PREV_DATA
-		std::unordered_map<size_t, std::vector<uint8_t>> _accumulatedData;
+			std::unordered_map<size_t, std::vector<uint8_t>> accumulatedData;
 #endif
+		};
 
-		void start_accept(); 
-		
-		void handle_accept(std::shared_ptr<asio::ip::tcp::socket> socket, const asio::error_code& error);
+		std::vector<ShardSessions> _sessions;
+
+		std::atomic<size_t> _clientCount = 0;
+
+		MetricsRegistry _metrics;
+		std::unique_ptr<MetricsExporter> _metricsExporter;
+
+		FlightRecorder _recorder;
+
+		static thread_local uint32_t _lastClientSentData;
+		static thread_local uint32_t _currentClientId;
+
+		std::function<void(uint32_t)> _onDisconnect = nullptr;
+		std::function<void(uint32_t)> _onConnect = nullptr;
+		std::function<void(uint32_t, const std::vector<uint8_t>&)> _onMessageReceived;
+		std::function<void(uint32_t, const protocol::FrameHeader&)> _onRelayedFrame;
+
+		static constexpr int RelayFlushTimeoutMs = 100;
+
+		ShardSessions& sessions_of(uint32_t clientId);
+
+		ShardMetrics& metrics_of(uint32_t clientId);
+
+		ShardRecorder& recorder_of(uint32_t clientId);
+
+		ClientSession* find_session(uint32_t clientId);
+
+		static uint32_t client_id(size_t shard, uint32_t handle);
+
+		bool erase_session(uint32_t clientId);
+
+		template<typename Func>
+		void run_on_shard(size_t shard, Func&& func);
+
+		template<typename T>
+		void write_to_client(uint32_t clientId, const T& data);
+
+		void write_bytes(uint32_t clientId, const uint8_t* data, size_t size);
+
+		template<typename T>
+		static SharedFrames share_bytes(const T& data);
+
+		// Shard thread only, the queueing half of send_shared
+		void queue_frames(uint32_t clientId, SharedFrames frames, SharedFrames resync);
+
+		// Appends to the connection's outbox, a connection MaxOutboxBytes behind is closed
+		void push_outbox(uint32_t connectionId, uint32_t clientId, SharedFrames frames, SharedFrames resync);
+
+		void flush_outbox(uint32_t id);
+
+		// A failed write or a disconnect; a socket's pending read then ends the session
+		static void close_transport(ClientSession& session);
+
+		uint32_t register_session(size_t shard, std::shared_ptr<StreamSocket> socket, std::shared_ptr<transport::LoopbackLink> link = nullptr);
+
+		// Registers a new client on its shard's thread, greets it and announces it
+		void open_session(size_t shard, std::shared_ptr<StreamSocket> socket, std::shared_ptr<transport::LoopbackLink> link);
+
+		enum class ReleaseResult
+		{
+			Released,
+			NotFound,
+			Unsupported
+		};
+
+		ReleaseResult release_session(uint32_t clientId, asio::generic::stream_protocol& protocol, NativeHandle& native);
+
+		uint32_t adopt_session(size_t shard, asio::generic::stream_protocol protocol, NativeHandle native);
+
+		void open_acceptor(const ServerConfig& config);
+
+		void configure_socket(StreamSocket& socket);
+
+		void request_quick_ack(StreamSocket& socket);
+
+		static bool is_tcp(const StreamSocket& socket);
+
+		static std::string peer_name(const StreamSocket& socket);
+
+		void start_accept();
+
+		void open_local_acceptor(const std::string& path);
+
+		void start_local_accept();
+
+		void handle_accept(size_t shard, StreamSocket socket, const asio::error_code& error, bool local);
 
 		//void handle
 		void start_session(uint32_t id);
 
-		void handle_incoming_data(const asio::error_code& error, size_t byteSizeTransferred, size_t id);
+		void start_read(uint32_t id);
+
+		void handle_incoming_data(const asio::error_code& error, size_t byteSizeTransferred, uint32_t id);
+
+		// Feeds bytes that arrived in the session's buffer to the reader and delivers the whole
+		// frames. False once the session is gone, migrating or corrupt.
+		bool deliver_frames(uint32_t id, size_t byteSizeTransferred);
+
+		void pump_loopback(size_t shard);
+
+		// The session a frame on a channel of this connection belongs to, opened on first use.
+		// 0 when the frame closed its channel or no channel could be opened.
+		uint32_t route_channel(uint32_t id, const protocol::FrameHeader& header);
+
+		uint32_t open_channel(uint32_t id, uint16_t channel);
+
+		void end_session(uint32_t id);
+
+		void begin_relay(uint32_t id);
+
+		void pump_relay(uint32_t id);
+
+		void arm_relay(uint32_t id, SpliceRelay::Result result);
+
+		void end_relay(uint32_t id);
+
+		void relayed_frame(uint32_t id, const protocol::FrameHeader& header);
+
+		// Frames the server sends to a relayed client go through the relay's pipe to stay in order
+		bool write_through_relay(uint32_t clientId, const uint8_t* data, size_t size);
 	};
 
 }
 
-#include "server.inl" 
\ No newline at end of file
+#include "server.inl"
\ No newline at end of file
@@ -4,73 +4,86 @@
 
 namespace server
 {
+	template<typename Func>
+	inline void Server::run_on_shard(size_t shard, Func&& func)
+	{
+		if (_shards.running_in_shard(shard))
+			func();
+		else
+			asio::post(_shards.get_context(shard), std::forward<Func>(func));
+	}
+
 	template<typename T>
 	inline void Server::send_data(size_t clientId, const T& data)
 	{
-		auto it = _clients.find(clientId);
-		if (it == _clients.end())
-		{
-			std::cerr << "Client ID " << clientId << " not found." << std::endl;
-		}
-		try
-		{
-			const uint8_t* buffer = reinterpret_cast<const uint8_t*>(&data);
-			size_t size = sizeof(T);
-			asio::write(*it->second.socket, asio::buffer(buffer, size));
-		}
-		catch (const asio::system_error& e) //NOTE: THERE IS A BUG WITH 
-		{
-			std::cerr << "Send failed: " << e.what() << std::endl;
-			it->second.socket->close(); 
-			_clients.erase(it); 
-		}
+		uint32_t id = static_cast<uint32_t>(clientId);
+		run_on_shard(shard_of(id), [this, id, data]()
+			{
+				write_to_client(id, data);
+			});
+	}
+
+	template<typename T>
+	inline void Server::write_to_client(uint32_t clientId, const T& data)
+	{
+		write_bytes(clientId, reinterpret_cast<const uint8_t*>(&data), sizeof(T));
 	}
 
 	template<>
-	inline void Server::send_data<std::string>(size_t clientId, const std::string& data)
+	inline void Server::write_to_client<std::string>(uint32_t clientId, const std::string& data)
 	{
-		auto it = _clients.find(clientId);
-		if (it == _clients.end())
-		{
-			std::cerr << "Client ID " << clientId << " not found." << std::endl;
-			return;
-		}
-		try
-		{
-			asio::write(*it->second.socket, asio::buffer(data.data(), data.size()));
-		}
-		catch (const asio::system_error& e)
-		{
-			std::cerr << "Send failed: " << e.what() << std::endl;
-			it->second.socket->close(); 
-			_clients.erase(it); 
-		}
+		write_bytes(clientId, reinterpret_cast<const uint8_t*>(data.data()), data.size());
+	}
+
+	template<>
+	inline void Server::write_to_client<std::vector<uint8_t>>(uint32_t clientId, const std::vector<uint8_t>& data)
+	{
+		write_bytes(clientId, data.data(), data.size());
+	}
+
+	template<typename T>
+	inline Server::SharedFrames Server::share_bytes(const T& data)
+	{
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&data);
+		return std::make_shared<const std::vector<uint8_t>>(bytes, bytes + sizeof(T));
+	}
+
+	template<>
+	inline Server::SharedFrames Server::share_bytes<std::string>(const std::string& data)
+	{
+		return std::make_shared<const std::vector<uint8_t>>(data.begin(), data.end());
+	}
+
+	template<>
+	inline Server::SharedFrames Server::share_bytes<std::vector<uint8_t>>(const std::vector<uint8_t>& data)
+	{
+		return std::make_shared<const std::vector<uint8_t>>(data);
 	}
 
-	
 	template<typename T>
 	inline void Server::send_data_to_some(const std::vector<size_t>& clientId, const T& data)
 	{
 		for (size_t id : clientId)
 		{
-			auto it = _clients.find(id);
-			if (it != _clients.end())
-			{
-				send_data(id, data);
-			}
-			else
-			{
-				std::cerr << "Client ID " << id << " not found." << std::endl;
-			}
+			send_data(id, data);
 		}
 	}
 
 	template<typename T>
 	inline void Server::send_data_to_all(const T& data)
 	{
-		for (const auto& [id, socket] : _clients)
+		SharedFrames frames = share_bytes(data);
+
+		for (size_t shard = 0; shard < _shards.size(); shard++)
 		{
-			send_data(id, data);
+			run_on_shard(shard, [this, shard, frames]()
+				{
+					auto& clients = _sessions[shard].clients;
+					for (size_t i = 0; i < clients.size(); i++)
+					{
+						queue_frames(client_id(shard, clients.handle_at(i)), frames, nullptr);
+					}
+				});
 		}
 	}
 }
\ No newline at end of file
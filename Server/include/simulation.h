@@ -0,0 +1,22 @@
+#pragma once
+
+#include "game_server.h"
+
+namespace game
+{
+	struct SimulationReport
+	{
+		size_t games = 0;
+		size_t finished = 0;      // games that reached game over
+		uint64_t frames = 0;      // frames the server read and wrote
+		double wallSeconds = 0;
+		double virtualSeconds = 0;
+	};
+
+	// Plays `games` matches at once against a simulated GameServer: every player is a scripted
+	// bot on a loopback link and the GameClock runs on virtual time, one server tick per round.
+	// The same arguments always give the same interleaving, so a failing run replays exactly.
+	SimulationReport run_simulation(size_t games, size_t shards);
+
+	void print_simulation(const SimulationReport& report, std::ostream& out);
+}
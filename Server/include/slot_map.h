@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace server
+{
+	// Dense slot map. Values live contiguously and are swapped on erase; handles pack a slot
+	// index with the slot's generation, so a handle kept past erase() no longer resolves even
+	// after the slot is reused. Lookup is two array reads and a compare, no hashing.
+	template<typename T, uint32_t IndexBits = 16, uint32_t GenerationBits = 10>
+	class SlotMap
+	{
+		// Generations wrap: a handle kept past erase() resolves again once its slot has been reused
+		// GenerationMask times. Freed slots are reused oldest first and only while MinFreeSlots
+		// wait, so that takes about GenerationMask * MinFreeSlots erases (a million with the
+		// defaults) even when one value comes and goes over and over.
+		static_assert(IndexBits + GenerationBits <= 32, "SlotMap handles must fit in 32 bits");
+
+	public:
+
+		static constexpr uint32_t HandleBits = IndexBits + GenerationBits;
+		static constexpr uint32_t IndexMask = (1u << IndexBits) - 1;
+		static constexpr uint32_t GenerationMask = (1u << GenerationBits) - 1;
+		static constexpr uint32_t InvalidHandle = 0;
+		static constexpr size_t MaxSize = size_t(1) << IndexBits;
+		static constexpr size_t MinFreeSlots = std::min<size_t>(1024, MaxSize / 4);
+
+		// InvalidHandle when full
+		template<typename... Args>
+		uint32_t emplace(Args&&... args)
+		{
+			uint32_t slotIndex;
+
+			// New slots until enough freed ones wait, so no single slot is reused back to back
+			if (_freeCount > 0 && (_freeCount >= MinFreeSlots || _slots.size() >= MaxSize))
+			{
+				slotIndex = _freeHead;
+				_freeHead = _slots[slotIndex].dense;
+				if (_freeHead == NoSlot)
+					_freeTail = NoSlot;
+				_freeCount--;
+			}
+			else
+			{
+				if (_slots.size() >= MaxSize)
+					return InvalidHandle;
+
+				slotIndex = static_cast<uint32_t>(_slots.size());
+				_slots.push_back({ NoSlot, 1 });
+			}
+
+			Slot& slot = _slots[slotIndex];
+			slot.dense = static_cast<uint32_t>(_values.size());
+			_values.emplace_back(std::forward<Args>(args)...);
+			_denseToSlot.push_back(slotIndex);
+
+			return make_handle(slotIndex, slot.generation);
+		}
+
+		T* find(uint32_t handle)
+		{
+			uint32_t dense = dense_index(handle);
+			return dense == NoSlot ? nullptr : &_values[dense];
+		}
+
+		const T* find(uint32_t handle) const
+		{
+			uint32_t dense = dense_index(handle);
+			return dense == NoSlot ? nullptr : &_values[dense];
+		}
+
+		bool contains(uint32_t handle) const
+		{
+			return dense_index(handle) != NoSlot;
+		}
+
+		bool erase(uint32_t handle)
+		{
+			uint32_t dense = dense_index(handle);
+			if (dense == NoSlot)
+				return false;
+
+			uint32_t slotIndex = handle & IndexMask;
+			uint32_t last = static_cast<uint32_t>(_values.size() - 1);
+
+			if (dense != last)
+			{
+				_values[dense] = std::move(_values[last]);
+				_denseToSlot[dense] = _denseToSlot[last];
+				_slots[_denseToSlot[dense]].dense = dense;
+			}
+
+			_values.pop_back();
+			_denseToSlot.pop_back();
+
+			// Generation 0 is never handed out, so no live handle can equal InvalidHandle
+			Slot& slot = _slots[slotIndex];
+			slot.generation = (slot.generation + 1) & GenerationMask;
+			if (slot.generation == 0)
+				slot.generation = 1;
+
+			// Queued behind every other free slot
+			slot.dense = NoSlot;
+			if (_freeTail != NoSlot)
+				_slots[_freeTail].dense = slotIndex;
+			else
+				_freeHead = slotIndex;
+			_freeTail = slotIndex;
+			_freeCount++;
+
+			return true;
+		}
+
+		void clear()
+		{
+			while (!_values.empty())
+				erase(handle_at(_values.size() - 1));
+		}
+
+		size_t size() const
+		{
+			return _values.size();
+		}
+
+		bool empty() const
+		{
+			return _values.empty();
+		}
+
+		// Dense iteration, handle_at(i) is the handle of the i-th value
+		T& value_at(size_t denseIndex)
+		{
+			return _values[denseIndex];
+		}
+
+		uint32_t handle_at(size_t denseIndex) const
+		{
+			uint32_t slotIndex = _denseToSlot[denseIndex];
+			return make_handle(slotIndex, _slots[slotIndex].generation);
+		}
+
+		auto begin() { return _values.begin(); }
+		auto end() { return _values.end(); }
+		auto begin() const { return _values.begin(); }
+		auto end() const { return _values.end(); }
+
+	private:
+
+		static constexpr uint32_t NoSlot = std::numeric_limits<uint32_t>::max();
+
+		struct Slot
+		{
+			uint32_t dense;      // index into _values while live, next free slot otherwise
+			uint32_t generation;
+		};
+
+		std::vector<T> _values;
+		std::vector<uint32_t> _denseToSlot;
+		std::vector<Slot> _slots;
+
+		// Free slots, oldest first, linked through `dense`
+		uint32_t _freeHead = NoSlot;
+		uint32_t _freeTail = NoSlot;
+		size_t _freeCount = 0;
+
+		static uint32_t make_handle(uint32_t slotIndex, uint32_t generation)
+		{
+			return (generation << IndexBits) | slotIndex;
+		}
+
+		uint32_t dense_index(uint32_t handle) const
+		{
+			uint32_t slotIndex = handle & IndexMask;
+			if (slotIndex >= _slots.size())
+				return NoSlot;
+
+			const Slot& slot = _slots[slotIndex];
+			if (slot.generation != ((handle >> IndexBits) & GenerationMask) || slot.dense >= _values.size())
+				return NoSlot;
+
+			// A free slot keeps the free-list link in `dense`, make sure it really points back here
+			if (_denseToSlot[slot.dense] != slotIndex)
+				return NoSlot;
+
+			return slot.dense;
+		}
+	};
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <asio.hpp>
+
+#include <functional>
+#include <vector>
+
+#include "protocol.h"
+
+namespace server
+{
+	// One direction of a kernel relay between two client sockets (Linux only). Bytes go
+	// socket -> pipe -> socket with splice() and never enter user space; the relay only peeks
+	// at each frame header so it can keep frames whole and report them.
+	class SpliceRelay
+	{
+	public:
+
+		using NativeHandle = asio::generic::stream_protocol::socket::native_handle_type;
+		using FrameCallback = std::function<void(const protocol::FrameHeader&)>;
+
+		enum class Result
+		{
+			WaitRead,   // the source has nothing more for now
+			WaitWrite,  // the destination cannot take what the pipe holds
+			Closed,     // the source hung up or failed
+			Corrupt     // the source announced an impossible frame
+		};
+
+		SpliceRelay() = default;
+
+		SpliceRelay(const SpliceRelay&) = delete;
+		SpliceRelay& operator=(const SpliceRelay&) = delete;
+
+		static bool supported();
+
+		bool open();
+
+		// Bytes of a frame the user space reader had already taken off the socket
+		bool prime(const std::vector<uint8_t>& carry, const FrameCallback& onFrame);
+
+		// Moves as many whole frames as the sockets allow, up to a per call budget
+		Result pump(NativeHandle source, NativeHandle destination, const FrameCallback& onFrame);
+
+		// Queues bytes the server itself sends to the destination behind the frame being moved.
+		// False when the destination has stopped reading and the pipe is full.
+		bool inject(const uint8_t* data, size_t size);
+
+		// Writes what the pipe still owes the destination; true once nothing is left
+		bool flush(NativeHandle destination);
+
+		// Waits up to `timeoutMs` for the destination to take the pipe and any injected bytes
+		void flush_blocking(NativeHandle destination, int timeoutMs);
+
+		// Bytes of a partly relayed frame still on the source socket, for the reader to skip
+		size_t frame_left() const;
+
+		// Part of a header already taken off the source socket, for the reader to continue from
+		std::vector<uint8_t> take_partial();
+
+		~SpliceRelay();
+
+	private:
+
+		static constexpr size_t FramesPerPump = 64;
+
+		int _pipeRead = -1;
+		int _pipeWrite = -1;
+
+		size_t _frameLeft = 0;  // bytes of the current frame not yet in the pipe
+		size_t _piped = 0;      // bytes in the pipe not yet on the destination
+		bool _frameMoved = false;
+		std::vector<uint8_t> _partial;
+		std::vector<uint8_t> _injected;
+
+		// Takes the next frame header, peeked when whole and read when it arrives in pieces
+		bool start_frame(NativeHandle source, const FrameCallback& onFrame, Result& stop);
+
+		bool write_to_pipe(const uint8_t* data, size_t size);
+
+		void drop_piped();
+	};
+}
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace server
+{
+	// Hierarchical timing wheel. Level n has 64 slots of 64^n ticks each; a timer sits in the
+	// lowest level whose range covers it and cascades down as the wheel turns. Timers are nodes
+	// of an intrusive list in a pooled array, so schedule and cancel are O(1) with no allocation
+	// once the pool has grown, and a tick only touches the slots that come due.
+	template<typename T, uint32_t Levels = 4>
+	class TimingWheel
+	{
+		static_assert(Levels >= 1 && Levels * 6 < 64, "TimingWheel levels must fit a 64 bit tick counter");
+
+	public:
+
+		using Handle = uint64_t;
+
+		static constexpr Handle InvalidHandle = 0;
+		static constexpr uint32_t SlotBits = 6;
+		static constexpr uint32_t SlotCount = 1u << SlotBits;
+		static constexpr uint64_t MaxDelay = (uint64_t(1) << (SlotBits * Levels)) - 1;
+
+		// Fires `payload` once `delay` ticks have passed, at least one tick from now
+		Handle schedule(uint64_t delay, const T& payload)
+		{
+			uint32_t index;
+
+			if (_freeHead != NoNode)
+			{
+				index = _freeHead;
+				_freeHead = _nodes[index].next;
+			}
+			else
+			{
+				index = static_cast<uint32_t>(_nodes.size());
+				_nodes.emplace_back();
+			}
+
+			Node& node = _nodes[index];
+			node.expiry = _current + (delay == 0 ? 1 : delay);
+			node.payload = payload;
+			node.live = true;
+
+			place(index);
+			++_size;
+
+			return make_handle(index, node.generation);
+		}
+
+		bool cancel(Handle handle)
+		{
+			uint32_t index = find(handle);
+			if (index == NoNode)
+				return false;
+
+			unlink(index);
+			release(index);
+			return true;
+		}
+
+		// Moves an existing timer instead of cancelling and scheduling a new one
+		bool reschedule(Handle handle, uint64_t delay)
+		{
+			uint32_t index = find(handle);
+			if (index == NoNode)
+				return false;
+
+			unlink(index);
+			_nodes[index].expiry = _current + (delay == 0 ? 1 : delay);
+			place(index);
+			return true;
+		}
+
+		bool contains(Handle handle) const
+		{
+			return find(handle) != NoNode;
+		}
+
+		// Turns the wheel up to `tick`, calling func(payload) for every timer that comes due.
+		// func may schedule and cancel timers.
+		template<typename Func>
+		void advance_to(uint64_t tick, Func&& func)
+		{
+			while (_current < tick)
+			{
+				++_current;
+
+				// Higher levels spill into lower ones when every level below them wraps
+				for (uint32_t level = 1; level < Levels; level++)
+				{
+					if ((_current & ((uint64_t(1) << (SlotBits * level)) - 1)) != 0)
+						break;
+					cascade(level);
+				}
+
+				uint32_t& head = _buckets[_current & (SlotCount - 1)];
+				while (head != NoNode)
+				{
+					uint32_t index = head;
+					unlink(index);
+
+					// Timers beyond the top level's range were parked early, put them back
+					if (_nodes[index].expiry > _current)
+					{
+						place(index);
+						continue;
+					}
+
+					T payload = _nodes[index].payload;
+					release(index);
+					func(payload);
+				}
+			}
+		}
+
+		uint64_t current_tick() const
+		{
+			return _current;
+		}
+
+		size_t size() const
+		{
+			return _size;
+		}
+
+		bool empty() const
+		{
+			return _size == 0;
+		}
+
+	private:
+
+		static constexpr uint32_t NoNode = std::numeric_limits<uint32_t>::max();
+
+		struct Node
+		{
+			uint64_t expiry = 0;
+			uint32_t prev = NoNode;
+			uint32_t next = NoNode;   // next in the slot while live, next free node otherwise
+			uint32_t bucket = 0;
+			uint32_t generation = 1;
+			bool live = false;
+			T payload{};
+		};
+
+		std::vector<Node> _nodes;
+		std::array<uint32_t, SlotCount * Levels> _buckets = make_empty_buckets();
+
+		uint32_t _freeHead = NoNode;
+		uint64_t _current = 0;
+		size_t _size = 0;
+
+		static constexpr std::array<uint32_t, SlotCount * Levels> make_empty_buckets()
+		{
+			std::array<uint32_t, SlotCount * Levels> buckets{};
+			for (auto& bucket : buckets)
+				bucket = NoNode;
+			return buckets;
+		}
+
+		static Handle make_handle(uint32_t index, uint32_t generation)
+		{
+			return (static_cast<uint64_t>(generation) << 32) | index;
+		}
+
+		uint32_t find(Handle handle) const
+		{
+			uint32_t index = static_cast<uint32_t>(handle);
+			if (index >= _nodes.size())
+				return NoNode;
+
+			const Node& node = _nodes[index];
+			if (!node.live || node.generation != static_cast<uint32_t>(handle >> 32))
+				return NoNode;
+
+			return index;
+		}
+
+		void place(uint32_t index)
+		{
+			Node& node = _nodes[index];
+			uint64_t delta = node.expiry - _current;
+			if (delta > MaxDelay)
+				delta = MaxDelay;
+
+			uint32_t level = 0;
+			while (level + 1 < Levels && delta >= (uint64_t(1) << (SlotBits * (level + 1))))
+				level++;
+
+			uint64_t target = _current + delta;
+			uint32_t slot = static_cast<uint32_t>((target >> (SlotBits * level)) & (SlotCount - 1));
+
+			node.bucket = level * SlotCount + slot;
+			node.prev = NoNode;
+			node.next = _buckets[node.bucket];
+			if (node.next != NoNode)
+				_nodes[node.next].prev = index;
+			_buckets[node.bucket] = index;
+		}
+
+		void unlink(uint32_t index)
+		{
+			Node& node = _nodes[index];
+
+			if (node.prev != NoNode)
+				_nodes[node.prev].next = node.next;
+			else
+				_buckets[node.bucket] = node.next;
+
+			if (node.next != NoNode)
+				_nodes[node.next].prev = node.prev;
+
+			node.prev = NoNode;
+			node.next = NoNode;
+		}
+
+		void release(uint32_t index)
+		{
+			Node& node = _nodes[index];
+			node.live = false;
+			node.payload = T{};
+
+			// Generation 0 is never handed out, so no live handle can equal InvalidHandle
+			if (++node.generation == 0)
+				node.generation = 1;
+
+			node.next = _freeHead;
+			_freeHead = index;
+			--_size;
+		}
+
+		void cascade(uint32_t level)
+		{
+			uint32_t slot = static_cast<uint32_t>((_current >> (SlotBits * level)) & (SlotCount - 1));
+			uint32_t& head = _buckets[level * SlotCount + slot];
+
+			while (head != NoNode)
+			{
+				uint32_t index = head;
+				unlink(index);
+				place(index);
+			}
+		}
+	};
+}
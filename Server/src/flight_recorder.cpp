@@ -0,0 +1,364 @@
+#include "headers.h"
+#include "flight_recorder.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifdef PLATFORM_WINDOWS
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+namespace server
+{
+	namespace
+	{
+		// A dump is the header, then per shard its event count and its whole ring, in host byte order
+		struct DumpHeader
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t shardCount;
+			uint32_t capacity;
+			uint32_t eventSize;
+		};
+
+		constexpr char DumpMagic[8] = { 'F', 'C', 'F', 'L', 'I', 'G', 'H', 'T' };
+		constexpr uint32_t DumpVersion = 1;
+
+		struct KindName
+		{
+			const char* name;
+			const char* code; // labels of the fields the kind uses, null when unused
+			const char* a;
+			const char* b;
+		};
+
+		constexpr std::array<KindName, FE_KIND_COUNT> KindNames = { {
+			{ "none", nullptr, nullptr, nullptr },
+			{ "accept", nullptr, "connection", nullptr },
+			{ "close", nullptr, nullptr, nullptr },
+			{ "frame in", "type", "size", nullptr },
+			{ "relayed", "type", "peer", nullptr },
+			{ "request", "type", "verdict", "room" },
+			{ "room create", nullptr, "black", "room" },
+			{ "room destroy", nullptr, nullptr, "room" },
+			{ "relay start", nullptr, "peer", nullptr },
+			{ "relay stop", nullptr, nullptr, nullptr },
+			{ "migrate", nullptr, "new id", "shard" },
+			{ "read error", nullptr, "error", nullptr },
+			{ "write error", nullptr, "error", nullptr },
+			{ "malformed frame", nullptr, nullptr, nullptr },
+			{ "outbox overflow", nullptr, "queued", nullptr },
+		} };
+
+		// Plain file descriptors, stdio may be what crashed
+#ifdef PLATFORM_WINDOWS
+		int open_dump(const char* path)
+		{
+			return ::_open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+		}
+
+		bool write_all(int fd, const void* data, size_t size)
+		{
+			const char* bytes = static_cast<const char*>(data);
+			while (size > 0)
+			{
+				int written = ::_write(fd, bytes, static_cast<unsigned int>(std::min<size_t>(size, 1 << 30)));
+				if (written <= 0)
+					return false;
+
+				bytes += written;
+				size -= written;
+			}
+			return true;
+		}
+
+		void close_dump(int fd)
+		{
+			::_close(fd);
+		}
+#else
+		int open_dump(const char* path)
+		{
+			return ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		}
+
+		bool write_all(int fd, const void* data, size_t size)
+		{
+			const char* bytes = static_cast<const char*>(data);
+			while (size > 0)
+			{
+				ssize_t written = ::write(fd, bytes, size);
+				if (written < 0 && errno == EINTR)
+					continue;
+				if (written <= 0)
+					return false;
+
+				bytes += written;
+				size -= static_cast<size_t>(written);
+			}
+			return true;
+		}
+
+		void close_dump(int fd)
+		{
+			::close(fd);
+		}
+#endif
+
+		// Read from signal handlers, so nothing here may allocate or lock
+		std::atomic<const FlightRecorder*> crashRecorder = nullptr;
+		char crashPath[1024];
+
+		constexpr int FatalSignals[] = {
+			SIGSEGV,
+			SIGABRT,
+			SIGFPE,
+			SIGILL,
+#ifndef PLATFORM_WINDOWS
+			SIGBUS,
+#endif
+		};
+
+		void on_fatal_signal(int signal)
+		{
+			if (const FlightRecorder* recorder = crashRecorder.load())
+				recorder->dump(crashPath);
+
+			// Dies the way it would have without the handler
+			std::signal(signal, SIG_DFL);
+			std::raise(signal);
+		}
+
+#ifndef PLATFORM_WINDOWS
+		void on_dump_signal(int)
+		{
+			if (const FlightRecorder* recorder = crashRecorder.load())
+				recorder->dump(crashPath);
+		}
+
+		// On the thread's alternate stack where it has one, an overflowed stack has no room left
+		void install_handler(int signal, void (*handler)(int))
+		{
+			struct sigaction action = {};
+			action.sa_handler = handler;
+			sigemptyset(&action.sa_mask);
+			action.sa_flags = SA_ONSTACK;
+			sigaction(signal, &action, nullptr);
+		}
+
+		// Disables the alternate stack before freeing it when the thread exits
+		struct SignalStack
+		{
+			std::unique_ptr<char[]> memory;
+
+			~SignalStack()
+			{
+				if (!memory)
+					return;
+
+				stack_t disable = {};
+				disable.ss_flags = SS_DISABLE;
+				sigaltstack(&disable, nullptr);
+			}
+		};
+
+		thread_local SignalStack signalStack;
+#endif
+
+		void print_time(std::ostream& out, int64_t nanoseconds)
+		{
+			int64_t sinceMidnight = nanoseconds % (86400LL * 1000000000LL);
+
+			char stamp[32];
+			std::snprintf(stamp, sizeof(stamp), "%02lld:%02lld:%02lld.%09lld", static_cast<long long>(sinceMidnight / 3600000000000LL), static_cast<long long>(sinceMidnight / 60000000000LL % 60),
+				static_cast<long long>(sinceMidnight / 1000000000LL % 60), static_cast<long long>(sinceMidnight % 1000000000LL));
+			out << stamp;
+		}
+	}
+
+	ShardRecorder::ShardRecorder(size_t capacity)
+		: _events(std::make_unique<FlightEvent[]>(capacity)), _mask(capacity - 1)
+	{
+	}
+
+	FlightRecorder::FlightRecorder(size_t shardCount, size_t eventsPerShard)
+		: _capacity(std::bit_ceil(std::max<size_t>(eventsPerShard, 1)))
+	{
+		for (size_t shard = 0; shard < shardCount; shard++)
+			_shards.push_back(std::make_unique<ShardRecorder>(_capacity));
+	}
+
+	ShardRecorder& FlightRecorder::shard(size_t shard)
+	{
+		return *_shards[shard];
+	}
+
+	bool FlightRecorder::dump(const char* path) const
+	{
+		int fd = open_dump(path);
+		if (fd < 0)
+			return false;
+
+		DumpHeader header;
+		std::memcpy(header.magic, DumpMagic, sizeof(header.magic));
+		header.version = DumpVersion;
+		header.shardCount = static_cast<uint32_t>(_shards.size());
+		header.capacity = static_cast<uint32_t>(_capacity);
+		header.eventSize = sizeof(FlightEvent);
+
+		bool written = write_all(fd, &header, sizeof(header));
+		for (const auto& shard : _shards)
+		{
+			if (!written)
+				break;
+
+			uint64_t next = shard->_next.load(std::memory_order_acquire);
+			written = write_all(fd, &next, sizeof(next)) && write_all(fd, shard->_events.get(), _capacity * sizeof(FlightEvent));
+		}
+
+		close_dump(fd);
+		return written;
+	}
+
+	void FlightRecorder::install_crash_handler(const std::string& path)
+	{
+		crashRecorder.store(nullptr);
+
+		size_t length = std::min(path.size(), sizeof(crashPath) - 1);
+		std::memcpy(crashPath, path.data(), length);
+		crashPath[length] = '\0';
+
+		crashRecorder.store(this);
+
+#ifdef PLATFORM_WINDOWS
+		for (int signal : FatalSignals)
+			std::signal(signal, on_fatal_signal);
+#else
+		install_signal_stack();
+
+		for (int signal : FatalSignals)
+			install_handler(signal, on_fatal_signal);
+
+		install_handler(SIGUSR1, on_dump_signal);
+#endif
+	}
+
+	void FlightRecorder::install_signal_stack()
+	{
+#ifndef PLATFORM_WINDOWS
+		if (signalStack.memory)
+			return;
+
+		// SIGSTKSZ is too small for the dump's write calls on some systems
+		size_t size = std::max<size_t>(SIGSTKSZ, 64 * 1024);
+		signalStack.memory = std::make_unique<char[]>(size);
+
+		stack_t stack = {};
+		stack.ss_sp = signalStack.memory.get();
+		stack.ss_size = size;
+		if (sigaltstack(&stack, nullptr) != 0)
+			signalStack.memory.reset();
+#endif
+	}
+
+	bool FlightRecorder::read_dump(const std::string& path, std::ostream& out)
+	{
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		if (!file)
+			return false;
+
+		uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+		file.seekg(0);
+
+		DumpHeader header;
+		if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, DumpMagic, sizeof(DumpMagic)) != 0
+			|| header.version != DumpVersion || header.eventSize != sizeof(FlightEvent) || header.capacity == 0)
+			return false;
+
+		// The counts come from the file, they must describe exactly its size before anything is
+		// allocated for them; divisions keep a forged count from overflowing the check
+		uint64_t shardBytes = sizeof(uint64_t) + uint64_t(header.capacity) * sizeof(FlightEvent);
+		uint64_t bodyBytes = fileSize - sizeof(header);
+		if (bodyBytes / shardBytes != header.shardCount || bodyBytes % shardBytes != 0)
+			return false;
+
+		struct Entry
+		{
+			FlightEvent event;
+			uint32_t shard;
+		};
+
+		std::vector<Entry> entries;
+		std::vector<FlightEvent> ring(header.capacity);
+		uint64_t recorded = 0;
+
+		for (uint32_t shard = 0; shard < header.shardCount; shard++)
+		{
+			uint64_t next;
+			if (!file.read(reinterpret_cast<char*>(&next), sizeof(next)) || !file.read(reinterpret_cast<char*>(ring.data()), ring.size() * sizeof(FlightEvent)))
+				return false;
+
+			recorded += next;
+
+			// Oldest first: a ring that wrapped starts where the next event would have gone
+			uint64_t kept = std::min<uint64_t>(next, header.capacity);
+			for (uint64_t i = next - kept; i < next; i++)
+			{
+				const FlightEvent& event = ring[i % header.capacity];
+				if (event.kind != FE_NONE)
+					entries.push_back({ event, shard });
+			}
+		}
+
+		std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.event.time < b.event.time; });
+
+		out << header.shardCount << " shards of " << header.capacity << " events, " << entries.size() << " kept of " << recorded << " recorded (UTC)\n";
+
+		for (const Entry& entry : entries)
+		{
+			const FlightEvent& event = entry.event;
+
+			print_time(out, event.time);
+			out << " shard " << entry.shard << " ";
+
+			if (event.kind >= FE_KIND_COUNT)
+			{
+				out << "kind " << event.kind << " client " << event.client << " code " << event.code << " a " << event.a << " b " << event.b << "\n";
+				continue;
+			}
+
+			const KindName& kind = KindNames[event.kind];
+			out << kind.name << " client " << event.client;
+			if (kind.code)
+				out << " " << kind.code << " " << event.code;
+			if (kind.a)
+				out << " " << kind.a << " " << event.a;
+			if (kind.b)
+				out << " " << kind.b << " " << event.b;
+			out << "\n";
+		}
+
+		out.flush();
+		return true;
+	}
+
+	FlightRecorder::~FlightRecorder()
+	{
+		// The handlers stay installed and find nothing to dump
+		const FlightRecorder* self = this;
+		crashRecorder.compare_exchange_strong(self, nullptr);
+	}
+}
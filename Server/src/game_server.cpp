@@ -1,93 +1,1055 @@
 #include "headers.h"
 #include "game_server.h"
+#include "binary_log.h"
+#include "tracepoints.h"
 
 
 
 namespace game
 {
 
-	GameServer::GameServer(unsigned short port)
-		: server(port)
+	GameServer::GameServer(unsigned short port, const server::ServerConfig& config, const std::string& brokerPath, bool validateMoves)
+		: server(port, config), validateMoves(validateMoves), simulated(config.simulated), shardRooms(server.shard_count())
 	{
-		//openPlayerIds.set_callback([this](std::vector<uint32_t>& players)
-		//{
-		//	if (players.size() >= 2)
-		//	{
-		//		size_t size = players.size();
-		//		for (size_t i = 0; i < size; i++)
-		//		{
-		//			size -= 2;
-		//			uint32_t playerId = players.back();
-		//			players.pop_back();
-		//			uint32_t opponentId = players.back();
-		//			players.pop_back();
-		//			server.send_data_to_some<std::string>({ playerId, opponentId }, "startMessage");
+		for (size_t shard = 0; shard < server.shard_count(); shard++)
+			shardTimers.push_back(std::make_unique<ShardTimers>(server.shard_context(shard)));
 
-		//			server.disconnect_client(playerId);
-		//			server.disconnect_client(opponentId);
-		//		}
+		newcomers.resize(server.shard_count());
 
-		//	}
-		//});
+		for (size_t shard = 0; shard < server.shard_count(); shard++)
+			shardLatency.push_back(std::make_unique<ShardLatency>());
 
-		server.set_on_connect([this]()
-		{	
-			if (server.client_count() % 2 == 0)
+		server.metrics().add_gauge("matchmaking_queue", "Players waiting for an opponent", [this]()
+		{
+			std::lock_guard lock(matchmakingMutex);
+			return static_cast<int64_t>(openPlayerIds.size());
+		});
+
+		openPlayerIds.set_callback([this](uint32_t whiteId, uint32_t blackId)
+		{
+#ifndef PLATFORM_WINDOWS
+			// The first player had been announced to the broker while it waited alone
+			if (broker)
+				broker->send({ server::BRK_CANCEL, whiteId, 0 });
+#endif
+			begin_match(whiteId, blackId);
+		});
+
+#ifndef PLATFORM_WINDOWS
+		if (!brokerPath.empty())
+		{
+			broker = std::make_unique<server::BrokerLink>(brokerPath, [this](const server::BrokerMessage& message, int attachedFd)
+			{
+				handle_broker_message(message, attachedFd);
+			});
+
+			if (!broker->connect())
+				broker.reset();
+		}
+#endif
+
+		server.set_on_connect([this](uint32_t clientId)
+		{
+			touch_client(clientId);
+
+			// Queued on its first frame, which may instead ask to spectate or to resume a game
+			newcomers[server::Server::shard_of(clientId)].insert(clientId);
+		});
+
+		server.set_on_disconnect([this](uint32_t clientId)
+		{
+			forget_client(clientId);
+			close_move_latency(clientId);
+
+			size_t shard = server::Server::shard_of(clientId);
+			if (newcomers[shard].erase(clientId) > 0)
+				return;
+
+			{
+				std::lock_guard lock(matchmakingMutex);
+				if (openPlayerIds.contains(clientId))
+				{
+					dequeue_player(clientId);
+					return;
+				}
+			}
+
+			if (const RoomRoute* watching = shardRooms[shard].find_watcher(clientId))
+			{
+				forget_spectator(clientId, *watching);
+				return;
+			}
+
+			const RoomRoute* found = shardRooms[shard].find_route(clientId);
+			if (!found)
+				return;
+
+			RoomRoute route = *found;
+
+			// A validated room keeps the seat for a reconnect, the opponent plays on meanwhile
+			if (this->validateMoves)
+			{
+				shardRooms[shard].remove_route(clientId, route.room, route.generation);
+
+				if (route.shard == shard)
+				{
+					seat_left(route, clientId);
+					return;
+				}
+
+				server.post_to_shard(route.shard, [this, route, clientId]()
+				{
+					seat_left(route, clientId);
+				});
+				return;
+			}
+
+			server.send_data(route.opponent, protocol::encode_frame(protocol::MSG_OPPONENT_LEFT));
+			finish_match(shard, route);
+		});
+
+
+		server.add_on_message_received([this](uint32_t clientId, const std::vector<uint8_t>& frame)
+		{
+			chess::GameClock::time_point received = chess::GameClock::now();
+			touch_client(clientId);
+
+			uint8_t type = protocol::frame_header(frame).type;
+			size_t shard = server::Server::shard_of(clientId);
+			bool first = newcomers[shard].erase(clientId) > 0;
+
+			if (type == protocol::MSG_SPECTATE)
+			{
+				handle_spectate(clientId, frame);
+				return;
+			}
+
+			// Only a client that is nothing yet can take a seat back
+			if (type == protocol::MSG_RESUME)
+			{
+				if (first)
+					handle_resume(clientId, frame);
+				else
+					server.send_data(clientId, protocol::encode_frame(protocol::MSG_REJECT, protocol::RejectMessage{ protocol::MSG_RESUME, 0, 0 }));
+				return;
+			}
+
+			if (first)
+			{
+				std::lock_guard lock(matchmakingMutex);
+				enqueue_player(clientId);
+			}
+
+			if (type == protocol::MSG_HEARTBEAT)
+				return;
+
+			// Answered before any room work so the round trip the client measures stays honest
+			if (type == protocol::MSG_TIME_SYNC)
+			{
+				protocol::TimeSyncMessage sync{};
+				if (protocol::decode_payload(frame, sync))
+				{
+					sync.serverTime = protocol::to_wire32(chess::ClockSync::millis(chess::GameClock::now()));
+					server.send_data(clientId, protocol::encode_frame(protocol::MSG_TIME_SYNC, sync));
+				}
+				return;
+			}
+
+			const RoomRoute* found = shardRooms[shard].find_route(clientId);
+			if (!found)
+				return;
+
+			RoomRoute route = *found;
+
+			if (!this->validateMoves)
 			{
-				auto ids = server.get_all_client_ids();
+				// Frames that did not go through a kernel relay are forwarded as they are, timed
+				// until the write on the opponent's shard
+				size_t opponentShard = server::Server::shard_of(route.opponent);
+				auto forward = [this, clientId, type, opponentShard, opponent = route.opponent, frame, received]()
+				{
+					server.send_data(opponent, frame);
+					server.metrics().shard(opponentShard).record(server::MH_RELAY_LATENCY, chess::GameClock::now() - received);
+					server.recorder().shard(opponentShard).record(server::FE_RELAYED, clientId, type, opponent);
+					FC_TRACE(frame_relayed, clientId, type, opponent);
+				};
 
-				clientIds = { ids[0], ids[1] };
+				if (opponentShard == shard)
+					forward();
+				else
+					server.post_to_shard(opponentShard, std::move(forward));
 
-				server.send_data(clientIds.first, "BLACK");
-				server.send_data(clientIds.second, "WHITE");
+				server.post_to_shard(route.shard, [this, route, type]()
+				{
+					handle_relayed_frame(route, type);
+				});
+				return;
 			}
+
+			if (route.shard == shard)
+			{
+				handle_match_request(clientId, route, frame, received);
+				return;
+			}
+
+			server.post_to_shard(route.shard, [this, clientId, route, frame, received]()
+			{
+				handle_match_request(clientId, route, frame, received);
+			});
 		});
 
-		server.set_on_disconnect([this]()
+		server.set_on_relayed_frame([this](uint32_t clientId, const protocol::FrameHeader& header)
 		{
-			openPlayerIds.remove_player(server.get_current_client_id());
+			touch_client(clientId);
+
+			if (header.type == protocol::MSG_HEARTBEAT)
+				return;
+
+			const RoomRoute* found = shardRooms[server::Server::shard_of(clientId)].find_route(clientId);
+			if (!found)
+				return;
+
+			// Posted, the relay calling this is still in the middle of moving the frame
+			RoomRoute route = *found;
+			uint8_t type = header.type;
+			server.post_to_shard(route.shard, [this, route, type]()
+			{
+				handle_relayed_frame(route, type);
+			});
 		});
 
+		// Real time timers would fire on the wall clock, a simulation ticks from poll() instead
+		if (simulated)
+			return;
 
-		server.add_on_message_received([this](const std::vector<uint8_t>& data)
+		for (size_t shard = 0; shard < server.shard_count(); shard++)
 		{
-			std::string message(data.begin(), data.end());
+			server.post_to_shard(shard, [this, shard]()
+			{
+				start_ticker(shard);
+			});
+		}
+	}
+
+	void GameServer::print_stats(std::ostream& out) const
+	{
+		out << "backend " << server::Server::event_backend() << ", shards " << server.shard_count()
+			<< ", frames in " << server.frames_received() << ", frames out " << server.frames_sent() << std::endl;
+
+		// CPU against wall time per shard; a busy polling shard sits near 100% whatever the load
+		for (size_t shard = 0; shard < server.shard_count(); shard++)
+		{
+			server::ShardLoad load = server.shard_load(shard);
+			double busy = load.wallSeconds > 0 ? 100.0 * load.cpuSeconds / load.wallSeconds : 0;
 
-			auto clientId = server.get_last_client_sent_data();
+			out << "shard " << shard << ": cpu " << load.cpuSeconds << "s of " << load.wallSeconds << "s (" << busy << "%)";
+			if (load.polls > 0)
+				out << ", " << load.polls << " polls, " << (100.0 * load.idlePolls / load.polls) << "% idle";
+			out << std::endl;
+		}
+
+		MoveLatency total;
+		for (const std::unique_ptr<ShardLatency>& latency : shardLatency)
+		{
+			std::lock_guard lock(latency->mutex);
 
-			if (clientId == clientIds.first)
+			total.merge(latency->closed);
+			for (const auto& [clientId, session] : latency->sessions)
+				total.merge(session);
+		}
+
+		total.sendToServer.print(out, "move send to server (us)");
+		total.serverQueue.print(out, "move server queueing (us)");
+	}
+
+	void GameServer::print_latency(std::ostream& out) const
+	{
+		for (const std::unique_ptr<ShardLatency>& latency : shardLatency)
+		{
+			std::lock_guard lock(latency->mutex);
+
+			for (const auto& [clientId, session] : latency->sessions)
 			{
-				server.send_data<std::string>(clientIds.second, message);
+				out << "client " << clientId << std::endl;
+				session.sendToServer.print(out, "  send to server (us)");
+				session.serverQueue.print(out, "  server queueing (us)");
 			}
-			else if (clientId == clientIds.second)
+		}
+	}
+
+	void GameServer::MoveLatency::merge(const MoveLatency& other)
+	{
+		sendToServer.merge(other.sendToServer);
+		serverQueue.merge(other.serverQueue);
+	}
+
+	void GameServer::record_move_latency(uint32_t clientId, const protocol::MoveTrace& trace)
+	{
+		ShardLatency& latency = *shardLatency[server::Server::shard_of(clientId)];
+		std::lock_guard lock(latency.mutex);
+
+		MoveLatency& session = latency.sessions[clientId];
+
+		// Stamps from two clocks; what the sync estimate got wrong can make a fast hop negative
+		if (trace.sentAt != 0)
+			session.sendToServer.record(static_cast<uint64_t>(std::max<int32_t>(0, static_cast<int32_t>(trace.serverReceived - trace.sentAt))));
+
+		session.serverQueue.record(trace.serverForwarded - trace.serverReceived);
+	}
+
+	void GameServer::close_move_latency(uint32_t clientId)
+	{
+		ShardLatency& latency = *shardLatency[server::Server::shard_of(clientId)];
+		std::lock_guard lock(latency.mutex);
+
+		auto it = latency.sessions.find(clientId);
+		if (it == latency.sessions.end())
+			return;
+
+		latency.closed.merge(it->second);
+		latency.sessions.erase(it);
+	}
+
+	std::shared_ptr<transport::LoopbackLink> GameServer::connect_loopback()
+	{
+		return server.connect_loopback();
+	}
+
+	size_t GameServer::poll()
+	{
+		for (size_t shard = 0; shard < server.shard_count(); shard++)
+		{
+			server.post_to_shard(shard, [this, shard]()
+			{
+				tick(shard);
+			});
+		}
+
+		return server.poll();
+	}
+
+	GameServer::~GameServer()
+	{
+		// Shard threads touch the rooms and timers below, stop them first
+		server.stop();
+	}
+
+	void GameServer::begin_match(uint32_t whiteId, uint32_t blackId)
+	{
+		// Both players of a room share the white player's shard
+		size_t home = server::Server::shard_of(whiteId);
+
+		server.migrate_client(blackId, home, [this, whiteId](uint32_t newBlackId)
+		{
+			if (newBlackId == 0)
 			{
-				server.send_data<std::string>(clientIds.first, message);
+				requeue(whiteId);
+				return;
 			}
+			start_match(whiteId, newBlackId);
+		});
+	}
+
+	void GameServer::start_match(uint32_t whiteId, uint32_t blackId)
+	{
+		size_t home = server::Server::shard_of(whiteId);
+		size_t blackShard = server::Server::shard_of(blackId);
+
+		if (!server.has_client(whiteId))
+		{
+			requeue(blackId);
+			return;
+		}
+		if (blackShard == home && !server.has_client(blackId))
+		{
+			requeue(whiteId);
+			return;
+		}
+
+		RoomRegistry& registry = shardRooms[home];
+		uint32_t roomIndex = registry.create_room(whiteId, blackId, static_cast<uint32_t>(shardTimers[home]->wheel.current_tick()));
+		uint32_t generation = registry.generation_of(roomIndex);
+		server.metrics().shard(home).set(server::MG_ROOMS, static_cast<int64_t>(registry.room_count()));
+		server.recorder().shard(home).record(server::FE_ROOM_CREATE, whiteId, 0, blackId, roomIndex);
+		FC_TRACE(room_create, home, roomIndex, whiteId, blackId);
+
+		// A migrated player has a new id, give it a deadline on this shard
+		if (blackShard == home)
+			touch_client(blackId);
+
+		registry.add_route(whiteId, { home, roomIndex, generation, blackId });
 
-			std::cout << "Received message: " << message << std::endl;
+		RoomRoute blackRoute = { home, roomIndex, generation, whiteId };
+		if (blackShard == home)
+		{
+			registry.add_route(blackId, blackRoute);
+		}
+		else
+		{
+			// The socket could not move, so the black player's messages keep arriving on its own shard
+			server.post_to_shard(blackShard, [this, blackShard, blackId, blackRoute]()
+			{
+				shardRooms[blackShard].add_route(blackId, blackRoute);
+			});
+		}
+
+		// Posted after the route so the black player cannot answer before it exists
+		uint8_t flags = validateMoves ? 0 : protocol::FLAG_RELAY;
+		// The white player never moves shards, so its id names the room for spectators
+		uint32_t room = protocol::to_wire32(whiteId);
+		protocol::StartMessage blackStart{ chess::PL_BLACK, room, protocol::to_wire64(resume_token(home, roomIndex, chess::PL_BLACK)) };
+		protocol::StartMessage whiteStart{ chess::PL_WHITE, room, protocol::to_wire64(resume_token(home, roomIndex, chess::PL_WHITE)) };
+		server.send_data(blackId, protocol::encode_frame(protocol::MSG_START, blackStart, 0, flags));
+		server.send_data(whiteId, protocol::encode_frame(protocol::MSG_START, whiteStart, 0, flags));
+
+		// Players left on different shards stay on the user space relay
+		if (!validateMoves && blackShard == home)
+			server.start_relay(whiteId, blackId);
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Room {}:{} started: {} vs {} ({} active on shard)">(home, roomIndex, whiteId, blackId, registry.room_count());
+		}
+	}
+
+	void GameServer::handle_match_request(uint32_t clientId, const RoomRoute& route, const std::vector<uint8_t>& frame, chess::GameClock::time_point received)
+	{
+		RoomRegistry& registry = shardRooms[route.shard];
+		if (!registry.is_active(route.room, route.generation))
+			return;
+
+		chess::Player player = registry.white_of(route.room) == clientId ? chess::PL_WHITE : chess::PL_BLACK;
+
+		std::vector<uint8_t> broadcast;
+		std::vector<uint8_t> reply;
+
+		server::ShardMetrics& shardMetrics = server.metrics().shard(route.shard);
+		chess::GameClock::time_point picked = chess::GameClock::now();
+		shardMetrics.record(server::MH_ROOM_QUEUE, picked - received);
+
+		MatchState& match = registry.match_of(route.room);
+		MatchResult result = match.handle_request(player, frame, received, broadcast, reply);
+		shardMetrics.record(server::MH_VALIDATION, chess::GameClock::now() - picked);
+		server.recorder().shard(route.shard).record(server::FE_REQUEST, clientId, protocol::frame_header(frame).type, result, route.room);
+		FC_TRACE(frame_validated, clientId, protocol::frame_header(frame).type, static_cast<int>(result), route.room);
+
+		if (result != MR_REJECTED)
+		{
+			uint32_t tick = static_cast<uint32_t>(shardTimers[route.shard]->wheel.current_tick());
+			registry.record_update(route.room, tick, static_cast<uint32_t>(to_ticks(std::chrono::milliseconds(protocol::MoveCooldownMs))));
+		}
+
+		if (!reply.empty())
+			server.send_data(clientId, reply);
+
+		if (!broadcast.empty())
+		{
+			// A dropped player catches up from the snapshot it gets on resuming
+			for (chess::Player side : { chess::PL_WHITE, chess::PL_BLACK })
+			{
+				if (registry.away_until(route.room, side) == 0)
+					server.send_data(registry.player_of(route.room, side), broadcast);
+			}
+
+			send_to_spectators(route.shard, route.room, broadcast);
+		}
+
+		if (const protocol::MoveTrace* trace = match.traced_move())
+			record_move_latency(clientId, *trace);
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Room {}:{} {} request {} from {} (seq {})">(route.shard, route.room, result == MR_REJECTED ? "rejected" : "accepted",
+				protocol::frame_header(frame).type, clientId, match.sequence());
+		}
+
+		if (result == MR_GAME_OVER)
+			end_match(route.shard, route.room, route.generation);
+	}
+
+	void GameServer::handle_spectate(uint32_t clientId, const std::vector<uint8_t>& frame)
+	{
+		size_t shard = server::Server::shard_of(clientId);
+		RoomRegistry& registry = shardRooms[shard];
+
+		// The room is named by its white player, who lives on the room's shard
+		protocol::SpectateMessage request{};
+		uint32_t white = protocol::decode_payload(frame, request) ? protocol::from_wire32(request.room) : 0;
+
+		// Players and spectators already watching cannot, and relay rooms have no board to show
+		if (white == 0 || server::Server::shard_of(white) >= shardRooms.size() || !validateMoves
+			|| registry.find_route(clientId) || registry.find_watcher(clientId))
+		{
+			server.send_data(clientId, protocol::encode_frame(protocol::MSG_REJECT, protocol::RejectMessage{ protocol::MSG_SPECTATE, 0, 0 }));
+			return;
+		}
+
+		{
+			std::lock_guard lock(matchmakingMutex);
+			if (openPlayerIds.contains(clientId))
+				dequeue_player(clientId);
+		}
+
+		size_t roomShard = server::Server::shard_of(white);
+		server.post_to_shard(roomShard, [this, clientId, white, roomShard]()
+		{
+			const RoomRoute* found = shardRooms[roomShard].find_route(white);
+			if (!found || found->shard != roomShard || shardRooms[roomShard].white_of(found->room) != white)
+			{
+				server.send_data(clientId, protocol::encode_frame(protocol::MSG_REJECT, protocol::RejectMessage{ protocol::MSG_SPECTATE, 0, 0 }));
+				return;
+			}
+
+			add_spectator(clientId, *found);
+		});
+	}
+
+	void GameServer::add_spectator(uint32_t clientId, const RoomRoute& route)
+	{
+		RoomRegistry& registry = shardRooms[route.shard];
+		if (!registry.is_active(route.room, route.generation))
+		{
+			server.send_data(clientId, protocol::encode_frame(protocol::MSG_REJECT, protocol::RejectMessage{ protocol::MSG_SPECTATE, 0, 0 }));
+			return;
+		}
+
+		registry.add_spectator(route.room, clientId);
+
+		// Events are queued behind the snapshot on the spectator's shard, so none is missed or doubled
+		server.send_shared({ clientId }, snapshot_frame(route.shard, route.room));
+
+		size_t spectatorShard = server::Server::shard_of(clientId);
+		RoomRoute watching = { route.shard, route.room, route.generation, 0 };
+		server.post_to_shard(spectatorShard, [this, spectatorShard, clientId, watching]()
+		{
+			if (server.has_client(clientId))
+				shardRooms[spectatorShard].add_watcher(clientId, watching);
+		});
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Room {}:{} gained spectator {} ({} watching)">(route.shard, route.room, clientId, registry.spectators_of(route.room).size());
+		}
+	}
+
+	void GameServer::forget_spectator(uint32_t clientId, const RoomRoute& route)
+	{
+		shardRooms[server::Server::shard_of(clientId)].remove_watcher(clientId);
+
+		server.post_to_shard(route.shard, [this, clientId, route]()
+		{
+			shardRooms[route.shard].remove_spectator(route.room, route.generation, clientId);
 		});
 	}
 
+	void GameServer::send_to_spectators(size_t shard, uint32_t roomIndex, const std::vector<uint8_t>& frames)
+	{
+		const std::vector<uint32_t>& spectators = shardRooms[shard].spectators_of(roomIndex);
+		if (spectators.empty())
+			return;
+
+		server.send_shared(spectators, std::make_shared<const std::vector<uint8_t>>(frames), snapshot_frame(shard, roomIndex));
+	}
+
+	server::Server::SharedFrames GameServer::snapshot_frame(size_t shard, uint32_t roomIndex) const
+	{
+		// Cooldowns are counted in wheel ticks and sent as they are
+		static_assert(TimerTick == std::chrono::milliseconds(protocol::SnapshotCooldownUnitMs));
+
+		const RoomRegistry& registry = shardRooms[shard];
+
+		protocol::SnapshotMessage snapshot;
+		registry.export_snapshot(roomIndex, static_cast<uint32_t>(shardTimers[shard]->wheel.current_tick()), snapshot);
+
+		return std::make_shared<const std::vector<uint8_t>>(protocol::encode_frame(protocol::MSG_SNAPSHOT, snapshot, registry.sequence_of(roomIndex)));
+	}
+
+	void GameServer::handle_resume(uint32_t clientId, const std::vector<uint8_t>& frame)
+	{
+		protocol::ResumeMessage request{};
+		uint64_t token = protocol::decode_payload(frame, request) ? protocol::from_wire64(request.token) : 0;
+
+		size_t roomShard = static_cast<size_t>(token >> 56);
+		uint32_t roomIndex = static_cast<uint32_t>(token >> 32) & 0xFFFFFF;
+		uint32_t secret = static_cast<uint32_t>(token);
+
+		if (token == 0 || roomShard >= shardRooms.size() || !validateMoves)
+		{
+			server.send_data(clientId, protocol::encode_frame(protocol::MSG_REJECT, protocol::RejectMessage{ protocol::MSG_RESUME, 0, 0 }));
+			return;
+		}
+
+		// Players sit on their room's shard, so the client moves there first like a matched black player
+		server.migrate_client(clientId, roomShard, [this, roomShard, roomIndex, secret](uint32_t newId)
+		{
+			if (newId != 0)
+				resume_seat(roomShard, newId, roomIndex, secret);
+		});
+	}
+
+	void GameServer::resume_seat(size_t shard, uint32_t clientId, uint32_t roomIndex, uint32_t secret)
+	{
+		// Gone again before the seat was found, the grace window keeps running
+		if (server::Server::shard_of(clientId) == shard && !server.has_client(clientId))
+			return;
+
+		RoomRegistry& registry = shardRooms[shard];
+		uint32_t generation = registry.generation_of(roomIndex);
+
+		std::optional<chess::Player> seat;
+		if (registry.is_active(roomIndex, generation))
+		{
+			for (chess::Player side : { chess::PL_WHITE, chess::PL_BLACK })
+			{
+				if (registry.away_until(roomIndex, side) != 0 && registry.secret_of(roomIndex, side) == secret)
+					seat = side;
+			}
+		}
+
+		if (!seat)
+		{
+			server.send_data(clientId, protocol::encode_frame(protocol::MSG_REJECT, protocol::RejectMessage{ protocol::MSG_RESUME, 0, 0 }));
+			return;
+		}
+
+		chess::Player side = *seat;
+		chess::Player other = side == chess::PL_WHITE ? chess::PL_BLACK : chess::PL_WHITE;
+		uint32_t opponent = registry.player_of(roomIndex, other);
+
+		registry.set_player(roomIndex, side, clientId);
+		registry.set_away(roomIndex, side, 0);
+
+		size_t clientShard = server::Server::shard_of(clientId);
+		RoomRoute route = { shard, roomIndex, generation, opponent };
+		if (clientShard == shard)
+		{
+			// A migrated client has a new id, give it a deadline on this shard
+			touch_client(clientId);
+			registry.add_route(clientId, route);
+		}
+		else
+		{
+			server.post_to_shard(clientShard, [this, clientShard, clientId, route]()
+			{
+				shardRooms[clientShard].add_route(clientId, route);
+			});
+		}
+
+		if (registry.away_until(roomIndex, other) == 0)
+		{
+			size_t opponentShard = server::Server::shard_of(opponent);
+			RoomRoute opponentRoute = { shard, roomIndex, generation, clientId };
+			server.post_to_shard(opponentShard, [this, opponentShard, opponent, opponentRoute]()
+			{
+				shardRooms[opponentShard].add_route(opponent, opponentRoute);
+			});
+		}
+
+		// Who the player is and then where the board stands, one reply to the one request
+		protocol::StartMessage start{ static_cast<uint8_t>(side), protocol::to_wire32(registry.white_of(roomIndex)), protocol::to_wire64(resume_token(shard, roomIndex, side)) };
+		server.send_data(clientId, protocol::encode_frame(protocol::MSG_START, start, 0, protocol::FLAG_RESUMED));
+		server.send_data(clientId, *snapshot_frame(shard, roomIndex));
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Room {}:{} resumed {} as {}">(shard, roomIndex, side == chess::PL_WHITE ? "white" : "black", clientId);
+		}
+	}
+
+	void GameServer::seat_left(const RoomRoute& route, uint32_t clientId)
+	{
+		RoomRegistry& registry = shardRooms[route.shard];
+		if (!registry.is_active(route.room, route.generation))
+			return;
+
+		chess::Player side = registry.white_of(route.room) == clientId ? chess::PL_WHITE : chess::PL_BLACK;
+		if (registry.player_of(route.room, side) != clientId)
+			return;
+
+		ShardTimers& timers = *shardTimers[route.shard];
+		uint64_t grace = to_ticks(std::chrono::milliseconds(protocol::ResumeGraceMs));
+
+		registry.set_away(route.room, side, static_cast<uint32_t>(timers.wheel.current_tick() + grace));
+		timers.wheel.schedule(grace, { TM_RESUME, route.room });
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Room {}:{} holds the seat of {} for a reconnect">(route.shard, route.room, clientId);
+		}
+	}
+
+	void GameServer::expire_seats(size_t shard, uint32_t roomIndex)
+	{
+		RoomRegistry& registry = shardRooms[shard];
+		uint32_t generation = registry.generation_of(roomIndex);
+		if (!registry.is_active(roomIndex, generation))
+			return;
+
+		// The room may have been reused, or the player came back and left again later
+		uint32_t tick = static_cast<uint32_t>(shardTimers[shard]->wheel.current_tick());
+		for (chess::Player side : { chess::PL_WHITE, chess::PL_BLACK })
+		{
+			uint32_t until = registry.away_until(roomIndex, side);
+			if (until == 0 || until > tick)
+				continue;
+
+			chess::Player other = side == chess::PL_WHITE ? chess::PL_BLACK : chess::PL_WHITE;
+			if (registry.away_until(roomIndex, other) == 0)
+				server.send_data(registry.player_of(roomIndex, other), protocol::encode_frame(protocol::MSG_OPPONENT_LEFT));
+
+			end_match(shard, roomIndex, generation);
+			return;
+		}
+	}
+
+	uint64_t GameServer::resume_token(size_t shard, uint32_t roomIndex, chess::Player side) const
+	{
+		if (!validateMoves || roomIndex > 0xFFFFFF)
+			return 0;
+
+		return (static_cast<uint64_t>(shard) << 56) | (static_cast<uint64_t>(roomIndex) << 32) | shardRooms[shard].secret_of(roomIndex, side);
+	}
+
+	void GameServer::handle_relayed_frame(const RoomRoute& route, uint8_t type)
+	{
+		RoomRegistry& registry = shardRooms[route.shard];
+		if (!registry.is_active(route.room, route.generation))
+			return;
+
+		registry.touch(route.room, static_cast<uint32_t>(shardTimers[route.shard]->wheel.current_tick()));
+
+		if (type == protocol::MSG_GAME_OVER)
+			end_match(route.shard, route.room, route.generation);
+	}
+
+	void GameServer::finish_match(size_t currentShard, const RoomRoute& route)
+	{
+		if (route.shard == currentShard)
+		{
+			end_match(route.shard, route.room, route.generation);
+			return;
+		}
+
+		server.post_to_shard(route.shard, [this, route]()
+		{
+			end_match(route.shard, route.room, route.generation);
+		});
+	}
+
+	void GameServer::end_match(size_t shard, uint32_t roomIndex, uint32_t generation)
+	{
+		RoomRegistry& registry = shardRooms[shard];
+		if (!registry.is_active(roomIndex, generation))
+			return;
+
+		for (uint32_t player : { registry.white_of(roomIndex), registry.black_of(roomIndex) })
+		{
+			server.stop_relay(player);
+
+			size_t playerShard = server::Server::shard_of(player);
+			if (playerShard == shard)
+			{
+				registry.remove_route(player, roomIndex, generation);
+				continue;
+			}
+
+			server.post_to_shard(playerShard, [this, playerShard, player, roomIndex, generation]()
+			{
+				shardRooms[playerShard].remove_route(player, roomIndex, generation);
+			});
+		}
+
+		// Spectators stay connected and may watch another room
+		const std::vector<uint32_t>& spectators = registry.spectators_of(roomIndex);
+		if (!spectators.empty())
+		{
+			server.send_shared(spectators, std::make_shared<const std::vector<uint8_t>>(protocol::encode_frame(protocol::MSG_ROOM_CLOSED)));
+
+			for (uint32_t spectator : spectators)
+			{
+				size_t spectatorShard = server::Server::shard_of(spectator);
+				server.post_to_shard(spectatorShard, [this, spectatorShard, spectator]()
+				{
+					shardRooms[spectatorShard].remove_watcher(spectator);
+				});
+			}
+		}
+
+		registry.destroy_room(roomIndex, generation);
+		server.metrics().shard(shard).set(server::MG_ROOMS, static_cast<int64_t>(registry.room_count()));
+		server.recorder().shard(shard).record(server::FE_ROOM_DESTROY, 0, 0, 0, roomIndex);
+		FC_TRACE(room_destroy, shard, roomIndex);
+
+		if constexpr (SERVER_DEBUG)
+		{
+			RoomStats stats = registry.stats();
+			logging::info<"Room {}:{} closed ({} active on shard, {} pieces in play, {} cooldowns pending)">(shard, roomIndex, stats.rooms, stats.pieces, stats.cooldowns);
+		}
+	}
+
+	void GameServer::start_ticker(size_t shard)
+	{
+		ShardTimers& timers = *shardTimers[shard];
+		timers.ticker.expires_after(TimerTick);
+		timers.ticker.async_wait([this, shard](const asio::error_code& error)
+		{
+			if (error)
+				return;
+
+			tick(shard);
+			start_ticker(shard);
+		});
+	}
+
+	void GameServer::tick(size_t shard)
+	{
+		// Ticks come from the clock, a late wakeup turns the wheel several steps at once
+		ShardTimers& timers = *shardTimers[shard];
+		uint64_t now = to_ticks(std::chrono::duration_cast<std::chrono::milliseconds>(chess::GameClock::now() - timers.start));
+
+		timers.wheel.advance_to(now, [this, shard](const TimerEvent& event)
+		{
+			handle_timer(shard, event);
+		});
+
+		run_room_passes(shard, now);
+	}
+
+	void GameServer::handle_timer(size_t shard, const TimerEvent& event)
+	{
+		switch (event.kind)
+		{
+		case TM_HEARTBEAT:
+		{
+			shardTimers[shard]->heartbeats.erase(event.id);
+
+			if (!server.has_client(event.id))
+				break;
+
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::info<"Client {} missed its heartbeat">(event.id);
+			}
+
+			server.disconnect_client(event.id);
+			break;
+		}
+		case TM_RESUME:
+			expire_seats(shard, event.id);
+			break;
+		default:
+			break;
+		}
+	}
+
+	void GameServer::run_room_passes(size_t shard, uint64_t tick)
+	{
+		RoomRegistry& registry = shardRooms[shard];
+		ShardTimers& timers = *shardTimers[shard];
+
+		registry.expire_cooldowns(static_cast<uint32_t>(tick), [&registry](uint32_t roomIndex, chess::Player player, int square)
+		{
+			registry.match_of(roomIndex).expire_cooldown(player, square);
+		});
+
+		if (tick - timers.lastIdleScan < to_ticks(IdleScanInterval))
+			return;
+
+		timers.lastIdleScan = tick;
+		timers.idleRooms.clear();
+		registry.collect_idle(static_cast<uint32_t>(tick), static_cast<uint32_t>(to_ticks(IdleRoomTimeout)), timers.idleRooms);
+
+		for (uint32_t roomIndex : timers.idleRooms)
+			close_idle_room(shard, roomIndex);
+	}
+
+	void GameServer::close_idle_room(size_t shard, uint32_t roomIndex)
+	{
+		RoomRegistry& registry = shardRooms[shard];
+
+		std::vector<uint8_t> closed = protocol::encode_frame(protocol::MSG_ROOM_CLOSED);
+		server.send_data(registry.white_of(roomIndex), closed);
+		server.send_data(registry.black_of(roomIndex), closed);
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Room {}:{} closed for inactivity">(shard, roomIndex);
+		}
+
+		end_match(shard, roomIndex, registry.generation_of(roomIndex));
+	}
+
+	uint64_t GameServer::to_ticks(std::chrono::milliseconds duration)
+	{
+		return static_cast<uint64_t>(duration / TimerTick);
+	}
+
+	void GameServer::touch_client(uint32_t clientId)
+	{
+		ShardTimers& timers = *shardTimers[server::Server::shard_of(clientId)];
+		uint64_t deadline = to_ticks(std::chrono::milliseconds(protocol::HeartbeatTimeoutMs));
+
+		auto it = timers.heartbeats.find(clientId);
+		if (it != timers.heartbeats.end() && timers.wheel.reschedule(it->second, deadline))
+			return;
+
+		timers.heartbeats[clientId] = timers.wheel.schedule(deadline, { TM_HEARTBEAT, clientId });
+	}
+
+	void GameServer::forget_client(uint32_t clientId)
+	{
+		ShardTimers& timers = *shardTimers[server::Server::shard_of(clientId)];
+
+		auto it = timers.heartbeats.find(clientId);
+		if (it == timers.heartbeats.end())
+			return;
+
+		timers.wheel.cancel(it->second);
+		timers.heartbeats.erase(it);
+	}
+
+	void GameServer::requeue(uint32_t clientId)
+	{
+		if (clientId == 0)
+			return;
+
+		std::lock_guard lock(matchmakingMutex);
+		enqueue_player(clientId);
+	}
+
+	void GameServer::enqueue_player(uint32_t clientId)
+	{
+		openPlayerIds.add_player(clientId);
+
+#ifndef PLATFORM_WINDOWS
+		// Nobody local to play against, let the broker look in the other processes
+		if (broker && openPlayerIds.contains(clientId))
+			broker->send({ server::BRK_WAITING, clientId, 0 });
+#endif
+	}
+
+	void GameServer::dequeue_player(uint32_t clientId)
+	{
+		openPlayerIds.remove_player(clientId);
+
+#ifndef PLATFORM_WINDOWS
+		if (broker)
+			broker->send({ server::BRK_CANCEL, clientId, 0 });
+#endif
+	}
+
+#ifndef PLATFORM_WINDOWS
+	void GameServer::handle_broker_message(const server::BrokerMessage& message, int attachedFd)
+	{
+		switch (message.type)
+		{
+		case server::BRK_SEND:
+		{
+			{
+				std::lock_guard lock(matchmakingMutex);
+				if (!openPlayerIds.contains(message.ticket))
+				{
+					broker->send({ server::BRK_HANDOFF_FAILED, message.ticket, message.peerTicket });
+					break;
+				}
+				openPlayerIds.remove_player(message.ticket);
+			}
+
+			server.detach_client(message.ticket, [this, message](server::Server::NativeHandle native)
+			{
+				if (native == server::Server::InvalidNativeHandle)
+				{
+					broker->send({ server::BRK_HANDOFF_FAILED, message.ticket, message.peerTicket });
+					return;
+				}
+
+				broker->send({ server::BRK_HANDOFF, message.ticket, message.peerTicket }, native);
+				::close(native);
+			});
+			break;
+		}
+		case server::BRK_ADOPT:
+		{
+			if (attachedFd < 0)
+				break;
+
+			uint32_t opponent = message.peerTicket;
+			size_t shard = opponent ? server::Server::shard_of(opponent) : 0;
+
+			server.adopt_client(attachedFd, shard, [this, opponent](uint32_t clientId)
+			{
+				if (clientId == 0)
+					return;
+
+				touch_client(clientId);
+
+				{
+					std::lock_guard lock(matchmakingMutex);
+					if (opponent == 0 || !openPlayerIds.contains(opponent))
+					{
+						enqueue_player(clientId);
+						return;
+					}
+					openPlayerIds.remove_player(opponent);
+				}
+
+				begin_match(opponent, clientId);
+			});
+			break;
+		}
+		default:
+			if (attachedFd >= 0)
+				::close(attachedFd);
+			break;
+		}
+	}
+#endif
+
 	void Players::add_player(uint32_t id)
 	{
+		if (positions.contains(id))
+			return;
+
 		players.push_back(id);
+		positions[id] = std::prev(players.end());
 
-		if (players.size() >= 2)
+		while (players.size() >= 2)
 		{
-			callback(players);
+			uint32_t first = players.front();
+			players.pop_front();
+			positions.erase(first);
+
+			uint32_t second = players.front();
+			players.pop_front();
+			positions.erase(second);
+
+			if (callback)
+				callback(first, second);
 		}
 	}
+
 	void Players::remove_player(uint32_t id)
 	{
-		auto it = std::find(players.begin(), players.end(), id);
-		if (it != players.end())
+		auto it = positions.find(id);
+		if (it != positions.end())
 		{
-			players.erase(it);
+			players.erase(it->second);
+			positions.erase(it);
 		}
 	}
 
-	void Players::set_callback(std::function<void(std::vector<uint32_t>&)> cb)
+	bool Players::contains(uint32_t id) const
+	{
+		return positions.contains(id);
+	}
+
+	size_t Players::size() const
+	{
+		return players.size();
+	}
+
+	void Players::set_callback(std::function<void(uint32_t, uint32_t)> cb)
 	{
 		callback = std::move(cb);
 	}
-}
\ No newline at end of file
+}
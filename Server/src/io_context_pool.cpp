@@ -0,0 +1,164 @@
+#include "headers.h"
+#include "io_context_pool.h"
+#include "binary_log.h"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+
+namespace server
+{
+	IoContextPool::IoContextPool(size_t shardCount, bool pinThreads, bool busyPoll, size_t maxDefaultShards)
+		: _pinThreads(pinThreads), _busyPoll(busyPoll)
+	{
+		if (shardCount == 0)
+			shardCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, maxDefaultShards);
+
+		_shards.reserve(shardCount);
+		for (size_t i = 0; i < shardCount; i++)
+		{
+			_shards.push_back(std::make_unique<Shard>());
+		}
+	}
+
+	void IoContextPool::run()
+	{
+		for (size_t i = 0; i < _shards.size(); i++)
+		{
+			Shard& shard = *_shards[i];
+			shard.started = std::chrono::steady_clock::now();
+
+			shard.thread = std::thread([this, &shard, i]()
+				{
+					if (_pinThreads)
+						pin_current_thread(i);
+
+					try
+					{
+						if (_busyPoll)
+							busy_poll(shard);
+						else
+							shard.ioContext.run();
+					}
+					catch (const std::exception& e)
+					{
+						if constexpr (SERVER_DEBUG)
+						{
+							logging::error<"Shard {} IO context error: {}">(i, e.what());
+						}
+					}
+				});
+		}
+	}
+
+	void IoContextPool::stop()
+	{
+		for (auto& shard : _shards)
+		{
+			shard->workGuard.reset();
+			shard->ioContext.stop();
+		}
+
+		for (auto& shard : _shards)
+		{
+			if (shard->thread.joinable())
+				shard->thread.join();
+		}
+	}
+
+	size_t IoContextPool::size() const
+	{
+		return _shards.size();
+	}
+
+	asio::io_context& IoContextPool::get_context(size_t shard)
+	{
+		return _shards[shard]->ioContext;
+	}
+
+	size_t IoContextPool::next_shard()
+	{
+		return _nextShard.fetch_add(1, std::memory_order_relaxed) % _shards.size();
+	}
+
+	bool IoContextPool::running_in_shard(size_t shard) const
+	{
+		return _shards[shard]->ioContext.get_executor().running_in_this_thread();
+	}
+
+	ShardLoad IoContextPool::load(size_t shard) const
+	{
+		Shard& target = *_shards[shard];
+
+		ShardLoad load;
+		load.cpuSeconds = thread_cpu_seconds(target.thread);
+		load.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - target.started).count();
+		load.polls = target.polls.load(std::memory_order_relaxed);
+		load.idlePolls = target.idlePolls.load(std::memory_order_relaxed);
+		return load;
+	}
+
+	IoContextPool::~IoContextPool()
+	{
+		stop();
+	}
+
+	void IoContextPool::pin_current_thread(size_t core)
+	{
+		size_t cores = std::max(1u, std::thread::hardware_concurrency());
+		core %= cores;
+
+#if defined(PLATFORM_WINDOWS)
+		SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core);
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(core, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+	}
+
+	void IoContextPool::busy_poll(Shard& shard)
+	{
+		// The work guard keeps poll() from stopping the context when it runs dry, so only stop() ends this
+		while (!shard.ioContext.stopped())
+		{
+			size_t handled = shard.ioContext.poll();
+
+			shard.polls.fetch_add(1, std::memory_order_relaxed);
+			if (handled == 0)
+				shard.idlePolls.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	double IoContextPool::thread_cpu_seconds(std::thread& thread)
+	{
+		if (!thread.joinable())
+			return 0;
+
+#if defined(PLATFORM_WINDOWS)
+		FILETIME creation, exit, kernel, user;
+		if (!GetThreadTimes(thread.native_handle(), &creation, &exit, &kernel, &user))
+			return 0;
+
+		auto ticks = [](const FILETIME& time)
+			{
+				return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+			};
+		return (ticks(kernel) + ticks(user)) / 1e7;
+#elif defined(__linux__)
+		clockid_t clock;
+		timespec time;
+		if (pthread_getcpuclockid(thread.native_handle(), &clock) != 0 || clock_gettime(clock, &time) != 0)
+			return 0;
+
+		return time.tv_sec + time.tv_nsec / 1e9;
+#else
+		return 0;
+#endif
+	}
+}
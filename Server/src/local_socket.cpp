@@ -0,0 +1,57 @@
+#include "headers.h"
+#include "local_socket.h"
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace server
+{
+	void LocalSocketFile::remove() const
+	{
+		if (path.empty())
+			return;
+
+		struct stat bound;
+		if (::lstat(path.c_str(), &bound) == 0 && static_cast<uint64_t>(bound.st_dev) == device && static_cast<uint64_t>(bound.st_ino) == inode)
+			::unlink(path.c_str());
+	}
+
+	LocalSocketFile bind_local_acceptor(asio::local::stream_protocol::acceptor& acceptor, const std::string& path)
+	{
+		asio::local::stream_protocol::endpoint endpoint(path);
+
+		struct stat existing;
+		if (::lstat(path.c_str(), &existing) == 0)
+		{
+			if (!S_ISSOCK(existing.st_mode))
+				throw std::runtime_error(path + " exists and is not a socket");
+
+			asio::local::stream_protocol::socket probe(acceptor.get_executor());
+			asio::error_code ec;
+			probe.connect(endpoint, ec);
+			if (ec != asio::error::connection_refused)
+				throw std::runtime_error("Another process is accepting on " + path);
+
+			::unlink(path.c_str());
+		}
+
+		acceptor.open(endpoint.protocol());
+		acceptor.bind(endpoint);
+		acceptor.listen();
+
+		LocalSocketFile bound;
+		bound.path = path;
+
+		struct stat created;
+		if (::lstat(path.c_str(), &created) == 0)
+		{
+			bound.device = static_cast<uint64_t>(created.st_dev);
+			bound.inode = static_cast<uint64_t>(created.st_ino);
+		}
+		return bound;
+	}
+}
+
+#endif
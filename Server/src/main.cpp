@@ -1,12 +1,116 @@
 #include "headers.h"
 #include "game_server.h"
+#include "match_broker.h"
+#include "simulation.h"
+#include "binary_log.h"
 
-int main()
+int main(int argc, char** argv)
 {
-	game::GameServer server(8080);
+	server::ServerConfig config;
+	std::string brokerPath;
+	std::string runBrokerPath;
+	bool printStats = false;
+	bool printLatency = false;
+	bool validateMoves = true;
+	size_t simulatedGames = 0;
+	std::string flightDumpPath;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "--shards" && i + 1 < argc)
+			config.shardCount = std::stoul(argv[++i]);
+		else if (arg == "--pin-threads")
+			config.pinThreads = true;
+		else if (arg == "--reuse-port")
+			config.reusePort = true;
+		else if (arg == "--broker" && i + 1 < argc)
+			brokerPath = argv[++i];
+		else if (arg == "--run-broker" && i + 1 < argc)
+			runBrokerPath = argv[++i];
+		else if (arg == "--busy-poll")
+			config.busyPoll = true;
+		else if (arg == "--busy-poll-us" && i + 1 < argc)
+			config.busyPollMicros = std::stoi(argv[++i]);
+		else if (arg == "--local" && i + 1 < argc)
+			config.localPath = argv[++i];
+		else if (arg == "--relay")
+			validateMoves = false;
+		else if (arg == "--stats")
+			printStats = true;
+		else if (arg == "--latency")
+			printLatency = true;
+		else if (arg == "--metrics-port" && i + 1 < argc)
+			config.metricsPort = static_cast<unsigned short>(std::stoul(argv[++i]));
+		else if (arg == "--metrics-file" && i + 1 < argc)
+			config.metricsPath = argv[++i];
+		else if (arg == "--metrics-interval" && i + 1 < argc)
+		{
+			config.metricsInterval = std::chrono::seconds(std::stoul(argv[++i]));
+			if (config.metricsInterval < server::MetricsExporter::MinInterval)
+			{
+				std::cerr << "--metrics-interval must be at least " << server::MetricsExporter::MinInterval.count() << " second" << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--log-file" && i + 1 < argc)
+		{
+			if (!logging::open_file(argv[++i]))
+				std::cerr << "Could not open log file " << argv[i] << std::endl;
+		}
+		else if (arg == "--flight-recorder" && i + 1 < argc)
+			config.flightRecorderPath = argv[++i];
+		else if (arg == "--flight-events" && i + 1 < argc)
+			config.flightRecorderEvents = std::stoul(argv[++i]);
+		else if (arg == "--read-flight-recorder" && i + 1 < argc)
+			flightDumpPath = argv[++i];
+		else if (arg == "--simulate" && i + 1 < argc)
+			simulatedGames = std::stoul(argv[++i]);
+	}
+
+	// Decodes a flight recorder dump and exits
+	if (!flightDumpPath.empty())
+	{
+		if (!server::FlightRecorder::read_dump(flightDumpPath, std::cout))
+		{
+			std::cerr << flightDumpPath << " is not a flight recorder dump" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+#ifndef PLATFORM_WINDOWS
+	if (!runBrokerPath.empty())
+	{
+		server::MatchBroker broker(runBrokerPath);
+		broker.run();
+		return 0;
+	}
+#endif
+
+	// Plays scripted games in process on virtual time and exits, no sockets involved
+	if (simulatedGames > 0)
+	{
+		game::SimulationReport report = game::run_simulation(simulatedGames, config.shardCount);
+		logging::flush();
+		game::print_simulation(report, std::cout);
+		return 0;
+	}
+
+	game::GameServer server(8080, config, brokerPath, validateMoves);
 
 	std::cin.get();
 	std::cin.get();
 	std::cin.get();
 
+	// Stats go to stdout, get the log lines written before them out first
+	logging::flush();
+
+	if (printStats)
+		server.print_stats(std::cout);
+
+	if (printLatency)
+		server.print_latency(std::cout);
+
 }
\ No newline at end of file
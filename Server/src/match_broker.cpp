@@ -0,0 +1,458 @@
+#include "headers.h"
+#include "match_broker.h"
+#include "binary_log.h"
+
+#ifndef PLATFORM_WINDOWS
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace server
+{
+	bool send_broker_message(int fd, const BrokerMessage& message, int attachedFd, std::chrono::milliseconds timeout)
+	{
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+
+		iovec iov{ const_cast<BrokerMessage*>(&message), sizeof(message) };
+
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		if (attachedFd >= 0)
+		{
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			std::memcpy(CMSG_DATA(cmsg), &attachedFd, sizeof(int));
+		}
+
+		while (true)
+		{
+			ssize_t sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (sent == static_cast<ssize_t>(sizeof(message)))
+				return true;
+
+			if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			{
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+				if (left <= std::chrono::milliseconds(0))
+					return false;
+
+				pollfd pfd{ fd, POLLOUT, 0 };
+				::poll(&pfd, 1, static_cast<int>(std::min<int64_t>(left.count() + 1, 100)));
+				continue;
+			}
+
+			// Messages are far below the socket buffer size, a short write means the link is broken
+			return false;
+		}
+	}
+
+	bool receive_broker_message(int fd, BrokerMessage& message, int& attachedFd, bool& wouldBlock)
+	{
+		attachedFd = -1;
+		wouldBlock = false;
+
+		iovec iov{ &message, sizeof(message) };
+
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t received = ::recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (received < 0)
+		{
+			wouldBlock = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+			return wouldBlock;
+		}
+		if (received != static_cast<ssize_t>(sizeof(message)))
+			return false;
+
+		for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+				std::memcpy(&attachedFd, CMSG_DATA(cmsg), sizeof(int));
+		}
+
+		return true;
+	}
+
+	MatchBroker::MatchBroker(const std::string& path)
+		: _acceptor(_ioContext), _socketFile(bind_local_acceptor(_acceptor, path))
+	{
+		start_accept();
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Match broker listening on {}">(path);
+		}
+	}
+
+	void MatchBroker::run()
+	{
+		_ioContext.run();
+	}
+
+	void MatchBroker::stop()
+	{
+		_ioContext.stop();
+	}
+
+	MatchBroker::~MatchBroker()
+	{
+		stop();
+		_socketFile.remove();
+	}
+
+	void MatchBroker::start_accept()
+	{
+		_acceptor.async_accept([this](const asio::error_code& error, asio::local::stream_protocol::socket socket)
+			{
+				if (error)
+				{
+					if (_acceptor.is_open())
+						start_accept();
+					return;
+				}
+
+				uint32_t worker = ++_nextWorkerId;
+				_workers[worker] = std::make_shared<asio::local::stream_protocol::socket>(std::move(socket));
+
+				if constexpr (SERVER_DEBUG)
+				{
+					logging::info<"Worker {} joined the broker">(worker);
+				}
+
+				start_read(worker);
+				start_accept();
+			});
+	}
+
+	void MatchBroker::start_read(uint32_t worker)
+	{
+		auto it = _workers.find(worker);
+		if (it == _workers.end())
+			return;
+
+		auto socket = it->second;
+		socket->async_wait(asio::socket_base::wait_read, [this, worker, socket](const asio::error_code& error)
+			{
+				if (error)
+				{
+					drop_worker(worker);
+					return;
+				}
+
+				BrokerMessage message;
+				int attachedFd = -1;
+				bool wouldBlock = false;
+
+				while (receive_broker_message(socket->native_handle(), message, attachedFd, wouldBlock))
+				{
+					if (wouldBlock)
+						break;
+					handle_message(worker, message, attachedFd);
+				}
+
+				if (!wouldBlock)
+				{
+					drop_worker(worker);
+					return;
+				}
+
+				start_read(worker);
+			});
+	}
+
+	void MatchBroker::handle_message(uint32_t worker, const BrokerMessage& message, int attachedFd)
+	{
+		switch (message.type)
+		{
+		case BRK_WAITING:
+		{
+			auto peer = std::find_if(_waiting.begin(), _waiting.end(), [worker](const Waiting& w) { return w.worker != worker; });
+			if (peer == _waiting.end())
+			{
+				_waiting.push_back({ worker, message.ticket });
+				break;
+			}
+
+			Waiting opponent = *peer;
+			_waiting.erase(peer);
+
+			// The newer player moves to the process where its opponent has been waiting
+			_pendingHandoffs[key(worker, message.ticket)] = opponent;
+			send(worker, { BRK_SEND, message.ticket, opponent.ticket });
+			break;
+		}
+		case BRK_CANCEL:
+		{
+			auto it = std::find_if(_waiting.begin(), _waiting.end(), [worker, &message](const Waiting& w) { return w.worker == worker && w.ticket == message.ticket; });
+			if (it != _waiting.end())
+				_waiting.erase(it);
+			break;
+		}
+		case BRK_HANDOFF:
+		{
+			if (attachedFd < 0)
+				break;
+
+			// Without its handoff, e.g. the opponent's worker left, the socket goes back to where it came from
+			auto it = _pendingHandoffs.find(key(worker, message.ticket));
+			if (it == _pendingHandoffs.end())
+			{
+				send(worker, { BRK_ADOPT, message.ticket, 0 }, attachedFd);
+				break;
+			}
+
+			Waiting opponent = it->second;
+			_pendingHandoffs.erase(it);
+
+			if (_workers.contains(opponent.worker))
+				send(opponent.worker, { BRK_ADOPT, message.ticket, opponent.ticket }, attachedFd);
+			else
+				send(worker, { BRK_ADOPT, message.ticket, 0 }, attachedFd);
+			break;
+		}
+		case BRK_HANDOFF_FAILED:
+		{
+			auto it = _pendingHandoffs.find(key(worker, message.ticket));
+			if (it == _pendingHandoffs.end())
+				break;
+
+			// The opponent did nothing wrong, it goes back to the front of the queue
+			if (_workers.contains(it->second.worker))
+				_waiting.push_front(it->second);
+			_pendingHandoffs.erase(it);
+			break;
+		}
+		default:
+			break;
+		}
+
+		if (attachedFd >= 0)
+			::close(attachedFd);
+	}
+
+	void MatchBroker::send(uint32_t worker, const BrokerMessage& message, int attachedFd)
+	{
+		auto it = _workers.find(worker);
+		if (it == _workers.end())
+			return;
+
+		// A worker that stopped reading is treated like one that left, the others keep matching
+		if (!send_broker_message(it->second->native_handle(), message, attachedFd))
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Worker {} stopped taking broker messages">(worker);
+			}
+			drop_worker(worker);
+		}
+	}
+
+	void MatchBroker::drop_worker(uint32_t worker)
+	{
+		auto it = _workers.find(worker);
+		if (it == _workers.end())
+			return;
+
+		asio::error_code ec;
+		it->second->close(ec);
+		_workers.erase(it);
+
+		std::erase_if(_waiting, [worker](const Waiting& w) { return w.worker == worker; });
+
+		// A player the dropped worker was handing over will never arrive, its opponent queues
+		// again. One handed over to the dropped worker is sent back by BRK_HANDOFF.
+		for (auto pending = _pendingHandoffs.begin(); pending != _pendingHandoffs.end();)
+		{
+			uint32_t from = static_cast<uint32_t>(pending->first >> 32);
+			if (from != worker && pending->second.worker != worker)
+			{
+				++pending;
+				continue;
+			}
+
+			if (from == worker)
+				_waiting.push_front(pending->second);
+			pending = _pendingHandoffs.erase(pending);
+		}
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Worker {} left the broker">(worker);
+		}
+	}
+
+	uint64_t MatchBroker::key(uint32_t worker, uint32_t ticket)
+	{
+		return (static_cast<uint64_t>(worker) << 32) | ticket;
+	}
+
+	BrokerLink::BrokerLink(const std::string& path, std::function<void(const BrokerMessage&, int)> onMessage)
+		: _path(path), _socket(_ioContext), _onMessage(std::move(onMessage))
+	{
+	}
+
+	bool BrokerLink::connect()
+	{
+		asio::error_code ec;
+		_socket.connect(asio::local::stream_protocol::endpoint(_path), ec);
+		if (ec)
+		{
+			logging::error<"Broker connect failed: {}">(ec.message());
+			return false;
+		}
+
+		_linked = true;
+		start_read();
+
+		_ioThread = std::thread([this]()
+			{
+				try
+				{
+					_ioContext.run();
+				}
+				catch (const std::exception& e)
+				{
+					logging::error<"Broker link error: {}">(e.what());
+				}
+			});
+
+		return true;
+	}
+
+	void BrokerLink::send(const BrokerMessage& message, int attachedFd)
+	{
+		if (!_linked)
+			return;
+
+		// Shard threads call this holding the matchmaking lock, they only queue
+		int duplicate = -1;
+		if (attachedFd >= 0)
+		{
+			duplicate = ::fcntl(attachedFd, F_DUPFD_CLOEXEC, 0);
+			if (duplicate < 0)
+			{
+				logging::error<"Broker send failed: {}">(std::strerror(errno));
+				return;
+			}
+		}
+
+		{
+			std::lock_guard lock(_sendMutex);
+			_outbox.push_back({ message, duplicate });
+		}
+
+		asio::post(_ioContext, [this]() { flush_outbox(); });
+	}
+
+	void BrokerLink::flush_outbox()
+	{
+		while (true)
+		{
+			Outgoing next;
+			{
+				std::lock_guard lock(_sendMutex);
+				if (_outbox.empty())
+					return;
+
+				next = _outbox.front();
+				_outbox.pop_front();
+			}
+
+			bool sent = _linked && send_broker_message(_socket.native_handle(), next.message, next.attachedFd);
+			if (next.attachedFd >= 0)
+				::close(next.attachedFd);
+
+			if (!sent && _linked)
+			{
+				// Matching goes on within this process, players waiting for another one stay queued here
+				logging::error<"Broker stopped taking messages, leaving it">();
+				_linked = false;
+
+				asio::error_code ec;
+				_socket.close(ec);
+			}
+		}
+	}
+
+	void BrokerLink::close_outbox()
+	{
+		std::lock_guard lock(_sendMutex);
+		for (const Outgoing& outgoing : _outbox)
+		{
+			if (outgoing.attachedFd >= 0)
+				::close(outgoing.attachedFd);
+		}
+		_outbox.clear();
+	}
+
+	void BrokerLink::stop()
+	{
+		_linked = false;
+		_ioContext.stop();
+
+		if (_ioThread.joinable())
+			_ioThread.join();
+
+		asio::error_code ec;
+		_socket.close(ec);
+
+		close_outbox();
+	}
+
+	BrokerLink::~BrokerLink()
+	{
+		stop();
+	}
+
+	void BrokerLink::start_read()
+	{
+		_socket.async_wait(asio::socket_base::wait_read, [this](const asio::error_code& error)
+			{
+				if (error)
+					return;
+
+				BrokerMessage message;
+				int attachedFd = -1;
+				bool wouldBlock = false;
+
+				while (receive_broker_message(_socket.native_handle(), message, attachedFd, wouldBlock))
+				{
+					if (wouldBlock)
+						break;
+
+					if (_onMessage)
+						_onMessage(message, attachedFd);
+					else if (attachedFd >= 0)
+						::close(attachedFd);
+				}
+
+				if (!wouldBlock)
+				{
+					logging::error<"Lost connection to the match broker">();
+					_linked = false;
+					return;
+				}
+
+				start_read();
+			});
+	}
+}
+
+#endif
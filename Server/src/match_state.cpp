@@ -0,0 +1,231 @@
+#include "headers.h"
+#include "match_state.h"
+
+namespace game
+{
+	MatchState::MatchState()
+	{
+		reset();
+	}
+
+	void MatchState::reset()
+	{
+		engines[chess::PL_WHITE] = chess::ChessEngine(chess::PL_WHITE, protocol::MoveCooldownMs);
+		engines[chess::PL_BLACK] = chess::ChessEngine(chess::PL_BLACK, protocol::MoveCooldownMs);
+		startedCooldowns.clear();
+		lastSequence = 0;
+		gameOver = false;
+	}
+
+	MatchResult MatchState::handle_request(chess::Player player, const std::vector<uint8_t>& frame, chess::GameClock::time_point received, std::vector<uint8_t>& broadcast, std::vector<uint8_t>& reply)
+	{
+		protocol::FrameHeader header = protocol::frame_header(frame);
+
+		startedCooldowns.clear();
+		acceptedAt = protocol::to_wire32(chess::ClockSync::millis(chess::GameClock::now()));
+		receivedAt = received;
+		traced = false;
+
+		if (gameOver)
+			return reject(header.type, 0, 0, reply);
+
+		std::array<size_t, 2> timeouts = { engines[chess::PL_WHITE].timeout_count(), engines[chess::PL_BLACK].timeout_count() };
+
+		MatchResult result;
+		switch (header.type)
+		{
+		case protocol::MSG_MOVE:
+			result = handle_move(player, frame, broadcast, reply);
+			break;
+		case protocol::MSG_WALL:
+			result = handle_wall(player, frame, broadcast, reply);
+			break;
+		case protocol::MSG_PROMOTE:
+			result = handle_promote(player, frame, broadcast, reply);
+			break;
+		default:
+			return reject(header.type, 0, 0, reply);
+		}
+
+		// Engines only ever append cooldowns, so anything past the old count is new
+		for (chess::Player side : { chess::PL_WHITE, chess::PL_BLACK })
+		{
+			for (size_t i = timeouts[side]; i < engines[side].timeout_count(); i++)
+				startedCooldowns.push_back({ side, engines[side].timeout_position(i) });
+		}
+
+		return result;
+	}
+
+	const protocol::MoveTrace* MatchState::traced_move() const
+	{
+		return traced ? &lastTrace : nullptr;
+	}
+
+	const std::vector<MatchState::Cooldown>& MatchState::started_cooldowns() const
+	{
+		return startedCooldowns;
+	}
+
+	void MatchState::expire_cooldown(chess::Player player, int position)
+	{
+		engines[player].expire_timeout(position);
+	}
+
+	void MatchState::export_board(BoardPlanes& planes) const
+	{
+		const chess::ChessEngine& white = engines[chess::PL_WHITE];
+
+		planes = {};
+		for (int i = 0; i < 64; i++)
+		{
+			chess::Pieces piece = white.piece_at(i);
+			if (piece != chess::EMPTY)
+				planes.pieces[piece - 1] |= uint64_t(1) << i;
+
+			std::array<bool, 4> walls = white.get_wall_at(i);
+			planes.wallsBelow |= uint64_t(walls[chess::DIR_DOWN - 1]) << i;
+			planes.wallsRight |= uint64_t(walls[chess::DIR_RIGHT - 1]) << i;
+		}
+	}
+
+	uint32_t MatchState::sequence() const
+	{
+		return lastSequence;
+	}
+
+	bool MatchState::finished() const
+	{
+		return gameOver;
+	}
+
+	MatchResult MatchState::handle_move(chess::Player player, const std::vector<uint8_t>& frame, std::vector<uint8_t>& broadcast, std::vector<uint8_t>& reply)
+	{
+		protocol::MoveMessage request{};
+		if (!protocol::decode_payload(frame, request) || !protocol::on_board(request.from) || !protocol::on_board(request.to))
+			return reject(protocol::MSG_MOVE, request.from, request.to, reply);
+
+		chess::ChessEngine& mover = engines[player];
+		bool white = player == chess::PL_WHITE;
+
+		// A pawn on the last rank has to be promoted before that side does anything else
+		if (mover.get_waiting_for_promotion().to != -1)
+			return reject(protocol::MSG_MOVE, request.from, request.to, reply);
+
+		int from = protocol::orient(request.from, white);
+		int to = protocol::orient(request.to, white);
+
+		chess::MoveState state = mover.move_piece(from, to);
+		if (state == chess::MOVE_INVALID)
+			return reject(protocol::MSG_MOVE, request.from, request.to, reply);
+
+		chess::ChessEngine& other = opponent_of(player);
+
+		if (state == chess::MOVE_EN_PASSENT_OPPORTUNITY)
+		{
+			int under = mover.get_under_position_of(to);
+			int when = mover.get_game_moves_count();
+
+			other.add_en_passent_oppertunity(other.reverse(under), when);
+
+			protocol::EnPassantMessage event{ static_cast<uint8_t>(player), static_cast<uint8_t>(protocol::orient(under, white)), protocol::to_wire16(static_cast<uint16_t>(when)) };
+			append_event(protocol::MSG_EN_PASSANT, event, broadcast);
+		}
+
+		// Keeps the opponent's move count and cooldowns in step, the board itself is copied below
+		// so castling, en passant captures and broken walls land on both sides
+		other.opponent_move(other.reverse(from), other.reverse(to));
+
+		// Stamped last, everything after this is the socket write
+		protocol::MoveMessage event{ static_cast<uint8_t>(player), request.from, request.to, acceptedAt, request.trace };
+		event.trace.serverReceived = protocol::to_wire32(chess::ClockSync::micros(receivedAt));
+		event.trace.serverForwarded = protocol::to_wire32(chess::ClockSync::micros(chess::GameClock::now()));
+		append_event(protocol::MSG_MOVE, event, broadcast);
+
+		lastTrace = { protocol::from_wire16(event.trace.moveId), protocol::from_wire32(event.trace.inputToSend), protocol::from_wire32(event.trace.sentAt),
+			protocol::from_wire32(event.trace.serverReceived), protocol::from_wire32(event.trace.serverForwarded) };
+		traced = true;
+
+		return accept(player, broadcast);
+	}
+
+	MatchResult MatchState::handle_wall(chess::Player player, const std::vector<uint8_t>& frame, std::vector<uint8_t>& broadcast, std::vector<uint8_t>& reply)
+	{
+		protocol::WallMessage request{};
+		if (!protocol::decode_payload(frame, request) || !protocol::on_board(request.place) || !protocol::on_board(request.direction))
+			return reject(protocol::MSG_WALL, request.place, request.direction, reply);
+
+		chess::ChessEngine& mover = engines[player];
+		bool white = player == chess::PL_WHITE;
+
+		if (mover.get_waiting_for_promotion().to != -1)
+			return reject(protocol::MSG_WALL, request.place, request.direction, reply);
+
+		if (mover.build_wall(protocol::orient(request.place, white), protocol::orient(request.direction, white)) != chess::WL_SUCCESS)
+			return reject(protocol::MSG_WALL, request.place, request.direction, reply);
+
+		protocol::WallMessage event{ static_cast<uint8_t>(player), request.place, request.direction, acceptedAt };
+		append_event(protocol::MSG_WALL, event, broadcast);
+
+		return accept(player, broadcast);
+	}
+
+	MatchResult MatchState::handle_promote(chess::Player player, const std::vector<uint8_t>& frame, std::vector<uint8_t>& broadcast, std::vector<uint8_t>& reply)
+	{
+		protocol::PromoteMessage request{};
+		if (!protocol::decode_payload(frame, request) || !protocol::on_board(request.from) || !protocol::on_board(request.to))
+			return reject(protocol::MSG_PROMOTE, request.from, request.to, reply);
+
+		chess::ChessEngine& mover = engines[player];
+		bool white = player == chess::PL_WHITE;
+
+		chess::ToFrom waiting = mover.get_waiting_for_promotion();
+		if (waiting.from != protocol::orient(request.from, white) || waiting.to != protocol::orient(request.to, white)
+			|| request.piece < chess::PR_QUEEN || request.piece > chess::PR_KNIGHT)
+			return reject(protocol::MSG_PROMOTE, request.from, request.to, reply);
+
+		mover.promote(static_cast<chess::PromotionResult>(request.piece));
+
+		protocol::PromoteMessage event{ static_cast<uint8_t>(player), request.from, request.to, request.piece, acceptedAt };
+		append_event(protocol::MSG_PROMOTE, event, broadcast);
+
+		return accept(player, broadcast);
+	}
+
+	MatchResult MatchState::accept(chess::Player player, std::vector<uint8_t>& broadcast)
+	{
+		chess::ChessEngine& mover = engines[player];
+		opponent_of(player).mirror_board_from(mover);
+
+		if (!mover.did_other_lose())
+			return MR_ACCEPTED;
+
+		gameOver = true;
+
+		protocol::GameOverMessage event{ static_cast<uint8_t>(player) };
+		append_event(protocol::MSG_GAME_OVER, event, broadcast);
+
+		return MR_GAME_OVER;
+	}
+
+	MatchResult MatchState::reject(uint8_t requestType, uint8_t from, uint8_t to, std::vector<uint8_t>& reply)
+	{
+		protocol::RejectMessage message{ requestType, from, to };
+		std::vector<uint8_t> frame = protocol::encode_frame(protocol::MSG_REJECT, message);
+		reply.insert(reply.end(), frame.begin(), frame.end());
+
+		return MR_REJECTED;
+	}
+
+	template<typename T>
+	void MatchState::append_event(protocol::MessageType type, const T& payload, std::vector<uint8_t>& broadcast)
+	{
+		std::vector<uint8_t> frame = protocol::encode_frame(type, payload, ++lastSequence);
+		broadcast.insert(broadcast.end(), frame.begin(), frame.end());
+	}
+
+	chess::ChessEngine& MatchState::opponent_of(chess::Player player)
+	{
+		return engines[player == chess::PL_WHITE ? chess::PL_BLACK : chess::PL_WHITE];
+	}
+}
@@ -0,0 +1,232 @@
+#include "headers.h"
+#include "metrics.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace server
+{
+	namespace
+	{
+		struct MetricName
+		{
+			const char* name;
+			const char* help;
+		};
+
+		constexpr std::array<MetricName, MC_COUNT> CounterNames = { {
+			{ "accepts_total", "Connections accepted" },
+			{ "disconnects_total", "Connections ended" },
+			{ "frames_in_total", "Protocol frames read from clients" },
+			{ "frames_out_total", "Protocol frames written to clients" },
+			{ "bytes_in_total", "Bytes read from clients" },
+			{ "bytes_out_total", "Bytes written to clients" },
+		} };
+
+		constexpr std::array<MetricName, MG_COUNT> GaugeNames = { {
+			{ "sessions", "Open sessions, channels included" },
+			{ "rooms", "Active rooms" },
+			{ "outbox_bytes", "Bytes queued to clients and not yet written" },
+		} };
+
+		constexpr std::array<MetricName, MH_COUNT> HistogramNames = { {
+			{ "relay_latency_us", "User space relay, frame read to written to the peer" },
+			{ "room_queue_us", "Validated request read to picked up by its room's shard" },
+			{ "validation_us", "Room checking and applying a request" },
+		} };
+
+		void write_header(std::ostream& out, const std::string& name, const char* help, const char* type)
+		{
+			out << "# HELP fortchess_" << name << " " << help << "\n# TYPE fortchess_" << name << " " << type << "\n";
+		}
+	}
+
+	MetricsRegistry::MetricsRegistry(size_t shardCount)
+	{
+		for (size_t shard = 0; shard < shardCount; shard++)
+			_shards.push_back(std::make_unique<ShardMetrics>());
+	}
+
+	ShardMetrics& MetricsRegistry::shard(size_t shard)
+	{
+		return *_shards[shard];
+	}
+
+	uint64_t MetricsRegistry::total(MetricCounter counter) const
+	{
+		uint64_t sum = 0;
+		for (const auto& shard : _shards)
+			sum += shard->counters[counter].load(std::memory_order_relaxed);
+		return sum;
+	}
+
+	void MetricsRegistry::add_gauge(const std::string& name, const std::string& help, std::function<int64_t()> read)
+	{
+		std::lock_guard lock(_sourcesMutex);
+		_sources.push_back({ name, help, std::move(read) });
+	}
+
+	void MetricsRegistry::write_text(std::ostream& out) const
+	{
+		for (size_t counter = 0; counter < MC_COUNT; counter++)
+		{
+			write_header(out, CounterNames[counter].name, CounterNames[counter].help, "counter");
+			for (size_t shard = 0; shard < _shards.size(); shard++)
+				out << "fortchess_" << CounterNames[counter].name << "{shard=\"" << shard << "\"} " << _shards[shard]->counters[counter].load(std::memory_order_relaxed) << "\n";
+		}
+
+		for (size_t gauge = 0; gauge < MG_COUNT; gauge++)
+		{
+			write_header(out, GaugeNames[gauge].name, GaugeNames[gauge].help, "gauge");
+			for (size_t shard = 0; shard < _shards.size(); shard++)
+				out << "fortchess_" << GaugeNames[gauge].name << "{shard=\"" << shard << "\"} " << _shards[shard]->gauges[gauge].load(std::memory_order_relaxed) << "\n";
+		}
+
+		{
+			std::lock_guard lock(_sourcesMutex);
+			for (const GaugeSource& source : _sources)
+			{
+				write_header(out, source.name, source.help.c_str(), "gauge");
+				out << "fortchess_" << source.name << " " << source.read() << "\n";
+			}
+		}
+
+		for (size_t histogram = 0; histogram < MH_COUNT; histogram++)
+		{
+			metrics::HdrHistogram merged;
+			for (const auto& shard : _shards)
+				shard->histograms[histogram].merge_into(merged);
+
+			std::string name = HistogramNames[histogram].name;
+			write_header(out, name, HistogramNames[histogram].help, "summary");
+			for (double quantile : { 0.5, 0.9, 0.99, 0.999 })
+				out << "fortchess_" << name << "{quantile=\"" << quantile << "\"} " << merged.percentile(quantile * 100) << "\n";
+			out << "fortchess_" << name << "_sum " << merged.sum() << "\n";
+			out << "fortchess_" << name << "_count " << merged.count() << "\n";
+		}
+
+		out.flush();
+	}
+
+	MetricsExporter::MetricsExporter(const MetricsRegistry& registry, unsigned short port, const std::string& dumpPath, std::chrono::seconds interval)
+		: _registry(registry), _context(1), _acceptor(_context), _dumpTimer(_context), _dumpPath(dumpPath), _interval(std::max(interval, MinInterval))
+	{
+		if (port != 0)
+		{
+			// Loopback only, whatever scrapes the server runs next to it
+			asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::loopback(), port);
+			_acceptor.open(endpoint.protocol());
+			_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+			_acceptor.bind(endpoint);
+			_acceptor.listen();
+			start_accept();
+		}
+
+		if (!_dumpPath.empty())
+			schedule_dump();
+
+		_thread = std::thread([this]()
+			{
+				_context.run();
+			});
+	}
+
+	void MetricsExporter::stop()
+	{
+		_context.stop();
+
+		if (_thread.joinable())
+			_thread.join();
+
+		asio::error_code ec;
+		_acceptor.close(ec);
+	}
+
+	MetricsExporter::~MetricsExporter()
+	{
+		stop();
+	}
+
+	void MetricsExporter::start_accept()
+	{
+		auto socket = std::make_shared<asio::ip::tcp::socket>(_context);
+		_acceptor.async_accept(*socket, [this, socket](const asio::error_code& error)
+			{
+				if (error)
+				{
+					if (error != asio::error::operation_aborted)
+						start_accept();
+					return;
+				}
+
+				serve(socket);
+				start_accept();
+			});
+	}
+
+	void MetricsExporter::serve(std::shared_ptr<asio::ip::tcp::socket> socket)
+	{
+		auto request = std::make_shared<asio::streambuf>(MaxRequestBytes);
+		asio::async_read_until(*socket, *request, "\r\n\r\n", [this, socket, request](const asio::error_code& error, size_t)
+			{
+				if (error)
+					return;
+
+				std::istream lines(request.get());
+				std::string method, path;
+				lines >> method >> path;
+
+				std::ostringstream body;
+				const char* status = "200 OK";
+				if (method != "GET")
+					status = "405 Method Not Allowed";
+				else if (path == "/metrics" || path == "/")
+					_registry.write_text(body);
+				else
+					status = "404 Not Found";
+
+				std::string text = body.str();
+				std::ostringstream head;
+				head << "HTTP/1.1 " << status << "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " << text.size() << "\r\nConnection: close\r\n\r\n";
+
+				auto response = std::make_shared<std::string>(head.str() + text);
+				asio::async_write(*socket, asio::buffer(*response), [socket, response](const asio::error_code&, size_t)
+					{
+						asio::error_code ec;
+						socket->shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+					});
+			});
+	}
+
+	void MetricsExporter::schedule_dump()
+	{
+		_dumpTimer.expires_after(_interval);
+		_dumpTimer.async_wait([this](const asio::error_code& error)
+			{
+				if (error)
+					return;
+
+				write_dump();
+				schedule_dump();
+			});
+	}
+
+	void MetricsExporter::write_dump()
+	{
+		std::string temporary = _dumpPath + ".tmp";
+		{
+			std::ofstream file(temporary, std::ios::trunc);
+			if (!file)
+				return;
+
+			_registry.write_text(file);
+		}
+
+#ifdef PLATFORM_WINDOWS
+		// Windows will not rename over an existing file
+		std::remove(_dumpPath.c_str());
+#endif
+		std::rename(temporary.c_str(), _dumpPath.c_str());
+	}
+}
@@ -0,0 +1,334 @@
+#include "headers.h"
+#include "room_registry.h"
+
+#include <algorithm>
+
+namespace game
+{
+	uint32_t RoomRegistry::create_room(uint32_t white, uint32_t black, uint32_t tick)
+	{
+		uint32_t roomIndex;
+
+		if (!freeRooms.empty())
+		{
+			roomIndex = freeRooms.back();
+			freeRooms.pop_back();
+		}
+		else
+		{
+			roomIndex = add_slot();
+		}
+
+		whites[roomIndex] = white;
+		blacks[roomIndex] = black;
+		active[roomIndex] = 1;
+		++generations[roomIndex];
+
+		for (size_t side = 0; side < 2; side++)
+		{
+			secrets[side][roomIndex] = rng();
+			awayUntil[side][roomIndex] = 0;
+		}
+
+		matches[roomIndex].reset();
+		spectators[roomIndex].clear();
+		lastActivity[roomIndex] = tick;
+		sequences[roomIndex] = 0;
+		store_board(roomIndex);
+
+		++activeRooms;
+
+		return roomIndex;
+	}
+
+	bool RoomRegistry::destroy_room(uint32_t roomIndex, uint32_t generation)
+	{
+		if (!is_active(roomIndex, generation))
+			return false;
+
+		active[roomIndex] = 0;
+		spectators[roomIndex].clear();
+
+		for (size_t side = 0; side < 2; side++)
+		{
+			cooldownMasks[side][roomIndex] = 0;
+			std::fill_n(cooldownExpiry[side].begin() + roomIndex * 64, 64, 0);
+		}
+
+		freeRooms.push_back(roomIndex);
+
+		--activeRooms;
+		return true;
+	}
+
+	uint32_t RoomRegistry::generation_of(uint32_t roomIndex) const
+	{
+		return generations[roomIndex];
+	}
+
+	bool RoomRegistry::is_active(uint32_t roomIndex, uint32_t generation) const
+	{
+		return roomIndex < active.size() && active[roomIndex] && generations[roomIndex] == generation;
+	}
+
+	uint32_t RoomRegistry::white_of(uint32_t roomIndex) const
+	{
+		return whites[roomIndex];
+	}
+
+	uint32_t RoomRegistry::black_of(uint32_t roomIndex) const
+	{
+		return blacks[roomIndex];
+	}
+
+	uint32_t RoomRegistry::player_of(uint32_t roomIndex, chess::Player side) const
+	{
+		return side == chess::PL_WHITE ? whites[roomIndex] : blacks[roomIndex];
+	}
+
+	void RoomRegistry::set_player(uint32_t roomIndex, chess::Player side, uint32_t clientId)
+	{
+		(side == chess::PL_WHITE ? whites : blacks)[roomIndex] = clientId;
+	}
+
+	uint32_t RoomRegistry::secret_of(uint32_t roomIndex, chess::Player side) const
+	{
+		return secrets[side][roomIndex];
+	}
+
+	void RoomRegistry::set_away(uint32_t roomIndex, chess::Player side, uint32_t untilTick)
+	{
+		awayUntil[side][roomIndex] = untilTick;
+	}
+
+	uint32_t RoomRegistry::away_until(uint32_t roomIndex, chess::Player side) const
+	{
+		return awayUntil[side][roomIndex];
+	}
+
+	MatchState& RoomRegistry::match_of(uint32_t roomIndex)
+	{
+		return matches[roomIndex];
+	}
+
+	void RoomRegistry::record_update(uint32_t roomIndex, uint32_t tick, uint32_t cooldownTicks)
+	{
+		MatchState& match = matches[roomIndex];
+
+		lastActivity[roomIndex] = tick;
+		sequences[roomIndex] = match.sequence();
+		store_board(roomIndex);
+
+		for (const MatchState::Cooldown& cooldown : match.started_cooldowns())
+		{
+			// A square cooling down twice keeps the later expiry, the engine clears every entry for it at once
+			cooldownMasks[cooldown.player][roomIndex] |= uint64_t(1) << cooldown.position;
+			cooldownExpiry[cooldown.player][roomIndex * 64 + cooldown.position] = tick + cooldownTicks;
+		}
+	}
+
+	void RoomRegistry::touch(uint32_t roomIndex, uint32_t tick)
+	{
+		lastActivity[roomIndex] = tick;
+	}
+
+	void RoomRegistry::collect_idle(uint32_t tick, uint32_t idleTicks, std::vector<uint32_t>& idleRooms) const
+	{
+		for (size_t slot = 0; slot < active.size(); slot++)
+		{
+			if (active[slot] && tick - lastActivity[slot] >= idleTicks)
+				idleRooms.push_back(static_cast<uint32_t>(slot));
+		}
+	}
+
+	RoomStats RoomRegistry::stats() const
+	{
+		RoomStats stats;
+		stats.rooms = activeRooms;
+
+		for (size_t slot = 0; slot < active.size(); slot++)
+		{
+			if (!active[slot])
+				continue;
+
+			for (const auto& boards : pieceBoards)
+				stats.pieces += std::popcount(boards[slot]);
+
+			stats.cooldowns += std::popcount(cooldownMasks[0][slot]) + std::popcount(cooldownMasks[1][slot]);
+		}
+
+		return stats;
+	}
+
+	void RoomRegistry::add_route(uint32_t clientId, const RoomRoute& route)
+	{
+		routes[clientId] = route;
+	}
+
+	void RoomRegistry::remove_route(uint32_t clientId, uint32_t roomIndex, uint32_t generation)
+	{
+		auto it = routes.find(clientId);
+		if (it != routes.end() && it->second.room == roomIndex && it->second.generation == generation)
+			routes.erase(it);
+	}
+
+	const RoomRoute* RoomRegistry::find_route(uint32_t clientId) const
+	{
+		auto it = routes.find(clientId);
+		if (it == routes.end())
+			return nullptr;
+		return &it->second;
+	}
+
+	void RoomRegistry::add_spectator(uint32_t roomIndex, uint32_t clientId)
+	{
+		spectators[roomIndex].push_back(clientId);
+	}
+
+	void RoomRegistry::remove_spectator(uint32_t roomIndex, uint32_t generation, uint32_t clientId)
+	{
+		if (is_active(roomIndex, generation))
+			std::erase(spectators[roomIndex], clientId);
+	}
+
+	const std::vector<uint32_t>& RoomRegistry::spectators_of(uint32_t roomIndex) const
+	{
+		return spectators[roomIndex];
+	}
+
+	void RoomRegistry::add_watcher(uint32_t clientId, const RoomRoute& route)
+	{
+		watchers[clientId] = route;
+	}
+
+	void RoomRegistry::remove_watcher(uint32_t clientId)
+	{
+		watchers.erase(clientId);
+	}
+
+	const RoomRoute* RoomRegistry::find_watcher(uint32_t clientId) const
+	{
+		auto it = watchers.find(clientId);
+		if (it == watchers.end())
+			return nullptr;
+		return &it->second;
+	}
+
+	void RoomRegistry::export_snapshot(uint32_t roomIndex, uint32_t tick, protocol::SnapshotMessage& snapshot) const
+	{
+		snapshot = {};
+
+		for (size_t piece = 0; piece < pieceBoards.size(); piece++)
+		{
+			uint64_t board = pieceBoards[piece][roomIndex];
+			while (board)
+			{
+				int square = std::countr_zero(board);
+				board &= board - 1;
+				protocol::set_snapshot_piece(snapshot, square, static_cast<uint8_t>(piece + 1));
+			}
+		}
+
+		protocol::set_snapshot_walls(snapshot, wallsBelow[roomIndex], wallsRight[roomIndex]);
+
+		// Each engine cools down both sides' moved pieces, a wall only cools on its builder's side
+		std::array<uint32_t, 64> left{};
+		for (size_t side = 0; side < 2; side++)
+		{
+			uint64_t mask = cooldownMasks[side][roomIndex];
+			const uint32_t* expiry = &cooldownExpiry[side][roomIndex * 64];
+			while (mask)
+			{
+				int square = std::countr_zero(mask);
+				mask &= mask - 1;
+
+				int wire = side == chess::PL_WHITE ? square : 63 - square;
+				if (expiry[square] > tick)
+					left[wire] = std::max(left[wire], expiry[square] - tick);
+			}
+		}
+
+		struct Remaining
+		{
+			uint8_t square;
+			uint32_t ticks;
+		};
+
+		std::array<Remaining, 64> remaining;
+		size_t count = 0;
+		for (int square = 0; square < 64; square++)
+		{
+			if (left[square] > 0)
+				remaining[count++] = { static_cast<uint8_t>(square), left[square] };
+		}
+
+		// Past the limit the ones closest to running out are left off, they are ready soon anyway
+		if (count > protocol::MaxSnapshotCooldowns)
+		{
+			std::partial_sort(remaining.begin(), remaining.begin() + protocol::MaxSnapshotCooldowns, remaining.begin() + count,
+				[](const Remaining& a, const Remaining& b) { return a.ticks > b.ticks; });
+			count = protocol::MaxSnapshotCooldowns;
+		}
+
+		snapshot.cooldownCount = static_cast<uint8_t>(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			snapshot.cooldowns[i][0] = remaining[i].square;
+			snapshot.cooldowns[i][1] = static_cast<uint8_t>(std::min<uint32_t>(remaining[i].ticks, 255));
+		}
+	}
+
+	uint32_t RoomRegistry::sequence_of(uint32_t roomIndex) const
+	{
+		return sequences[roomIndex];
+	}
+
+	size_t RoomRegistry::room_count() const
+	{
+		return activeRooms;
+	}
+
+	uint32_t RoomRegistry::add_slot()
+	{
+		uint32_t roomIndex = static_cast<uint32_t>(active.size());
+
+		whites.push_back(0);
+		blacks.push_back(0);
+		generations.push_back(0);
+		for (size_t side = 0; side < 2; side++)
+		{
+			secrets[side].push_back(0);
+			awayUntil[side].push_back(0);
+		}
+		active.push_back(0);
+		matches.emplace_back();
+		spectators.emplace_back();
+
+		lastActivity.push_back(0);
+		sequences.push_back(0);
+		for (auto& boards : pieceBoards)
+			boards.push_back(0);
+		wallsBelow.push_back(0);
+		wallsRight.push_back(0);
+
+		for (size_t side = 0; side < 2; side++)
+		{
+			cooldownMasks[side].push_back(0);
+			cooldownExpiry[side].resize(cooldownExpiry[side].size() + 64, 0);
+		}
+
+		return roomIndex;
+	}
+
+	void RoomRegistry::store_board(uint32_t roomIndex)
+	{
+		BoardPlanes planes;
+		matches[roomIndex].export_board(planes);
+
+		for (size_t piece = 0; piece < planes.pieces.size(); piece++)
+			pieceBoards[piece][roomIndex] = planes.pieces[piece];
+
+		wallsBelow[roomIndex] = planes.wallsBelow;
+		wallsRight[roomIndex] = planes.wallsRight;
+	}
+}
@@ -1,20 +1,78 @@
 #include "headers.h"
 #include "server.h"
+#include "binary_log.h"
+#include "tracepoints.h"
 
 namespace server
 {
-	Server::Server(unsigned short port, std::function<void()> onConnect, std::function<void()> onDisconnect)
+	thread_local uint32_t Server::_lastClientSentData = 0;
+	thread_local uint32_t Server::_currentClientId = 0;
+
+	Server::Server(unsigned short port, std::function<void(uint32_t)> onConnect, std::function<void(uint32_t)> onDisconnect)
+		: Server(port, ServerConfig{}, std::move(onConnect), std::move(onDisconnect))
+	{
+	}
+
+	Server::Server(unsigned short port, const ServerConfig& config, std::function<void(uint32_t)> onConnect, std::function<void(uint32_t)> onDisconnect)
 		: _ioContext(),
 		_workGuard(asio::make_work_guard(_ioContext)),
-		_endpoint(asio::ip::tcp::v4(), port), 
-		_acceptor(_ioContext, _endpoint)
+		_shards(config.shardCount, config.pinThreads || config.busyPoll, config.busyPoll, MaxShards),
+		_endpoint(asio::ip::tcp::v4(), port),
+		_acceptor(_ioContext),
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		_localAcceptor(_ioContext),
+#endif
+		_busyPoll(config.busyPoll),
+		_busyPollMicros(config.busyPollMicros),
+		_simulated(config.simulated),
+		_sessions(_shards.size()),
+		_metrics(_shards.size()),
+		_recorder(_shards.size(), config.flightRecorderEvents)
 	{
 		if (onConnect) _onConnect = std::move(onConnect);
 		if (onDisconnect) _onDisconnect = std::move(onDisconnect);
 
-		start_accept();		
+		// Only an explicit count can get here, the default is clamped
+		if (_shards.size() > MaxShards)
+			throw std::invalid_argument("Too many io shards for the client id layout");
+
+		// The owner runs the shards through poll() and connects clients itself
+		if (_simulated)
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::info<"Server simulating {} io shards over loopback links">(_shards.size());
+			}
+			return;
+		}
+
+		if (!config.flightRecorderPath.empty())
+			_recorder.install_crash_handler(config.flightRecorderPath);
+
+		open_acceptor(config);
+
+		if (!config.localPath.empty())
+			open_local_acceptor(config.localPath);
+
+		_shards.run();
 
-		_ioThread = std::thread([this]() 
+		if (!config.flightRecorderPath.empty())
+		{
+			for (size_t shard = 0; shard < _shards.size(); shard++)
+				asio::post(_shards.get_context(shard), []() { FlightRecorder::install_signal_stack(); });
+		}
+
+		if (config.metricsPort != 0 || !config.metricsPath.empty())
+			_metricsExporter = std::make_unique<MetricsExporter>(_metrics, config.metricsPort, config.metricsPath, config.metricsInterval);
+
+		start_accept();
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		if (_localAcceptor.is_open())
+			start_local_accept();
+#endif
+
+		_ioThread = std::thread([this]()
 			{
 			try {
 				_ioContext.run();
@@ -23,55 +81,56 @@ namespace server
 			{
 				if constexpr (SERVER_DEBUG)
 				{
-					std::cerr << "IO context error: " << e.what() << std::endl;
+					logging::error<"IO context error: {}">(e.what());
 				}
 			}
 			});
 
 		if constexpr (SERVER_DEBUG)
 		{
-			std::cout << "Server started on " << _endpoint.address().to_string() << ":" << _endpoint.port() << std::endl; \
+			logging::info<"Server started on {}:{} with {} io shards on {}">(_endpoint.address().to_string(), _endpoint.port(), _shards.size(), event_backend());
 		}
 	}
 
-	void Server::set_on_disconnect(std::function<void()> callback)
+	void Server::set_on_disconnect(std::function<void(uint32_t)> callback)
 	{
 		_onDisconnect = std::move(callback);
 	}
 
-	void Server::set_on_connect(std::function<void()> callback)
+	void Server::set_on_connect(std::function<void(uint32_t)> callback)
 	{
 		_onConnect = std::move(callback);
 	}
 
 	size_t Server::client_count() const
 	{
-		return _clients.size();
+		return _clientCount.load(std::memory_order_relaxed);
 	}
 
-	void Server::add_on_message_received(std::function<void(const std::vector<uint8_t>&)> callback)
+	void Server::add_on_message_received(std::function<void(uint32_t, const std::vector<uint8_t>&)> callback)
 	{
 		_onMessageReceived = std::move(callback);
 	}
 
-	void Server::stop_accepting()
+	void Server::set_on_relayed_frame(std::function<void(uint32_t, const protocol::FrameHeader&)> callback)
 	{
-		_acceptor.close();
-		if constexpr (SERVER_DEBUG)
-		{
-			std::cout << "Server stopped accepting new connections." << std::endl;
-		}
+		_onRelayedFrame = std::move(callback);
 	}
 
-	std::vector<uint32_t> Server::get_all_client_ids() const
+	void Server::stop_accepting()
 	{
-		std::vector<uint32_t> ids;
-		ids.reserve(_clients.size());
-		for (const auto& [id, _] : _clients)
+		asio::post(_ioContext, [this]()
+			{
+				_acceptor.close();
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+				asio::error_code ec;
+				_localAcceptor.close(ec);
+#endif
+			});
+		if constexpr (SERVER_DEBUG)
 		{
-			ids.push_back(id);
+			logging::info<"Server stopped accepting new connections.">();
 		}
-		return ids;
 	}
 
 	uint32_t Server::get_last_client_sent_data() const
@@ -84,21 +143,21 @@ namespace server
 
 	std::vector<uint8_t> Server::get_accumulated_data(size_t id)
 	{
-		auto it = _clients.find(id);
-		if (it == _clients.end())
+		ShardSessions& sessions = sessions_of(static_cast<uint32_t>(id));
+		auto it = sessions.accumulatedData.find(id);
+		if (it == sessions.accumulatedData.end())
 		{
 			if constexpr (SERVER_DEBUG)
 			{
-				std::cerr << "Client ID " << id << " not found." << std::endl;
+				logging::error<"Client ID {} not found.">(id);
 			}
 			return {};
 		}
-		const ClientSession& client = it->second;
 		if constexpr (SERVER_DEBUG)
 		{
 			std::cout << "Accumulated data for client " << id << ": ";
 
-			const auto& data = _accumulatedData.at(id); 
+			const auto& data = it->second;
 			for (const auto& byte : data)
 			{
 				std::cout << static_cast<uint8_t>(byte) << " ";
@@ -106,37 +165,305 @@ namespace server
 			std::cout << std::endl;
 		}
 
-		return _accumulatedData.at(id);
+		return it->second;
 	}
 #endif
 
 	uint32_t Server::get_current_client_id() const
 	{
-		return _nextClientId;
+		return _currentClientId;
 	}
 
 	void Server::disconnect_client(uint32_t clientId)
 	{
-		auto it = _clients.find(clientId);
-		if (it != _clients.end())
+		run_on_shard(shard_of(clientId), [this, clientId]()
+			{
+				ClientSession* session = find_session(clientId);
+				if (!session)
+				{
+					if constexpr (SERVER_DEBUG)
+					{
+						logging::error<"Client ID {} not found.">(clientId);
+					}
+					return;
+				}
+
+				if constexpr (SERVER_DEBUG)
+				{
+					logging::info<"Client {} disconnected by server.">(clientId);
+				}
+
+				// The connection stays, only its client learns that this channel is gone
+				if (session->parent != 0)
+				{
+					write_bytes(clientId, protocol::encode_frame(protocol::MSG_CLOSE_CHANNEL).data(), protocol::HeaderSize);
+					end_session(clientId);
+					return;
+				}
+
+				bool reading = session->reading;
+				close_transport(*session);
+
+				// A pending read completes with an error and ends the session, so the disconnect callback runs once either way
+				if (!reading)
+					end_session(clientId);
+			});
+	}
+
+	bool Server::has_client(uint32_t clientId)
+	{
+		return find_session(clientId) != nullptr;
+	}
+
+	void Server::migrate_client(uint32_t clientId, size_t targetShard, std::function<void(uint32_t)> done)
+	{
+		size_t sourceShard = shard_of(clientId);
+
+		// `done` is always posted so callers may hold locks while requesting a migration
+		if (sourceShard == targetShard)
 		{
-			if (it->second.socket->is_open())
+			asio::post(_shards.get_context(targetShard), [clientId, done = std::move(done)]()
+				{
+					done(clientId);
+				});
+			return;
+		}
+
+		run_on_shard(sourceShard, [this, clientId, targetShard, done = std::move(done)]() mutable
 			{
-				it->second.socket->close();
-			}
-			_clients.erase(it);
-			if constexpr (SERVER_DEBUG)
+				// A loopback link has no shard of its own, the session is simply registered again
+				ClientSession* session = find_session(clientId);
+				if (session && session->loopback && session->channels.empty())
+				{
+					std::shared_ptr<transport::LoopbackLink> link = session->loopback;
+					erase_session(clientId);
+
+					asio::post(_shards.get_context(targetShard), [this, targetShard, link, done = std::move(done)]()
+						{
+							done(register_session(targetShard, nullptr, link));
+						});
+					return;
+				}
+
+				asio::generic::stream_protocol protocol(asio::ip::tcp::v4());
+				NativeHandle native;
+
+				switch (release_session(clientId, protocol, native))
+				{
+				case ReleaseResult::NotFound:
+					asio::post(_shards.get_context(targetShard), [done = std::move(done)]() { done(0); });
+					return;
+
+				case ReleaseResult::Unsupported:
+					asio::post(_shards.get_context(targetShard), [clientId, done = std::move(done)]() { done(clientId); });
+					return;
+
+				case ReleaseResult::Released:
+					break;
+				}
+
+				asio::post(_shards.get_context(targetShard), [this, clientId, targetShard, protocol, native, done = std::move(done)]()
+					{
+						uint32_t newId = adopt_session(targetShard, protocol, native);
+						_recorder.shard(targetShard).record(FE_MIGRATE, clientId, 0, newId, targetShard);
+
+						if constexpr (SERVER_DEBUG)
+						{
+							logging::info<"Client {} moved to shard {} as {}">(clientId, targetShard, newId);
+						}
+
+						done(newId);
+					});
+			});
+	}
+
+	void Server::detach_client(uint32_t clientId, std::function<void(NativeHandle)> done)
+	{
+		run_on_shard(shard_of(clientId), [this, clientId, done = std::move(done)]()
 			{
-				std::cout << "Client " << clientId << " disconnected by server." << std::endl;
-			}
+				asio::generic::stream_protocol protocol(asio::ip::tcp::v4());
+				NativeHandle native;
+
+				if (release_session(clientId, protocol, native) != ReleaseResult::Released)
+				{
+					done(InvalidNativeHandle);
+					return;
+				}
+
+				done(native);
+			});
+	}
+
+	void Server::adopt_client(NativeHandle native, size_t shard, std::function<void(uint32_t)> done)
+	{
+		asio::post(_shards.get_context(shard), [this, native, shard, done = std::move(done)]() mutable
+			{
+				asio::error_code ec;
+				StreamSocket probe(_shards.get_context(shard));
+				asio::generic::stream_protocol protocol(asio::ip::tcp::v4());
+
+				// Recover the address family of a socket handed over from another process, TCP or local
+				probe.assign(protocol, native, ec);
+				if (!ec)
+				{
+					auto local = probe.local_endpoint(ec);
+					if (!ec)
+						protocol = local.protocol();
+					native = probe.release(ec);
+				}
+
+				done(adopt_session(shard, protocol, native));
+			});
+	}
+
+	void Server::post_to_shard(size_t shard, std::function<void()> work)
+	{
+		asio::post(_shards.get_context(shard), std::move(work));
+	}
+
+	std::shared_ptr<transport::LoopbackLink> Server::connect_loopback()
+	{
+		auto link = std::make_shared<transport::LoopbackLink>();
+		size_t shard = _shards.next_shard();
+
+		asio::post(_shards.get_context(shard), [this, shard, link]()
+			{
+				open_session(shard, nullptr, link);
+			});
+
+		return link;
+	}
+
+	size_t Server::poll()
+	{
+		size_t handled = 0;
+		for (size_t shard = 0; shard < _shards.size(); shard++)
+		{
+			asio::io_context& context = _shards.get_context(shard);
+
+			// Queued behind what is already posted, so reads keep their place among the shard's work
+			asio::post(context, [this, shard]()
+				{
+					pump_loopback(shard);
+				});
+
+			handled += context.poll();
 		}
-		else
+		return handled;
+	}
+
+	bool Server::start_relay(uint32_t first, uint32_t second)
+	{
+		size_t shard = shard_of(first);
+		if (!SpliceRelay::supported() || shard != shard_of(second) || !_shards.running_in_shard(shard))
+			return false;
+
+		for (uint32_t id : { first, second })
 		{
-			if constexpr (SERVER_DEBUG)
+			ClientSession* session = find_session(id);
+			if (!session || !session->socket || session->migrating || session->relay || !session->channels.empty() || !session->outbox.empty())
+				return false;
+		}
+
+		auto firstRelay = std::make_unique<SpliceRelay>();
+		auto secondRelay = std::make_unique<SpliceRelay>();
+		if (!firstRelay->open() || !secondRelay->open())
+			return false;
+
+		std::pair<uint32_t, std::unique_ptr<SpliceRelay>> directions[] = { { first, std::move(firstRelay) }, { second, std::move(secondRelay) } };
+		for (auto& [id, relay] : directions)
+		{
+			ClientSession* session = find_session(id);
+			session->relay = std::move(relay);
+			session->relayPeer = id == first ? second : first;
+			recorder_of(id).record(FE_RELAY_START, id, 0, session->relayPeer);
+		}
+
+		for (uint32_t id : { first, second })
+		{
+			ClientSession* session = find_session(id);
+
+			// The cancelled read comes back through handle_incoming_data, which hands over to the relay
+			if (session->reading)
 			{
-				std::cerr << "Client ID " << clientId << " not found." << std::endl;
+				asio::error_code ec;
+				session->socket->cancel(ec);
 			}
+			else
+			{
+				begin_relay(id);
+			}
+		}
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Relaying {} <-> {} in the kernel">(first, second);
 		}
+
+		return true;
+	}
+
+	void Server::stop_relay(uint32_t clientId)
+	{
+		run_on_shard(shard_of(clientId), [this, clientId]()
+			{
+				end_relay(clientId);
+			});
+	}
+
+	asio::io_context& Server::shard_context(size_t shard)
+	{
+		return _shards.get_context(shard);
+	}
+
+	size_t Server::shard_count() const
+	{
+		return _shards.size();
+	}
+
+	size_t Server::shard_of(uint32_t clientId)
+	{
+		return clientId >> ShardShift;
+	}
+
+	const char* Server::event_backend()
+	{
+#if defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+		return "io_uring";
+#elif defined(ASIO_HAS_EPOLL)
+		return "epoll";
+#elif defined(ASIO_HAS_KQUEUE)
+		return "kqueue";
+#elif defined(ASIO_HAS_IOCP)
+		return "iocp";
+#else
+		return "select";
+#endif
+	}
+
+	uint64_t Server::frames_received() const
+	{
+		return _metrics.total(MC_FRAMES_IN);
+	}
+
+	uint64_t Server::frames_sent() const
+	{
+		return _metrics.total(MC_FRAMES_OUT);
+	}
+
+	MetricsRegistry& Server::metrics()
+	{
+		return _metrics;
+	}
+
+	FlightRecorder& Server::recorder()
+	{
+		return _recorder;
+	}
+
+	ShardLoad Server::shard_load(size_t shard) const
+	{
+		return _shards.load(shard);
 	}
 
 	asio::ip::tcp::endpoint Server::get_endpoint() const
@@ -146,23 +473,43 @@ namespace server
 
 	void Server::stop()
 	{
-		_acceptor.close();
+		// It reads gauges the owner registered, which may be gone once stop() returns
+		if (_metricsExporter)
+			_metricsExporter->stop();
+
+		_workGuard.reset();
 		_ioContext.stop();
 
-		for (auto& [id, socket] : _clients)
+		if (_ioThread.joinable())
+			_ioThread.join();
+
+		asio::error_code ec;
+		_acceptor.close(ec);
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		if (_localAcceptor.is_open())
 		{
-			if (socket.socket->is_open())
-				socket.socket->close();
+			_localAcceptor.close(ec);
+			_localFile.remove();
 		}
+#endif
 
-		if (_ioThread.joinable())
-			_ioThread.join();
+		_shards.stop();
+
+		for (auto& sessions : _sessions)
+		{
+			for (auto& session : sessions.clients)
+				close_transport(session);
+
+			sessions.clients.clear();
+			sessions.loopbackClients.clear();
+		}
 
-		_clients.clear();
+		_clientCount = 0;
 
 		if constexpr (SERVER_DEBUG)
 		{
-			std::cout << "Server stopped." << std::endl;
+			logging::info<"Server stopped after {} frames in, {} frames out.">(frames_received(), frames_sent());
 		}
 	}
 
@@ -171,151 +518,1090 @@ namespace server
 		stop();
 	}
 
-	void Server::start_accept()
+	Server::ShardSessions& Server::sessions_of(uint32_t clientId)
 	{
-		auto socket = std::make_shared<asio::ip::tcp::socket>(_ioContext);
+		return _sessions[shard_of(clientId)];
+	}
 
-		_acceptor.async_accept(*socket, [this, socket](const asio::error_code& error) 
-			{
-				handle_accept(socket, error);
-			});
+	ShardMetrics& Server::metrics_of(uint32_t clientId)
+	{
+		return _metrics.shard(shard_of(clientId));
 	}
 
-	void Server::handle_accept(std::shared_ptr<asio::ip::tcp::socket> socket, const asio::error_code& error)
+	ShardRecorder& Server::recorder_of(uint32_t clientId)
 	{
-		if (error)
-		{
-			if constexpr (SERVER_DEBUG)
-			{
-				std::cerr << "Accept failed: " << error.message() << std::endl;
-			}
-		}
+		return _recorder.shard(shard_of(clientId));
+	}
 
-		uint32_t clientId = ++_nextClientId;
+	Server::ClientSession* Server::find_session(uint32_t clientId)
+	{
+		size_t shard = shard_of(clientId);
+		if (shard >= _sessions.size())
+			return nullptr;
 
-		if constexpr (SERVER_DEBUG)
-		{
-			std::cout << "Client connected: " << socket->remote_endpoint() << std::endl;
-		}
+		return _sessions[shard].clients.find(clientId & LocalIdMask);
+	}
 
-		_clients[clientId] = std::move(ClientSession{ socket, 1024 });
+	bool Server::erase_session(uint32_t clientId)
+	{
+		ShardSessions& sessions = sessions_of(clientId);
 
 #ifdef SERVER_SAVE_PREV_DATA
-		_accumulatedData[clientId] = std::vector<uint8_t>();
+		sessions.accumulatedData.erase(clientId);
 #endif
 
+		ClientSession* session = sessions.clients.find(clientId & LocalIdMask);
+		if (session && session->loopback)
+			std::erase(sessions.loopbackClients, clientId);
 
-		start_session(clientId);
+		// What a dead socket never got to write leaves the queue with it
+		if (session)
+			metrics_of(clientId).add(MG_OUTBOX_BYTES, -static_cast<int64_t>(session->outboxBytes));
 
+		if (!sessions.clients.erase(clientId & LocalIdMask))
+			return false;
 
-		if (_onConnect)
-			_onConnect();
-		
-		if (_acceptor.is_open())
-			start_accept(); 
+		_clientCount.fetch_sub(1, std::memory_order_relaxed);
+		metrics_of(clientId).add(MG_SESSIONS, -1);
+		return true;
 	}
 
-	void Server::start_session(uint32_t id)
+	uint32_t Server::client_id(size_t shard, uint32_t handle)
 	{
-		if (_clients.find(id) == _clients.end())
-		{
-			std::cerr << "Client ID " << id << " not found." << std::endl;
-			return;
-		}
-		ClientSession& client = _clients[id];
-
-		if constexpr (SERVER_DEBUG)
-		{
-			std::cout << "Starting session with client: " << client.socket->remote_endpoint() << std::endl;
-		}
-
-		uint32_t netId = htonl(id);
-		asio::write(*client.socket, asio::buffer(&netId, sizeof(netId)));
-
-		client.socket->async_read_some(
-			asio::buffer(client.buffer),
-			[this, id](const asio::error_code& error, std::size_t bytesTransferred)
-			{
-				handle_incoming_data(error, bytesTransferred, id);
-			});
+		return (static_cast<uint32_t>(shard) << ShardShift) | handle;
 	}
 
-	void Server::handle_incoming_data(const asio::error_code& error, size_t byteSizeTransferred, size_t id)
+	void Server::write_bytes(uint32_t clientId, const uint8_t* data, size_t size)
 	{
-		if (_clients.find(id) == _clients.end())
+		ClientSession* session = find_session(clientId);
+		if (!session)
 		{
+			// Frames racing a disconnect are routine, only debug builds mention them
 			if constexpr (SERVER_DEBUG)
 			{
-				std::cerr << "Client ID " << id << " not found." << std::endl;
+				logging::error<"Client ID {} not found.">(clientId);
 			}
 			return;
 		}
+		if (session->relay && write_through_relay(clientId, data, size))
+			return;
 
-		if (error || byteSizeTransferred == 0)
+		if (session->parent != 0)
 		{
-			if (error == asio::error::eof)
+			std::vector<uint8_t> stamped(data, data + size);
+			protocol::set_channel(stamped.data(), stamped.size(), session->channel);
+			write_bytes(session->parent, stamped.data(), stamped.size());
+			return;
+		}
+
+		if (session->loopback)
+		{
+			// A client that let its ring fill up is treated like one whose send buffer did
+			if (!session->loopback->toClient.try_push_all(data, size))
 			{
 				if constexpr (SERVER_DEBUG)
 				{
-					std::cout << "Client " << id << " disconnected." << std::endl;
+					logging::error<"Send failed: loopback client {} is not reading">(clientId);
 				}
+				close_transport(*session);
+				return;
 			}
-			else if (error == asio::error::operation_aborted || error == asio::error::connection_reset)
+
+			metrics_of(clientId).add(MC_FRAMES_OUT);
+			metrics_of(clientId).add(MC_BYTES_OUT, size);
+			return;
+		}
+
+		// Straight to the socket only while nothing is queued ahead of the frame and the kernel
+		// takes it without waiting; the rest goes out in the background, so a player who stops
+		// reading holds up nobody else on the shard
+		if (session->outbox.empty() && session->socket->is_open())
+		{
+			asio::error_code ec;
+			if (!session->socket->non_blocking())
+				session->socket->non_blocking(true, ec);
+
+			size_t written = session->socket->write_some(asio::buffer(data, size), ec);
+			if (ec && ec != asio::error::would_block && ec != asio::error::try_again)
 			{
 				if constexpr (SERVER_DEBUG)
 				{
-					std::cout << "Client " << id << " disconnected ungracfully." << std::endl;
+					logging::error<"Send failed: {}">(ec.message());
 				}
+				recorder_of(clientId).record(FE_WRITE_ERROR, clientId, 0, static_cast<uint64_t>(ec.value()));
+				// The pending read on this socket completes with an error and runs the disconnect path
+				close_transport(*session);
+				return;
 			}
-			else
-			{
-				if constexpr (SERVER_DEBUG)
-				{
-					std::cerr << "Error receiving data from client " << id << ": " << error.message() << std::endl;
 
-				}
+			metrics_of(clientId).add(MC_BYTES_OUT, written);
+			if (written == size)
+			{
+				metrics_of(clientId).add(MC_FRAMES_OUT);
+				return;
 			}
 
-			if (_onDisconnect)
-				_onDisconnect();
+			data += written;
+			size -= written;
+		}
 
-			_clients.erase(id);
+		push_outbox(clientId, clientId, std::make_shared<const std::vector<uint8_t>>(data, data + size), nullptr);
+	}
 
-			_nextClientId--;
+	void Server::send_shared(const std::vector<uint32_t>& clientIds, SharedFrames frames, SharedFrames resync)
+	{
+		// One post per shard however many of its clients are listening
+		std::vector<std::vector<uint32_t>> byShard(_shards.size());
+		for (uint32_t id : clientIds)
+		{
+			if (shard_of(id) < byShard.size())
+				byShard[shard_of(id)].push_back(id);
+		}
 
-			if constexpr (SERVER_DEBUG)
-			{
-				std::cout << "Session with client " << id << " ended." << std::endl;
-			}
-			return;
+		for (size_t shard = 0; shard < byShard.size(); shard++)
+		{
+			if (byShard[shard].empty())
+				continue;
+
+			run_on_shard(shard, [this, ids = std::move(byShard[shard]), frames, resync]()
+				{
+					for (uint32_t id : ids)
+						queue_frames(id, frames, resync);
+				});
 		}
+	}
+
+	void Server::queue_frames(uint32_t clientId, SharedFrames frames, SharedFrames resync)
+	{
+		ClientSession* session = find_session(clientId);
+		if (!session)
+			return;
 
-		ClientSession& client = _clients[id];
+		uint32_t connectionId = session->parent != 0 ? session->parent : clientId;
+		ClientSession* connection = find_session(connectionId);
+		if (!connection)
+			return;
 
-		if (byteSizeTransferred > client.buffer.size())
+		// Loopback rings never block and a relay keeps its own order, both take the bytes as they are
+		if (!connection->socket || connection->relay)
 		{
-			if constexpr (SERVER_DEBUG)
-			{
-				std::cerr << "Received data size exceeds buffer capacity for client " << id << ". Resizing buffer." << std::endl;
-			}
-			client.buffer.resize(byteSizeTransferred);
+			write_bytes(clientId, frames->data(), frames->size());
+			return;
 		}
 
-		_lastClientSentData = id;
+		// A channel's copy carries its channel, so it is the one buffer that is not shared
+		if (session->parent != 0)
+		{
+			auto stamp = [channel = session->channel](const SharedFrames& shared)
+				{
+					auto stamped = std::make_shared<std::vector<uint8_t>>(*shared);
+					protocol::set_channel(stamped->data(), stamped->size(), channel);
+					return SharedFrames(std::move(stamped));
+				};
 
-		std::vector<uint8_t> data(client.buffer.begin(), client.buffer.begin() + byteSizeTransferred);
+			frames = stamp(frames);
+			if (resync)
+				resync = stamp(resync);
+		}
+
+		push_outbox(connectionId, clientId, std::move(frames), std::move(resync));
+	}
+
+	void Server::push_outbox(uint32_t connectionId, uint32_t clientId, SharedFrames frames, SharedFrames resync)
+	{
+		ClientSession* connection = find_session(connectionId);
+		if (!connection)
+			return;
+
+		if (connection->outboxBytes + frames->size() > MaxOutboxBytes)
+		{
+			// What this client has not started receiving is superseded by the resync
+			if (resync)
+			{
+				auto first = connection->outbox.begin() + connection->outboxInFlight;
+				for (auto it = first; it != connection->outbox.end();)
+				{
+					if (it->clientId != clientId)
+					{
+						++it;
+						continue;
+					}
+
+					connection->outboxBytes -= it->frames->size();
+					metrics_of(connectionId).add(MG_OUTBOX_BYTES, -static_cast<int64_t>(it->frames->size()));
+					it = connection->outbox.erase(it);
+				}
+
+				frames = std::move(resync);
+			}
+
+			if (connection->outboxBytes + frames->size() > MaxOutboxBytes)
+			{
+				if constexpr (SERVER_DEBUG)
+				{
+					logging::error<"Send failed: client {} fell {} bytes behind">(connectionId, connection->outboxBytes);
+				}
+				recorder_of(connectionId).record(FE_OUTBOX_OVERFLOW, connectionId, 0, connection->outboxBytes);
+				close_transport(*connection);
+				return;
+			}
+		}
+
+		connection->outboxBytes += frames->size();
+		metrics_of(connectionId).add(MG_OUTBOX_BYTES, static_cast<int64_t>(frames->size()));
+		connection->outbox.push_back({ std::move(frames), clientId });
+
+		if (connection->outboxInFlight == 0)
+			flush_outbox(connectionId);
+	}
+
+	void Server::flush_outbox(uint32_t id)
+	{
+		ClientSession* session = find_session(id);
+		if (!session || session->outbox.empty() || !session->socket->is_open())
+			return;
+
+		// The buffers stay alive in the handler until the write is done with them
+		size_t count = std::min(session->outbox.size(), MaxOutboxGather);
+		std::vector<SharedFrames> held;
+		std::vector<asio::const_buffer> buffers;
+		for (size_t i = 0; i < count; i++)
+		{
+			held.push_back(session->outbox[i].frames);
+			buffers.push_back(asio::buffer(*held.back()));
+		}
+
+		session->outboxInFlight = count;
+
+		asio::async_write(*session->socket, buffers, [this, id, held = std::move(held)](const asio::error_code& error, size_t written)
+			{
+				ClientSession* session = find_session(id);
+				if (!session)
+					return;
+
+				session->outboxInFlight = 0;
+
+				// The pending read sees the closed socket and ends the session
+				if (error)
+				{
+					recorder_of(id).record(FE_WRITE_ERROR, id, 0, static_cast<uint64_t>(error.value()));
+					close_transport(*session);
+					return;
+				}
+
+				for (size_t i = 0; i < held.size(); i++)
+				{
+					session->outboxBytes -= session->outbox.front().frames->size();
+					session->outbox.pop_front();
+				}
+
+				ShardMetrics& stats = metrics_of(id);
+				stats.add(MG_OUTBOX_BYTES, -static_cast<int64_t>(written));
+				stats.add(MC_FRAMES_OUT, held.size());
+				stats.add(MC_BYTES_OUT, written);
+
+				flush_outbox(id);
+			});
+	}
+
+	void Server::close_transport(ClientSession& session)
+	{
+		if (session.loopback)
+		{
+			session.loopback->serverClosed.store(true, std::memory_order_release);
+			return;
+		}
+
+		// Channel sessions have nothing to close, their connection does
+		asio::error_code ec;
+		if (session.socket && session.socket->is_open())
+			session.socket->close(ec);
+	}
+
+	uint32_t Server::register_session(size_t shard, std::shared_ptr<StreamSocket> socket, std::shared_ptr<transport::LoopbackLink> link)
+	{
+		ShardSessions& sessions = _sessions[shard];
+		bool loopback = link != nullptr;
+
+		uint32_t handle = sessions.clients.emplace(std::move(socket), std::move(link), 1024);
+		if (handle == decltype(sessions.clients)::InvalidHandle)
+			return 0;
+
+		uint32_t clientId = client_id(shard, handle);
+		_clientCount.fetch_add(1, std::memory_order_relaxed);
+		_metrics.shard(shard).add(MG_SESSIONS, 1);
+
+		if (loopback)
+			sessions.loopbackClients.push_back(clientId);
 
 #ifdef SERVER_SAVE_PREV_DATA
-		_accumulatedData[id].insert(_accumulatedData[id].end(), data.begin(), data.end());
+		sessions.accumulatedData[clientId] = std::vector<uint8_t>();
+#endif
+
+		return clientId;
+	}
+
+	void Server::open_acceptor(const ServerConfig& config)
+	{
+		_acceptor.open(_endpoint.protocol());
+		_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+
+		if (config.reusePort)
+		{
+#ifdef SO_REUSEPORT
+			// Every process bound with SO_REUSEPORT gets its own accept queue and the kernel balances between them
+			_acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"SO_REUSEPORT is not available on this platform, binding exclusively.">();
+			}
+#endif
+		}
+
+		_acceptor.bind(_endpoint);
+		_acceptor.listen();
+	}
+
+	void Server::configure_socket(StreamSocket& socket)
+	{
+		// Unix domain sockets have no TCP stack to tune
+		if (!is_tcp(socket))
+			return;
+
+		asio::error_code ec;
+
+		// Frames are a few bytes each and latency bound, Nagle would only hold them back
+		socket.set_option(asio::ip::tcp::no_delay(true), ec);
+
+		if (!_busyPoll)
+			return;
+
+#ifdef SO_BUSY_POLL
+		if (_busyPollMicros > 0)
+			socket.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(_busyPollMicros), ec);
+#endif
+
+		request_quick_ack(socket);
+
+		if (ec)
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Could not set low latency socket options: {}">(ec.message());
+			}
+		}
+	}
+
+	void Server::request_quick_ack(StreamSocket& socket)
+	{
+#ifdef TCP_QUICKACK
+		// Linux clears quick ack after it fires, so it is asked for again before every read
+		asio::error_code ec;
+		socket.set_option(asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_QUICKACK>(true), ec);
+#else
+		(void)socket;
+#endif
+	}
+
+	bool Server::is_tcp(const StreamSocket& socket)
+	{
+		asio::error_code ec;
+		int family = socket.local_endpoint(ec).protocol().family();
+		return !ec && (family == AF_INET || family == AF_INET6);
+	}
+
+	std::string Server::peer_name(const StreamSocket& socket)
+	{
+		if (!is_tcp(socket))
+			return "local";
+
+		asio::error_code ec;
+		auto generic = socket.remote_endpoint(ec);
+		if (ec)
+			return "unknown";
+
+		asio::ip::tcp::endpoint endpoint;
+		std::memcpy(endpoint.data(), generic.data(), generic.size());
+		endpoint.resize(generic.size());
+		return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+	}
+
+	void Server::start_accept()
+	{
+		size_t shard = _shards.next_shard();
+
+		_acceptor.async_accept(_shards.get_context(shard), [this, shard](const asio::error_code& error, asio::ip::tcp::socket socket)
+			{
+				handle_accept(shard, StreamSocket(std::move(socket)), error, false);
+			});
+	}
+
+	void Server::open_local_acceptor(const std::string& path)
+	{
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		_localFile = bind_local_acceptor(_localAcceptor, path);
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Also accepting local clients on {}">(path);
+		}
+#else
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::error<"Unix domain sockets are not available on this platform, {} is ignored.">(path);
+		}
+#endif
+	}
+
+	void Server::start_local_accept()
+	{
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+		size_t shard = _shards.next_shard();
+
+		_localAcceptor.async_accept(_shards.get_context(shard), [this, shard](const asio::error_code& error, asio::local::stream_protocol::socket socket)
+			{
+				handle_accept(shard, StreamSocket(std::move(socket)), error, true);
+			});
+#endif
+	}
+
+	void Server::handle_accept(size_t shard, StreamSocket socket, const asio::error_code& error, bool local)
+	{
+		// Keeps the acceptor that produced this socket going
+		auto rearm = [this, local]()
+			{
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+				if (local)
+				{
+					if (_localAcceptor.is_open())
+						start_local_accept();
+					return;
+				}
 #endif
-		
-		_onMessageReceived(data);
+				if (_acceptor.is_open())
+					start_accept();
+			};
+
+		if (error)
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Accept failed: {}">(error.message());
+			}
+
+			rearm();
+			return;
+		}
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Client connected: {} on shard {}">(peer_name(socket), shard);
+		}
+
+		// The socket is bound to the shard's io_context, so the session is set up there
+		auto shared = std::make_shared<StreamSocket>(std::move(socket));
+
+		asio::post(_shards.get_context(shard), [this, shard, shared]()
+			{
+				open_session(shard, shared, nullptr);
+			});
+
+		rearm();
+	}
+
+	void Server::open_session(size_t shard, std::shared_ptr<StreamSocket> socket, std::shared_ptr<transport::LoopbackLink> link)
+	{
+		uint32_t clientId = register_session(shard, std::move(socket), std::move(link));
+		if (clientId == 0)
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Shard {} is full, dropping connection.">(shard);
+			}
+			return;
+		}
+
+		_metrics.shard(shard).add(MC_ACCEPTS);
+		_recorder.shard(shard).record(FE_ACCEPT, clientId);
+		FC_TRACE(session_accept, clientId, 0);
+
+		start_session(clientId);
+
+		_currentClientId = clientId;
+
+		if (_onConnect)
+			_onConnect(clientId);
+	}
+
+	void Server::start_session(uint32_t id)
+	{
+		ClientSession* session = find_session(id);
+		if (!session)
+		{
+			logging::error<"Client ID {} not found.">(id);
+			return;
+		}
+		ClientSession& client = *session;
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Starting session with client: {}">((client.loopback ? "loopback" : peer_name(*client.socket)));
+		}
+
+		uint32_t netId = htonl(id);
+
+		// Loopback sessions are read by poll() and have nothing to configure
+		if (client.loopback)
+		{
+			client.loopback->toClient.try_push_all(reinterpret_cast<const uint8_t*>(&netId), sizeof(netId));
+			return;
+		}
+
+		configure_socket(*client.socket);
+
+		asio::error_code ec;
+		asio::write(*client.socket, asio::buffer(&netId, sizeof(netId)), ec);
+
+		start_read(id);
+	}
+
+	void Server::start_read(uint32_t id)
+	{
+		ClientSession& client = *find_session(id);
+		client.reading = true;
+
+		if (_busyPoll)
+			request_quick_ack(*client.socket);
 
 		client.socket->async_read_some(
 			asio::buffer(client.buffer),
-			[this, id](const asio::error_code& err, size_t transferred)
+			[this, id](const asio::error_code& error, std::size_t bytesTransferred)
 			{
-				handle_incoming_data(err, transferred, id);
+				handle_incoming_data(error, bytesTransferred, id);
 			});
 	}
+
+	void Server::handle_incoming_data(const asio::error_code& error, size_t byteSizeTransferred, uint32_t id)
+	{
+		ClientSession* session = find_session(id);
+		if (!session)
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Client ID {} not found.">(id);
+			}
+			return;
+		}
+
+		ClientSession& client = *session;
+		client.reading = false;
+
+		if (error == asio::error::operation_aborted && client.relay)
+		{
+			begin_relay(id);
+			return;
+		}
+
+		if (error == asio::error::operation_aborted && client.migrating)
+		{
+			// The socket could not be released and stays on this shard
+			client.migrating = false;
+			if (client.socket->is_open())
+				start_read(id);
+			return;
+		}
+
+		if (error || byteSizeTransferred == 0)
+		{
+			if (error && error != asio::error::eof)
+				recorder_of(id).record(FE_READ_ERROR, id, 0, static_cast<uint64_t>(error.value()));
+
+			if (error == asio::error::eof)
+			{
+				if constexpr (SERVER_DEBUG)
+				{
+					logging::info<"Client {} disconnected.">(id);
+				}
+			}
+			else if (error == asio::error::operation_aborted || error == asio::error::connection_reset)
+			{
+				if constexpr (SERVER_DEBUG)
+				{
+					logging::info<"Client {} disconnected ungracfully.">(id);
+				}
+			}
+			else
+			{
+				if constexpr (SERVER_DEBUG)
+				{
+					logging::error<"Error receiving data from client {}: {}">(id, error.message());
+
+				}
+			}
+
+			end_session(id);
+			return;
+		}
+
+		if (!deliver_frames(id, byteSizeTransferred))
+			return;
+
+		session = find_session(id);
+
+		// A relay started while this read was completing takes over from here
+		if (session->relay)
+			begin_relay(id);
+		else
+			start_read(id);
+	}
+
+	bool Server::deliver_frames(uint32_t id, size_t byteSizeTransferred)
+	{
+		ClientSession& client = *find_session(id);
+
+		if (byteSizeTransferred > client.buffer.size())
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Received data size exceeds buffer capacity for client {}. Resizing buffer.">(id);
+			}
+			client.buffer.resize(byteSizeTransferred);
+		}
+
+#ifdef SERVER_SAVE_PREV_DATA
+		auto& accumulated = sessions_of(id).accumulatedData[id];
+		accumulated.insert(accumulated.end(), client.buffer.begin(), client.buffer.begin() + byteSizeTransferred);
+#endif
+
+		metrics_of(id).add(MC_BYTES_IN, byteSizeTransferred);
+
+		// The tail of a frame that was partly relayed when its relay stopped
+		size_t skipped = std::min(client.discard, byteSizeTransferred);
+		client.discard -= skipped;
+
+		client.reader.append(client.buffer.data() + skipped, byteSizeTransferred - skipped);
+
+		ClientSession* session = nullptr;
+		std::vector<uint8_t> frame;
+		while (true)
+		{
+			// The callback may have migrated or dropped this client
+			// and sessions may have moved in the table, so look it up again
+			session = find_session(id);
+			if (!session || session->migrating)
+				return false;
+
+			if (!session->reader.next(frame))
+				break;
+
+			metrics_of(id).add(MC_FRAMES_IN);
+
+			uint32_t target = id;
+			uint16_t channel = protocol::frame_header(frame).channel;
+			if (channel != 0)
+			{
+				target = route_channel(id, protocol::frame_header(frame));
+				if (target == 0)
+					continue;
+
+				protocol::set_channel(frame.data(), frame.size(), 0);
+			}
+
+			recorder_of(id).record(FE_FRAME_IN, target, protocol::frame_header(frame).type, frame.size());
+			FC_TRACE(frame_received, target, protocol::frame_header(frame).type, frame.size());
+
+			_lastClientSentData = target;
+
+			if (_onMessageReceived)
+				_onMessageReceived(target, frame);
+		}
+
+		if (session->reader.corrupt())
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Client {} sent a malformed frame.">(id);
+			}
+			recorder_of(id).record(FE_MALFORMED_FRAME, id);
+
+			close_transport(*session);
+			end_session(id);
+			return false;
+		}
+
+		return true;
+	}
+
+	void Server::pump_loopback(size_t shard)
+	{
+		// Frame callbacks may connect, migrate or end sessions, so walk a copy
+		std::vector<uint32_t> ids = _sessions[shard].loopbackClients;
+
+		for (uint32_t id : ids)
+		{
+			ClientSession* session = find_session(id);
+			if (!session || !session->loopback)
+				continue;
+
+			std::shared_ptr<transport::LoopbackLink> link = session->loopback;
+
+			if (link->serverClosed.load(std::memory_order_acquire))
+			{
+				end_session(id);
+				continue;
+			}
+
+			size_t received = link->toServer.pop_some(session->buffer.data(), session->buffer.size());
+			if (received > 0 && !deliver_frames(id, received))
+				continue;
+
+			// Whatever the client sent before hanging up has been delivered above
+			if (link->clientClosed.load(std::memory_order_acquire) && link->toServer.empty())
+			{
+				if constexpr (SERVER_DEBUG)
+				{
+					logging::info<"Client {} disconnected.">(id);
+				}
+
+				end_session(id);
+			}
+		}
+	}
+
+	uint32_t Server::route_channel(uint32_t id, const protocol::FrameHeader& header)
+	{
+		ClientSession& connection = *find_session(id);
+		auto it = connection.channels.find(header.channel);
+
+		if (header.type == protocol::MSG_CLOSE_CHANNEL)
+		{
+			if (it != connection.channels.end())
+				end_session(it->second);
+			return 0;
+		}
+
+		if (it != connection.channels.end())
+			return it->second;
+
+		return open_channel(id, header.channel);
+	}
+
+	uint32_t Server::open_channel(uint32_t id, uint16_t channel)
+	{
+		ClientSession* connection = find_session(id);
+		if (connection->relay || connection->channels.size() >= MaxChannelsPerConnection)
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Client {} cannot open channel {}">(id, channel);
+			}
+			return 0;
+		}
+
+		uint32_t channelId = register_session(shard_of(id), nullptr);
+		if (channelId == 0)
+			return 0;
+
+		// Registering may have moved sessions in the table
+		ClientSession& session = *find_session(channelId);
+		session.parent = id;
+		session.channel = channel;
+		session.buffer = {}; // reads happen on the connection
+
+		find_session(id)->channels[channel] = channelId;
+		recorder_of(id).record(FE_ACCEPT, channelId, 0, id);
+		FC_TRACE(session_accept, channelId, id);
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Client {} opened channel {} as {}">(id, channel, channelId);
+		}
+
+		_currentClientId = channelId;
+
+		if (_onConnect)
+			_onConnect(channelId);
+
+		return find_session(channelId) ? channelId : 0;
+	}
+
+	Server::ReleaseResult Server::release_session(uint32_t clientId, asio::generic::stream_protocol& protocol, NativeHandle& native)
+	{
+		ClientSession* found = find_session(clientId);
+		if (!found)
+			return ReleaseResult::NotFound;
+
+		// Channels are tied to their connection's transport, a connection to its channels and
+		// queued frames to the socket they are being written to
+		ClientSession& session = *found;
+		if (!session.socket || !session.channels.empty() || !session.outbox.empty())
+			return ReleaseResult::Unsupported;
+
+		asio::error_code ec;
+		protocol = session.socket->local_endpoint(ec).protocol();
+
+		// Cancels the pending read, whose handler sees `migrating` and leaves the session alone
+		session.migrating = true;
+		native = session.socket->release(ec);
+
+		if (ec)
+		{
+			// Without a read in flight no aborted handler will come back to resume the session
+			if (!session.reading)
+				session.migrating = false;
+
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Client {} cannot release its socket: {}">(clientId, ec.message());
+			}
+			return ReleaseResult::Unsupported;
+		}
+
+		erase_session(clientId);
+
+		return ReleaseResult::Released;
+	}
+
+	uint32_t Server::adopt_session(size_t shard, asio::generic::stream_protocol protocol, NativeHandle native)
+	{
+		asio::error_code ec;
+		auto socket = std::make_shared<StreamSocket>(_shards.get_context(shard));
+		socket->assign(protocol, native, ec);
+
+		if (ec)
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				logging::error<"Failed to adopt socket: {}">(ec.message());
+			}
+			return 0;
+		}
+
+		configure_socket(*socket);
+
+		uint32_t clientId = register_session(shard, std::move(socket));
+		start_read(clientId);
+		return clientId;
+	}
+
+	void Server::end_session(uint32_t id)
+	{
+		ClientSession* session = find_session(id);
+
+		// A connection's channels end before it, a channel leaves its connection's table
+		if (session && !session->channels.empty())
+		{
+			std::vector<uint32_t> channels;
+			for (const auto& [channel, channelId] : session->channels)
+				channels.push_back(channelId);
+
+			for (uint32_t channelId : channels)
+				end_session(channelId);
+
+			session = find_session(id);
+		}
+
+		if (session && session->parent != 0)
+		{
+			if (ClientSession* connection = find_session(session->parent))
+				connection->channels.erase(session->channel);
+		}
+
+		// Channels are counted with their connection
+		if (session && session->parent == 0)
+			metrics_of(id).add(MC_DISCONNECTS);
+
+		if (session)
+		{
+			recorder_of(id).record(FE_CLOSE, id);
+			FC_TRACE(session_close, id);
+		}
+
+		_currentClientId = id;
+
+		if (_onDisconnect)
+			_onDisconnect(id);
+
+		erase_session(id);
+
+		if constexpr (SERVER_DEBUG)
+		{
+			logging::info<"Session with client {} ended.">(id);
+		}
+	}
+
+	void Server::begin_relay(uint32_t id)
+	{
+		ClientSession* session = find_session(id);
+		if (!session || !session->relay)
+			return;
+
+		std::vector<uint8_t> carry = session->reader.take_pending();
+		bool primed = session->relay->prime(carry, [this, id](const protocol::FrameHeader& header)
+			{
+				relayed_frame(id, header);
+			});
+
+		if (!primed)
+		{
+			arm_relay(id, SpliceRelay::Result::Corrupt);
+			return;
+		}
+
+		pump_relay(id);
+	}
+
+	void Server::pump_relay(uint32_t id)
+	{
+		ClientSession* session = find_session(id);
+		if (!session || !session->relay)
+			return;
+
+		// Without its peer the relay idles until it is stopped
+		ClientSession* peer = find_session(session->relayPeer);
+		if (!peer)
+			return;
+
+		SpliceRelay::Result result = session->relay->pump(session->socket->native_handle(), peer->socket->native_handle(), [this, id](const protocol::FrameHeader& header)
+			{
+				relayed_frame(id, header);
+			});
+
+		arm_relay(id, result);
+	}
+
+	void Server::arm_relay(uint32_t id, SpliceRelay::Result result)
+	{
+		// Frame callbacks may have changed the session table
+		ClientSession* session = find_session(id);
+		if (!session || !session->relay)
+			return;
+
+		switch (result)
+		{
+		case SpliceRelay::Result::WaitRead:
+		{
+			if (session->relayReadArmed)
+				break;
+
+			session->relayReadArmed = true;
+			session->socket->async_wait(asio::socket_base::wait_read, [this, id](const asio::error_code&)
+				{
+					ClientSession* waiting = find_session(id);
+					if (!waiting)
+						return;
+
+					waiting->relayReadArmed = false;
+					pump_relay(id);
+				});
+			break;
+		}
+		case SpliceRelay::Result::WaitWrite:
+		{
+			ClientSession* peer = find_session(session->relayPeer);
+			if (!peer || session->relayWriteArmed)
+				break;
+
+			session->relayWriteArmed = true;
+			peer->socket->async_wait(asio::socket_base::wait_write, [this, id](const asio::error_code&)
+				{
+					ClientSession* waiting = find_session(id);
+					if (!waiting)
+						return;
+
+					waiting->relayWriteArmed = false;
+					pump_relay(id);
+				});
+			break;
+		}
+		case SpliceRelay::Result::Corrupt:
+		case SpliceRelay::Result::Closed:
+		{
+			if constexpr (SERVER_DEBUG)
+			{
+				if (result == SpliceRelay::Result::Corrupt)
+					logging::error<"Client {} sent a malformed frame.">(id);
+				else
+					logging::info<"Client {} disconnected.">(id);
+			}
+
+			asio::error_code ec;
+			session->socket->close(ec);
+			end_session(id);
+			break;
+		}
+		}
+	}
+
+	void Server::end_relay(uint32_t id)
+	{
+		ClientSession* session = find_session(id);
+		if (!session || !session->relay)
+			return;
+
+		// Whatever was already taken off this socket still belongs to the peer
+		ClientSession* peer = find_session(session->relayPeer);
+		if (peer)
+			session->relay->flush_blocking(peer->socket->native_handle(), RelayFlushTimeoutMs);
+
+		session->discard = session->relay->frame_left();
+
+		std::vector<uint8_t> partial = session->relay->take_partial();
+		session->reader.append(partial.data(), partial.size());
+
+		session->relay.reset();
+		recorder_of(id).record(FE_RELAY_STOP, id);
+
+		// Pending relay waits find no relay when they fire and leave the session to this read
+		if (!session->reading && session->socket->is_open())
+			start_read(id);
+	}
+
+	void Server::relayed_frame(uint32_t id, const protocol::FrameHeader& header)
+	{
+		// Spliced frames never pass through user space, the header is all the relay saw of them
+		ShardMetrics& stats = metrics_of(id);
+		stats.add(MC_FRAMES_IN);
+		stats.add(MC_FRAMES_OUT);
+		stats.add(MC_BYTES_IN, protocol::HeaderSize + header.size);
+		stats.add(MC_BYTES_OUT, protocol::HeaderSize + header.size);
+
+		ClientSession* session = find_session(id);
+		uint32_t peer = session ? session->relayPeer : 0;
+		recorder_of(id).record(FE_RELAYED, id, header.type, peer);
+		FC_TRACE(frame_relayed, id, header.type, peer);
+
+		if (_onRelayedFrame)
+			_onRelayedFrame(id, header);
+	}
+
+	bool Server::write_through_relay(uint32_t clientId, const uint8_t* data, size_t size)
+	{
+		ClientSession* session = find_session(clientId);
+		if (!session || !session->relay)
+			return false;
+
+		// Relays come in pairs, the one flowing into this client belongs to its peer
+		uint32_t peerId = session->relayPeer;
+		ClientSession* peer = find_session(peerId);
+		if (!peer || !peer->relay)
+			return false;
+
+		if (!peer->relay->inject(data, size))
+		{
+			// The client has not read a whole pipe's worth, treat it like a failed send
+			asio::error_code ec;
+			session->socket->close(ec);
+			return true;
+		}
+
+		metrics_of(clientId).add(MC_FRAMES_OUT);
+		metrics_of(clientId).add(MC_BYTES_OUT, size);
+
+		if (!peer->relay->flush(session->socket->native_handle()))
+			arm_relay(peerId, SpliceRelay::Result::WaitWrite);
+
+		return true;
+	}
 }
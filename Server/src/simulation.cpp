@@ -0,0 +1,198 @@
+#include "headers.h"
+#include "simulation.h"
+#include "scripted_game.h"
+
+namespace game
+{
+	namespace
+	{
+		constexpr std::chrono::milliseconds Step{ 10 };
+		constexpr std::chrono::seconds Limit{ 120 };
+
+		struct Bot
+		{
+			std::shared_ptr<transport::LoopbackLink> link;
+			protocol::FrameReader reader;
+			bool greeted = false;
+			bool white = false;
+			bool playing = false;
+			bool done = false;
+			bool sawGameOver = false;
+			size_t nextMove = 0;
+			bool awaitingMove = false;
+			chess::GameClock::time_point moveDue;
+			chess::GameClock::time_point heartbeatDue;
+			uint64_t frames = 0;
+		};
+
+		void send(Bot& bot, const std::vector<uint8_t>& frame)
+		{
+			bot.frames++;
+			if (!bot.link->toServer.try_push_all(frame.data(), frame.size()))
+				bot.done = true;
+		}
+
+		void hang_up(Bot& bot)
+		{
+			bot.done = true;
+			bot.link->clientClosed.store(true, std::memory_order_release);
+		}
+
+		void handle_frame(Bot& bot, const std::vector<uint8_t>& frame, chess::GameClock::time_point now)
+		{
+			bot.frames++;
+
+			switch (protocol::frame_header(frame).type)
+			{
+			case protocol::MSG_START:
+			{
+				protocol::StartMessage start{};
+				protocol::decode_payload(frame, start);
+				bot.white = start.player == chess::PL_WHITE;
+				bot.playing = true;
+				bot.moveDue = now;
+				break;
+			}
+			case protocol::MSG_MOVE:
+			{
+				protocol::MoveMessage move{};
+				protocol::decode_payload(frame, move);
+				if (bot.white && move.player == chess::PL_WHITE && bot.awaitingMove)
+				{
+					bot.awaitingMove = false;
+					bot.nextMove++;
+					bot.moveDue = now + std::chrono::milliseconds(protocol::MoveCooldownMs);
+				}
+				break;
+			}
+			case protocol::MSG_REJECT:
+			{
+				// Still cooling down, the same move goes again once it has
+				bot.awaitingMove = false;
+				bot.moveDue = now + std::chrono::milliseconds(protocol::MoveCooldownMs);
+				break;
+			}
+			case protocol::MSG_GAME_OVER:
+				bot.sawGameOver = true;
+				hang_up(bot);
+				break;
+			case protocol::MSG_OPPONENT_LEFT:
+			case protocol::MSG_ROOM_CLOSED:
+				hang_up(bot);
+				break;
+			default:
+				break;
+			}
+		}
+
+		void update(Bot& bot, chess::GameClock::time_point now)
+		{
+			if (bot.done)
+				return;
+
+			// The server greets with the client id in one 4 byte write before any frame
+			if (!bot.greeted)
+			{
+				uint32_t id = 0;
+				if (bot.link->toClient.pop_some(reinterpret_cast<uint8_t*>(&id), sizeof(id)) < sizeof(id))
+					return;
+				bot.greeted = true;
+				bot.heartbeatDue = now; // the first frame queues the bot for a match
+			}
+
+			uint8_t buffer[1024];
+			size_t received = bot.link->toClient.pop_some(buffer, sizeof(buffer));
+			bot.reader.append(buffer, received);
+
+			std::vector<uint8_t> frame;
+			while (!bot.done && bot.reader.next(frame))
+				handle_frame(bot, frame, now);
+
+			if (bot.done)
+				return;
+
+			if (bot.reader.corrupt() || bot.link->serverClosed.load(std::memory_order_acquire))
+			{
+				hang_up(bot);
+				return;
+			}
+
+			if (now >= bot.heartbeatDue)
+			{
+				send(bot, protocol::encode_frame(protocol::MSG_HEARTBEAT));
+				bot.heartbeatDue = now + std::chrono::milliseconds(protocol::HeartbeatIntervalMs);
+			}
+
+			if (bot.playing && bot.white && !bot.awaitingMove && bot.nextMove < chess::WhiteScript.size() && now >= bot.moveDue)
+			{
+				auto [from, to] = chess::WhiteScript[bot.nextMove];
+				send(bot, protocol::encode_frame(protocol::MSG_MOVE, protocol::MoveMessage{ .player = chess::PL_WHITE, .from = from, .to = to }));
+				bot.awaitingMove = true;
+			}
+		}
+	}
+
+	SimulationReport run_simulation(size_t games, size_t shards)
+	{
+		// Before the server exists, its shard clocks start on virtual time
+		chess::GameClock::use_virtual_time(true);
+
+		server::ServerConfig config;
+		config.shardCount = shards;
+		config.simulated = true;
+
+		SimulationReport report;
+		report.games = games;
+
+		auto began = std::chrono::steady_clock::now();
+		chess::GameClock::time_point start = chess::GameClock::now();
+
+		{
+			GameServer server(0, config);
+
+			std::vector<Bot> bots(games * 2);
+			for (Bot& bot : bots)
+				bot.link = server.connect_loopback();
+
+			size_t done = 0;
+			while (done < bots.size() && chess::GameClock::now() - start < Limit)
+			{
+				server.poll();
+
+				chess::GameClock::time_point now = chess::GameClock::now();
+				done = 0;
+				for (Bot& bot : bots)
+				{
+					update(bot, now);
+					done += bot.done;
+				}
+
+				chess::GameClock::advance(Step);
+			}
+
+			// Lets the server see the hang ups and close the sessions
+			server.poll();
+
+			for (const Bot& bot : bots)
+			{
+				report.frames += bot.frames;
+				report.finished += bot.white && bot.sawGameOver;
+			}
+		}
+
+		report.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - began).count();
+		report.virtualSeconds = std::chrono::duration<double>(chess::GameClock::now() - start).count();
+
+		chess::GameClock::use_virtual_time(false);
+		return report;
+	}
+
+	void print_simulation(const SimulationReport& report, std::ostream& out)
+	{
+		double gamesPerSecond = report.wallSeconds > 0 ? report.finished / report.wallSeconds : 0;
+
+		out << "simulated " << report.finished << " of " << report.games << " games to game over, "
+			<< report.frames << " frames, " << report.virtualSeconds << "s of game time in " << report.wallSeconds
+			<< "s (" << gamesPerSecond << " games/s)" << std::endl;
+	}
+}
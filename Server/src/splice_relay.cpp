@@ -0,0 +1,329 @@
+#include "headers.h"
+#include "splice_relay.h"
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace server
+{
+#ifdef __linux__
+
+	static bool would_block(int error)
+	{
+		return error == EAGAIN || error == EWOULDBLOCK || error == EINTR;
+	}
+
+	bool SpliceRelay::supported()
+	{
+		return true;
+	}
+
+	bool SpliceRelay::open()
+	{
+		int fds[2];
+		if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+			return false;
+
+		_pipeRead = fds[0];
+		_pipeWrite = fds[1];
+		return true;
+	}
+
+	bool SpliceRelay::prime(const std::vector<uint8_t>& carry, const FrameCallback& onFrame)
+	{
+		if (carry.empty())
+			return true;
+
+		if (carry.size() < protocol::HeaderSize)
+		{
+			_partial = carry;
+			return true;
+		}
+
+		protocol::FrameHeader header = protocol::read_header(carry.data());
+
+		// Only the tail of one frame can be left over, whole frames were delivered before the switch
+		size_t total = protocol::HeaderSize + header.size;
+		if (header.size > protocol::MaxPayloadSize || total < carry.size())
+			return false;
+
+		onFrame(header);
+		_frameLeft = total - carry.size();
+		_frameMoved = true;
+		return write_to_pipe(carry.data(), carry.size());
+	}
+
+	SpliceRelay::Result SpliceRelay::pump(NativeHandle source, NativeHandle destination, const FrameCallback& onFrame)
+	{
+		for (size_t frames = 0; frames < FramesPerPump;)
+		{
+			if (!flush(destination))
+				return Result::WaitWrite;
+
+			if (_frameLeft == 0)
+			{
+				if (!_injected.empty())
+				{
+					if (!write_to_pipe(_injected.data(), _injected.size()))
+						return Result::Closed;
+					_injected.clear();
+					continue;
+				}
+
+				Result stop;
+				if (!start_frame(source, onFrame, stop))
+					return stop;
+
+				frames++;
+				continue;
+			}
+
+			ssize_t moved = ::splice(source, nullptr, _pipeWrite, nullptr, _frameLeft, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (moved == 0)
+				return Result::Closed;
+			if (moved < 0)
+				return would_block(errno) ? Result::WaitRead : Result::Closed;
+
+			_frameLeft -= moved;
+			_piped += moved;
+			_frameMoved = true;
+		}
+
+		return flush(destination) ? Result::WaitRead : Result::WaitWrite;
+	}
+
+	bool SpliceRelay::inject(const uint8_t* data, size_t size)
+	{
+		// Between frames the bytes can go straight into the pipe, mid-frame they wait for its end
+		if (_frameLeft == 0 || !_frameMoved)
+			return write_to_pipe(data, size);
+
+		_injected.insert(_injected.end(), data, data + size);
+		return true;
+	}
+
+	bool SpliceRelay::flush(NativeHandle destination)
+	{
+		while (_piped > 0)
+		{
+			ssize_t moved = ::splice(_pipeRead, nullptr, destination, nullptr, _piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (moved > 0)
+			{
+				_piped -= moved;
+				continue;
+			}
+
+			if (moved < 0 && !would_block(errno))
+			{
+				// The destination is gone and its own session notices, nothing here is owed anymore
+				drop_piped();
+				return true;
+			}
+
+			return false;
+		}
+
+		return true;
+	}
+
+	void SpliceRelay::flush_blocking(NativeHandle destination, int timeoutMs)
+	{
+		// Only left over when the relay stops mid-frame, the destination gets the cut frame either way
+		if (!_injected.empty() && write_to_pipe(_injected.data(), _injected.size()))
+			_injected.clear();
+
+		while (!flush(destination))
+		{
+			pollfd target{ destination, POLLOUT, 0 };
+			if (::poll(&target, 1, timeoutMs) <= 0)
+			{
+				drop_piped();
+				return;
+			}
+		}
+	}
+
+	size_t SpliceRelay::frame_left() const
+	{
+		return _frameMoved ? _frameLeft : 0;
+	}
+
+	std::vector<uint8_t> SpliceRelay::take_partial()
+	{
+		return std::move(_partial);
+	}
+
+	SpliceRelay::~SpliceRelay()
+	{
+		if (_pipeRead != -1)
+			::close(_pipeRead);
+		if (_pipeWrite != -1)
+			::close(_pipeWrite);
+	}
+
+	bool SpliceRelay::start_frame(NativeHandle source, const FrameCallback& onFrame, Result& stop)
+	{
+		uint8_t head[protocol::HeaderSize];
+
+		if (_partial.empty())
+		{
+			ssize_t peeked = ::recv(source, head, protocol::HeaderSize, MSG_PEEK);
+			if (peeked == 0 || (peeked < 0 && !would_block(errno)))
+			{
+				stop = Result::Closed;
+				return false;
+			}
+			if (peeked < 0)
+			{
+				stop = Result::WaitRead;
+				return false;
+			}
+
+			if (peeked == protocol::HeaderSize)
+			{
+				protocol::FrameHeader header = protocol::read_header(head);
+				if (header.size > protocol::MaxPayloadSize)
+				{
+					stop = Result::Corrupt;
+					return false;
+				}
+
+				onFrame(header);
+				_frameLeft = protocol::HeaderSize + header.size;
+				_frameMoved = false;
+				return true;
+			}
+		}
+
+		// A split header keeps the socket readable, so it is taken off the socket to not spin on it
+		ssize_t received = ::recv(source, head, protocol::HeaderSize - _partial.size(), 0);
+		if (received == 0 || (received < 0 && !would_block(errno)))
+		{
+			stop = Result::Closed;
+			return false;
+		}
+		if (received > 0)
+			_partial.insert(_partial.end(), head, head + received);
+
+		if (_partial.size() < protocol::HeaderSize)
+		{
+			stop = Result::WaitRead;
+			return false;
+		}
+
+		protocol::FrameHeader header = protocol::read_header(_partial.data());
+		if (header.size > protocol::MaxPayloadSize)
+		{
+			stop = Result::Corrupt;
+			return false;
+		}
+
+		onFrame(header);
+
+		if (!write_to_pipe(_partial.data(), _partial.size()))
+		{
+			stop = Result::Closed;
+			return false;
+		}
+
+		_partial.clear();
+		_frameLeft = header.size;
+		_frameMoved = true;
+		return true;
+	}
+
+	bool SpliceRelay::write_to_pipe(const uint8_t* data, size_t size)
+	{
+		// At most a header or a frame's worth, far below the pipe's capacity
+		ssize_t written = ::write(_pipeWrite, data, size);
+		if (written != static_cast<ssize_t>(size))
+			return false;
+
+		_piped += size;
+		return true;
+	}
+
+	void SpliceRelay::drop_piped()
+	{
+		uint8_t scratch[protocol::HeaderSize + protocol::MaxPayloadSize];
+		while (_piped > 0)
+		{
+			ssize_t drained = ::read(_pipeRead, scratch, std::min(_piped, sizeof(scratch)));
+			if (drained <= 0)
+				break;
+			_piped -= drained;
+		}
+		_piped = 0;
+	}
+
+#else
+
+	bool SpliceRelay::supported()
+	{
+		return false;
+	}
+
+	bool SpliceRelay::open()
+	{
+		return false;
+	}
+
+	bool SpliceRelay::prime(const std::vector<uint8_t>&, const FrameCallback&)
+	{
+		return false;
+	}
+
+	SpliceRelay::Result SpliceRelay::pump(NativeHandle, NativeHandle, const FrameCallback&)
+	{
+		return Result::Closed;
+	}
+
+	bool SpliceRelay::inject(const uint8_t*, size_t)
+	{
+		return false;
+	}
+
+	bool SpliceRelay::flush(NativeHandle)
+	{
+		return true;
+	}
+
+	void SpliceRelay::flush_blocking(NativeHandle, int)
+	{
+	}
+
+	size_t SpliceRelay::frame_left() const
+	{
+		return 0;
+	}
+
+	std::vector<uint8_t> SpliceRelay::take_partial()
+	{
+		return {};
+	}
+
+	SpliceRelay::~SpliceRelay()
+	{
+	}
+
+	bool SpliceRelay::start_frame(NativeHandle, const FrameCallback&, Result&)
+	{
+		return false;
+	}
+
+	bool SpliceRelay::write_to_pipe(const uint8_t*, size_t)
+	{
+		return false;
+	}
+
+	void SpliceRelay::drop_piped()
+	{
+	}
+
+#endif
+}
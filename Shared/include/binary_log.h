@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace logging
+{
+	enum LogLevel : uint8_t
+	{
+		LL_INFO = 0,
+		LL_ERROR,
+	};
+
+	enum ArgType : uint8_t
+	{
+		AT_SIGNED = 0,
+		AT_UNSIGNED,
+		AT_DOUBLE,
+		AT_STRING,
+	};
+
+	// A format string passed as a template argument: each call site's text is registered once
+	// before main and only its id and the arguments are written at run time. "{}" marks an
+	// argument.
+	template<size_t N>
+	struct FormatString
+	{
+		char text[N];
+
+		constexpr FormatString(const char (&literal)[N])
+		{
+			std::copy_n(literal, N, text);
+		}
+
+		constexpr size_t placeholders() const
+		{
+			size_t count = 0;
+			for (size_t i = 0; i + 1 < N; i++)
+			{
+				if (text[i] == '{' && text[i + 1] == '}')
+					count++;
+			}
+			return count;
+		}
+	};
+
+	// One log call, fixed size so it goes into a ring as a plain copy. Arguments are packed back
+	// to back: numbers as 8 bytes, strings as a length byte and as much of the text as still fits.
+	struct LogRecord
+	{
+		static constexpr size_t PayloadSize = 48;
+		static constexpr size_t MaxArgs = 8;
+
+		int64_t time;    // system_clock ticks
+		uint16_t format;
+		uint8_t argCount;
+		uint8_t size;    // payload bytes used
+		uint32_t types;  // an ArgType per argument, 4 bits each
+		uint8_t payload[PayloadSize];
+	};
+
+	static_assert(sizeof(LogRecord) == 64, "LogRecord should fill one cache line");
+
+	uint16_t register_format(LogLevel level, std::string_view text);
+
+	// Copies the record into the calling thread's ring, or drops it when the ring is full. Never
+	// blocks and never allocates after the thread's first record.
+	void submit(const LogRecord& record);
+
+	// Records go to stdout and errors to stderr until a file is opened, then all to the file
+	bool open_file(const std::string& path);
+
+	// Returns once everything logged before the call has been written
+	void flush();
+
+	namespace detail
+	{
+		inline void put_type(LogRecord& record, ArgType type)
+		{
+			record.types |= static_cast<uint32_t>(type) << (4 * record.argCount);
+			record.argCount++;
+		}
+
+		inline void put_bytes(LogRecord& record, const void* data, size_t size)
+		{
+			std::memcpy(record.payload + record.size, data, size);
+			record.size = static_cast<uint8_t>(record.size + size);
+		}
+
+		inline void pack_string(LogRecord& record, std::string_view text)
+		{
+			size_t room = LogRecord::PayloadSize - record.size;
+			uint8_t length = static_cast<uint8_t>(std::min(text.size(), room > 0 ? room - 1 : 0));
+
+			put_type(record, AT_STRING);
+			if (room == 0)
+				return;
+
+			put_bytes(record, &length, 1);
+			put_bytes(record, text.data(), length);
+		}
+
+		template<typename T>
+		inline void pack(LogRecord& record, const T& value)
+		{
+			if constexpr (std::is_convertible_v<const T&, std::string_view>)
+			{
+				pack_string(record, std::string_view(value));
+				return;
+			}
+			else
+			{
+				// A number that no longer fits is shown as 0 rather than read past the payload
+				if (LogRecord::PayloadSize - record.size < 8)
+				{
+					put_type(record, AT_UNSIGNED);
+					return;
+				}
+
+				if constexpr (std::is_floating_point_v<T>)
+				{
+					double number = value;
+					put_type(record, AT_DOUBLE);
+					put_bytes(record, &number, 8);
+				}
+				else if constexpr (std::is_enum_v<T>)
+				{
+					pack(record, static_cast<std::underlying_type_t<T>>(value));
+				}
+				else if constexpr (std::is_signed_v<T>)
+				{
+					int64_t number = value;
+					put_type(record, AT_SIGNED);
+					put_bytes(record, &number, 8);
+				}
+				else
+				{
+					static_assert(std::is_integral_v<T>, "Log arguments are numbers, enums or strings");
+					uint64_t number = value;
+					put_type(record, AT_UNSIGNED);
+					put_bytes(record, &number, 8);
+				}
+			}
+		}
+
+		template<FormatString Format, LogLevel Level>
+		inline const uint16_t formatId = register_format(Level, Format.text);
+
+		template<FormatString Format, LogLevel Level, typename... Args>
+		inline void write(const Args&... args)
+		{
+			static_assert(Format.placeholders() == sizeof...(Args), "Log call needs one argument per {}");
+			static_assert(sizeof...(Args) <= LogRecord::MaxArgs, "Log calls take at most 8 arguments");
+
+			LogRecord record;
+			record.time = std::chrono::system_clock::now().time_since_epoch().count();
+			record.format = formatId<Format, Level>;
+			record.argCount = 0;
+			record.size = 0;
+			record.types = 0;
+
+			(pack(record, args), ...);
+			submit(record);
+		}
+	}
+
+	template<FormatString Format, typename... Args>
+	inline void info(const Args&... args)
+	{
+		detail::write<Format, LL_INFO>(args...);
+	}
+
+	template<FormatString Format, typename... Args>
+	inline void error(const Args&... args)
+	{
+		detail::write<Format, LL_ERROR>(args...);
+	}
+}
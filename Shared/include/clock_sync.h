@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+#include "game_clock.h"
+
+namespace chess
+{
+	// Estimates the server's clock from MSG_TIME_SYNC round trips, the way NTP does: a probe
+	// leaves at client time t0, the server stamps it with its time ts and the answer is back
+	// at t3. With equal delays both ways the server read its clock halfway, so
+	// offset = ts - (t0 + t3) / 2. Queueing only ever makes a round trip longer, so of the
+	// last Window samples the one with the shortest round trip is trusted.
+	class ClockSync
+	{
+	public:
+		static constexpr size_t Window = 8;
+
+		// Milliseconds on a GameClock as they go on the wire, wrapping every 49 days. Only
+		// differences are ever taken, so the wrap does no harm.
+		static uint32_t millis(GameClock::time_point time)
+		{
+			return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count());
+		}
+
+		// Same for the microsecond stamps of a MoveTrace, wrapping every 71 minutes
+		static uint32_t micros(GameClock::time_point time)
+		{
+			return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count());
+		}
+
+		void add_sample(uint32_t clientSent, uint32_t serverTime, uint32_t clientReceived)
+		{
+			int32_t roundTrip = static_cast<int32_t>(clientReceived - clientSent);
+			if (roundTrip < 0)
+				return;
+
+			samples[next % Window] = { static_cast<int32_t>(serverTime - clientSent) - roundTrip / 2, static_cast<uint32_t>(roundTrip) };
+			next++;
+
+			best = samples[0];
+			for (size_t i = 1; i < std::min(next, Window); i++)
+			{
+				if (samples[i].roundTrip < best.roundTrip)
+					best = samples[i];
+			}
+		}
+
+		bool synced() const
+		{
+			return next > 0;
+		}
+
+		// Server clock minus this side's clock
+		int32_t offset_ms() const
+		{
+			return best.offset;
+		}
+
+		uint32_t round_trip_ms() const
+		{
+			return best.roundTrip;
+		}
+
+		// When a server timestamp happened on this side's GameClock
+		GameClock::time_point to_local(uint32_t serverTime) const
+		{
+			GameClock::time_point now = GameClock::now();
+			int32_t ago = static_cast<int32_t>(millis(now) - (serverTime - static_cast<uint32_t>(best.offset)));
+			return now - std::chrono::milliseconds(ago);
+		}
+
+	private:
+		struct Sample
+		{
+			int32_t offset = 0;
+			uint32_t roundTrip = std::numeric_limits<uint32_t>::max();
+		};
+
+		std::array<Sample, Window> samples;
+		Sample best;
+		size_t next = 0;
+	};
+}
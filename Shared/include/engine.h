@@ -1,9 +1,13 @@
 #pragma once
 
 #include <array>
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <optional>
+#include <vector>
+
+#include "game_clock.h"
 
 
 namespace chess
@@ -29,7 +33,7 @@ namespace chess
 	struct TimeOut
 	{
 		int position;
-		std::chrono::steady_clock::time_point expiry;
+		GameClock::time_point expiry;
 	};
 
 	struct BoardData
@@ -139,11 +143,12 @@ namespace chess
 
 		ChessEngine(Player player, unsigned int timeoutPerMoveInMilliseconds);
 
-		ChessEngine(const ChessEngine&) = delete;
-		ChessEngine& operator=(const ChessEngine&) = delete;
+		// The walls of boardSetup point into chessBorders, so a copied or moved engine rebinds them to its own
+		ChessEngine(const ChessEngine& other);
+		ChessEngine& operator=(const ChessEngine& other);
 
-		ChessEngine(ChessEngine&&) noexcept = default;           
-		ChessEngine& operator=(ChessEngine&&) noexcept = default;
+		ChessEngine(ChessEngine&& other) noexcept;
+		ChessEngine& operator=(ChessEngine&& other) noexcept;
 
 		void opponent_move(int from, int to);
 
@@ -155,6 +160,14 @@ namespace chess
 
 		void check_timeouts();
 
+		// For callers that expire cooldowns themselves instead of calling check_timeouts
+		size_t timeout_count() const;
+		int timeout_position(size_t index) const;
+		void expire_timeout(int position);
+
+		// When the piece at `position` comes off cooldown, nullopt if it is not cooling down
+		std::optional<GameClock::time_point> cooldown_expiry(int position) const;
+
 		Pieces piece_at(int index) const;
 
 		int piece_count() const;
@@ -173,6 +186,16 @@ namespace chess
 		
 		void build_wall_opponent(int place, int direction);
 
+		// Copies pieces and walls from an engine playing the other side
+		void mirror_board_from(const ChessEngine& other);
+
+		// Replaces the position with one seen from white's side, as a MSG_SNAPSHOT carries it.
+		// Cooldowns, en passant chances and a pending promotion are dropped.
+		void load_board(const std::array<Pieces, 64>& pieces, uint64_t wallsBelow, uint64_t wallsRight);
+
+		// Puts a piece into cooldown for what is left of it rather than the full timeout
+		void start_cooldown(int position, GameClock::duration remaining);
+
 		bool piece_exists(int index) const;
 
 		int get_under_position_of(int square);
@@ -198,7 +221,7 @@ namespace chess
 			int whenImplemented;
 		};
 
-		Player player;
+		Player player = PL_WHITE;
 
 		unsigned int timeoutPerMoveMs = 3000; 
 
@@ -212,7 +235,7 @@ namespace chess
 
 		std::vector<TimeOut> timeOutPositions;
 
-		int piecesLeft;
+		int piecesLeft = 12;
 
 		size_t gameMovesCount = 0;
 
@@ -231,6 +254,9 @@ namespace chess
 
 		bool is_other_player_piece(int index) const;
 
+		// move_piece without its tracepoints
+		MoveState dispatch_move(int from, int to);
+
 		MoveState handle_pawn_move(int from, int to);
 		MoveState handle_rook_move(int from, int to);
 		MoveState handle_knight_move(int from, int to);
@@ -254,6 +280,8 @@ namespace chess
 
 		void move_piece_no_check(int from, int to);
 
+		void bind_walls();
+
 		void add_timeout(int position);
 
 	};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+namespace chess
+{
+	// The clock behind cooldowns, heartbeats and the server's ticks. It follows steady_clock
+	// until a simulation switches it to virtual time, which only moves when advance() is called,
+	// so a run replays the same way every time however fast the machine is.
+	struct GameClock
+	{
+		using duration = std::chrono::steady_clock::duration;
+		using rep = duration::rep;
+		using period = duration::period;
+		using time_point = std::chrono::time_point<GameClock>;
+
+		static constexpr bool is_steady = true;
+
+		static time_point now() noexcept
+		{
+			if (virtualTime.load(std::memory_order_relaxed))
+				return time_point(duration(virtualNow.load(std::memory_order_acquire)));
+
+			return time_point(std::chrono::steady_clock::now().time_since_epoch());
+		}
+
+		// Virtual time starts where the real clock is, so time points taken before stay comparable
+		static void use_virtual_time(bool enabled)
+		{
+			virtualNow.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_release);
+			virtualTime.store(enabled, std::memory_order_relaxed);
+		}
+
+		static bool is_virtual()
+		{
+			return virtualTime.load(std::memory_order_relaxed);
+		}
+
+		static void advance(duration step)
+		{
+			virtualNow.fetch_add(step.count(), std::memory_order_acq_rel);
+		}
+
+	private:
+		inline static std::atomic<bool> virtualTime = false;
+		inline static std::atomic<rep> virtualNow = 0;
+	};
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+namespace metrics
+{
+	// Log-linear histogram in the style of HdrHistogram: values below 2^SubBucketBits are
+	// counted exactly, above that every power of two is split into 2^(SubBucketBits - 1) equal
+	// steps, so a value is never reported more than 1/32 too high. Fixed size and never
+	// allocates, recording is a bit scan and an add. Not thread safe, one writer per histogram.
+	class HdrHistogram
+	{
+	public:
+		static constexpr int SubBucketBits = 6;
+		static constexpr int MaxValueBits = 32; // larger values are clamped into the top bucket
+
+		void record(uint64_t value)
+		{
+			counts[index_of(value)]++;
+			total++;
+			summed += value;
+			largest = std::max(largest, value);
+		}
+
+		void merge(const HdrHistogram& other)
+		{
+			for (size_t i = 0; i < BucketCount; i++)
+				counts[i] += other.counts[i];
+
+			total += other.total;
+			summed += other.summed;
+			largest = std::max(largest, other.largest);
+		}
+
+		void reset()
+		{
+			*this = HdrHistogram();
+		}
+
+		uint64_t count() const
+		{
+			return total;
+		}
+
+		uint64_t max() const
+		{
+			return largest;
+		}
+
+		uint64_t sum() const
+		{
+			return summed;
+		}
+
+		double mean() const
+		{
+			return total > 0 ? static_cast<double>(summed) / total : 0;
+		}
+
+		// Highest value of the bucket holding the given percentile, 0 when empty
+		uint64_t percentile(double percent) const
+		{
+			if (total == 0)
+				return 0;
+
+			uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percent / 100.0 * total)));
+			uint64_t seen = 0;
+			for (size_t i = 0; i < BucketCount; i++)
+			{
+				seen += counts[i];
+				if (seen >= rank)
+					return std::min(highest_of(i), largest);
+			}
+			return largest;
+		}
+
+		// Non-empty buckets in ascending order as (highest value, count)
+		template<typename Visit>
+		void for_each_bucket(Visit&& visit) const
+		{
+			for (size_t i = 0; i < BucketCount; i++)
+			{
+				if (counts[i] > 0)
+					visit(highest_of(i), counts[i]);
+			}
+		}
+
+		// One line: the name, the count and the usual percentiles
+		void print(std::ostream& out, std::string_view name) const
+		{
+			out << name << ": n " << total << ", mean " << static_cast<uint64_t>(mean()) << ", p50 " << percentile(50) << ", p90 " << percentile(90)
+				<< ", p99 " << percentile(99) << ", p99.9 " << percentile(99.9) << ", max " << largest << std::endl;
+		}
+
+	private:
+		friend class AtomicHdrHistogram;
+
+		static constexpr size_t SubBucketCount = size_t(1) << SubBucketBits;
+		static constexpr size_t HalfCount = SubBucketCount / 2;
+		static constexpr size_t BucketCount = SubBucketCount + (MaxValueBits - SubBucketBits) * HalfCount;
+
+		static size_t index_of(uint64_t value)
+		{
+			if (value < SubBucketCount)
+				return static_cast<size_t>(value);
+
+			value = std::min(value, (uint64_t(1) << MaxValueBits) - 1);
+
+			// The top SubBucketBits bits of the value pick the step within its power of two
+			int magnitude = 63 - std::countl_zero(value);
+			int shift = magnitude - SubBucketBits + 1;
+			size_t step = static_cast<size_t>(value >> shift) - HalfCount;
+
+			return SubBucketCount + static_cast<size_t>(magnitude - SubBucketBits) * HalfCount + step;
+		}
+
+		static uint64_t highest_of(size_t index)
+		{
+			if (index < SubBucketCount)
+				return index;
+
+			size_t level = (index - SubBucketCount) / HalfCount;
+			uint64_t step = (index - SubBucketCount) % HalfCount + HalfCount;
+			int shift = static_cast<int>(level) + 1;
+
+			return ((step + 1) << shift) - 1;
+		}
+
+		std::array<uint64_t, BucketCount> counts{};
+		uint64_t total = 0;
+		uint64_t summed = 0;
+		uint64_t largest = 0;
+	};
+
+	// HdrHistogram one thread records into while any other reads it. The buckets are atomics the
+	// writer bumps with a relaxed load and store, no lock and no read-modify-write, so with more
+	// than one writer counts get lost. A reader may catch a record half done, e.g. counted in its
+	// bucket but not yet in the total.
+	class AtomicHdrHistogram
+	{
+	public:
+		void record(uint64_t value)
+		{
+			bump(counts[HdrHistogram::index_of(value)], 1);
+			bump(total, 1);
+			bump(sum, value);
+
+			if (value > largest.load(std::memory_order_relaxed))
+				largest.store(value, std::memory_order_relaxed);
+		}
+
+		// Adds everything recorded so far to `out`
+		void merge_into(HdrHistogram& out) const
+		{
+			for (size_t i = 0; i < HdrHistogram::BucketCount; i++)
+				out.counts[i] += counts[i].load(std::memory_order_relaxed);
+
+			out.total += total.load(std::memory_order_relaxed);
+			out.summed += sum.load(std::memory_order_relaxed);
+			out.largest = std::max(out.largest, largest.load(std::memory_order_relaxed));
+		}
+
+	private:
+		static void bump(std::atomic<uint64_t>& value, uint64_t amount)
+		{
+			value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		}
+
+		std::array<std::atomic<uint64_t>, HdrHistogram::BucketCount> counts{};
+		std::atomic<uint64_t> total = 0;
+		std::atomic<uint64_t> sum = 0;
+		std::atomic<uint64_t> largest = 0;
+	};
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "spsc_ring.h"
+
+namespace transport
+{
+	// An in-memory connection between one client and the server, for simulations that run both
+	// in one process. Each direction is a byte stream like a socket's, so frames are split and
+	// reassembled by the same readers, but it never touches the kernel.
+	struct LoopbackLink
+	{
+		static constexpr size_t Capacity = 4096;
+
+		SpscRing<uint8_t, Capacity> toServer;
+		SpscRing<uint8_t, Capacity> toClient;
+
+		// Either side hanging up; the other notices on its next poll
+		std::atomic<bool> clientClosed = false;
+		std::atomic<bool> serverClosed = false;
+
+		LoopbackLink() = default;
+
+		LoopbackLink(const LoopbackLink&) = delete;
+		LoopbackLink& operator=(const LoopbackLink&) = delete;
+	};
+}
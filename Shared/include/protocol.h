@@ -0,0 +1,421 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Wire format shared by client and server. Every message is a frame: a 10 byte header in
+// network byte order followed by `size` payload bytes. Board squares on the wire are always
+// in white's orientation (0 = top-left as seen by white), each side converts to its own.
+// A client is matched with an opponent once it sends its first frame, usually a heartbeat,
+// unless that frame is a MSG_SPECTATE or MSG_RESUME.
+
+namespace protocol
+{
+	enum MessageType : uint8_t
+	{
+		MSG_NONE = 0,
+		MSG_START,          // server -> client, StartMessage
+		MSG_MOVE,           // client -> server request, server -> client accepted event
+		MSG_WALL,           // client -> server request, server -> client accepted event
+		MSG_PROMOTE,        // client -> server request, server -> client accepted event
+		MSG_EN_PASSANT,     // server -> client, EnPassantMessage
+		MSG_REJECT,         // server -> client, the request was refused
+		MSG_GAME_OVER,      // server -> client, GameOverMessage
+		MSG_OPPONENT_LEFT,  // server -> client, no payload
+		MSG_HEARTBEAT,      // client -> server, no payload
+		MSG_ROOM_CLOSED,    // server -> client, no payload, the room sat idle too long
+		MSG_CLOSE_CHANNEL,  // both ways, no payload, the frame's channel is done
+		MSG_SPECTATE,       // client -> server, SpectateMessage, answered with a snapshot or a reject
+		MSG_SNAPSHOT,       // server -> client, SnapshotMessage, replaces whatever board it had
+		MSG_RESUME,         // client -> server, ResumeMessage, answered with MSG_START and MSG_SNAPSHOT or a reject
+		MSG_TIME_SYNC,      // both ways, TimeSyncMessage, the server sends it back with its clock filled in
+	};
+
+	struct FrameHeader
+	{
+		uint16_t size = 0;      // payload bytes after the header
+		uint8_t type = MSG_NONE;
+		uint8_t flags = 0;
+		uint32_t sequence = 0;  // room event sequence on accepted events, 0 otherwise
+
+		// Lets one connection carry many players. Channel 0 is the connection's own player,
+		// every other channel is opened by the client's first frame on it.
+		uint16_t channel = 0;
+	};
+
+	// FrameHeader::flags
+	enum FrameFlag : uint8_t
+	{
+		FLAG_RELAY = 1 << 0,    // on MSG_START: the room relays without validating, clients announce en passant and game over themselves
+		FLAG_RESUMED = 1 << 1,  // on MSG_START: back in a game after a reconnect, a MSG_SNAPSHOT with the board follows
+	};
+
+	constexpr size_t HeaderSize = 10;
+	constexpr size_t MaxPayloadSize = 512;
+
+	// Per-piece cooldown, the server validates with the same value the clients play with
+	constexpr unsigned int MoveCooldownMs = 2000;
+
+	// A client that sends nothing for HeartbeatTimeoutMs is dropped
+	constexpr unsigned int HeartbeatIntervalMs = 5000;
+	constexpr unsigned int HeartbeatTimeoutMs = 15000;
+
+	// How long a dropped player's seat is kept for a MSG_RESUME before the opponent wins
+	constexpr unsigned int ResumeGraceMs = 20000;
+
+	constexpr size_t MaxSnapshotCooldowns = 16;
+	constexpr unsigned int SnapshotCooldownUnitMs = 10;
+
+	inline bool on_board(uint8_t square)
+	{
+		return square < 64;
+	}
+
+	// Wire squares are white's orientation and black's engine sees the board rotated, the
+	// rotation is its own inverse so this converts both ways
+	inline int orient(int square, bool white)
+	{
+		return white ? square : 63 - square;
+	}
+
+#pragma pack(push, 1)
+
+	struct StartMessage
+	{
+		uint8_t player;
+		uint32_t room;  // network byte order, what spectators send in a SpectateMessage to watch this game
+		uint64_t token; // network byte order, gets this player back into the game with a ResumeMessage
+	};
+
+	// Where the time of one move went, microseconds in network byte order. The mover fills in
+	// the first three fields, the server stamps the last two and forwards the trace with the
+	// event. `sentAt` is on the server's clock, shifted there with the mover's ClockSync offset,
+	// and 0 while the mover is not synced. Relay rooms forward it unstamped.
+	struct MoveTrace
+	{
+		uint16_t moveId;        // counts the mover's move requests, wrapping
+		uint32_t inputToSend;   // from the click to the request leaving the mover
+		uint32_t sentAt;
+		uint32_t serverReceived;
+		uint32_t serverForwarded;
+	};
+
+	// `player` and `acceptedAt` are filled in by the server on events and ignored on requests, so
+	// requests leave them to their defaults.
+	// `acceptedAt` is the server's clock in milliseconds when the cooldown started, network
+	// byte order, and 0 from relay rooms.
+	struct MoveMessage
+	{
+		uint8_t player;
+		uint8_t from;
+		uint8_t to;
+		uint32_t acceptedAt = 0;
+		MoveTrace trace = {};
+	};
+
+	struct WallMessage
+	{
+		uint8_t player;
+		uint8_t place;
+		uint8_t direction;
+		uint32_t acceptedAt = 0;
+	};
+
+	struct PromoteMessage
+	{
+		uint8_t player;
+		uint8_t from;
+		uint8_t to;
+		uint8_t piece;
+		uint32_t acceptedAt = 0;
+	};
+
+	struct EnPassantMessage
+	{
+		uint8_t player;
+		uint8_t underPosition;
+		uint16_t whenImplemented; // network byte order
+	};
+
+	struct RejectMessage
+	{
+		uint8_t requestType;
+		uint8_t from;
+		uint8_t to;
+	};
+
+	struct GameOverMessage
+	{
+		uint8_t winner;
+	};
+
+	struct SpectateMessage
+	{
+		uint32_t room; // network byte order, from the players' StartMessage
+	};
+
+	// Whole board of a room in white's orientation: a chess::Pieces nibble per square, low
+	// nibble first, the 112 inner walls as bits, the 56 below squares 0-55 and then the 56
+	// right of each row's first seven squares, and the squares still cooling down with the
+	// SnapshotCooldownUnitMs left on each. The header sequence is the room's last event.
+	struct SnapshotMessage
+	{
+		uint8_t pieces[32];
+		uint8_t walls[14];
+		uint8_t cooldownCount;
+		uint8_t cooldowns[MaxSnapshotCooldowns][2]; // square, units left
+	};
+
+	// Milliseconds, network byte order. The client sends its own clock and the server adds its own.
+	struct TimeSyncMessage
+	{
+		uint32_t clientTime;
+		uint32_t serverTime;
+	};
+
+	struct ResumeMessage
+	{
+		uint64_t token; // network byte order, from the StartMessage of the game to get back into
+	};
+
+#pragma pack(pop)
+
+	inline uint16_t to_wire16(uint16_t value)
+	{
+		uint8_t bytes[2] = { static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value) };
+		uint16_t wire;
+		std::memcpy(&wire, bytes, sizeof(wire));
+		return wire;
+	}
+
+	inline uint16_t from_wire16(uint16_t wire)
+	{
+		uint8_t bytes[2];
+		std::memcpy(bytes, &wire, sizeof(wire));
+		return static_cast<uint16_t>((bytes[0] << 8) | bytes[1]);
+	}
+
+	inline uint32_t to_wire32(uint32_t value)
+	{
+		uint8_t bytes[4] = { static_cast<uint8_t>(value >> 24), static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value) };
+		uint32_t wire;
+		std::memcpy(&wire, bytes, sizeof(wire));
+		return wire;
+	}
+
+	inline uint32_t from_wire32(uint32_t wire)
+	{
+		uint8_t bytes[4];
+		std::memcpy(bytes, &wire, sizeof(wire));
+		return (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) | (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+	}
+
+	inline uint64_t to_wire64(uint64_t value)
+	{
+		uint32_t halves[2] = { to_wire32(static_cast<uint32_t>(value >> 32)), to_wire32(static_cast<uint32_t>(value)) };
+		uint64_t wire;
+		std::memcpy(&wire, halves, sizeof(wire));
+		return wire;
+	}
+
+	inline uint64_t from_wire64(uint64_t wire)
+	{
+		uint32_t halves[2];
+		std::memcpy(halves, &wire, sizeof(wire));
+		return (static_cast<uint64_t>(from_wire32(halves[0])) << 32) | from_wire32(halves[1]);
+	}
+
+	inline void set_snapshot_piece(SnapshotMessage& snapshot, int square, uint8_t piece)
+	{
+		snapshot.pieces[square / 2] |= static_cast<uint8_t>((piece & 0x0F) << (square % 2 * 4));
+	}
+
+	inline uint8_t snapshot_piece(const SnapshotMessage& snapshot, int square)
+	{
+		return (snapshot.pieces[square / 2] >> (square % 2 * 4)) & 0x0F;
+	}
+
+	// Walls as bitboards, bit i for a wall below or to the right of square i
+	inline void set_snapshot_walls(SnapshotMessage& snapshot, uint64_t below, uint64_t right)
+	{
+		for (int square = 0; square < 56; square++)
+		{
+			if (below >> square & 1)
+				snapshot.walls[square / 8] |= static_cast<uint8_t>(1 << square % 8);
+		}
+
+		for (int row = 0; row < 8; row++)
+		{
+			for (int column = 0; column < 7; column++)
+			{
+				int bit = 56 + row * 7 + column;
+				if (right >> (row * 8 + column) & 1)
+					snapshot.walls[bit / 8] |= static_cast<uint8_t>(1 << bit % 8);
+			}
+		}
+	}
+
+	inline void snapshot_walls(const SnapshotMessage& snapshot, uint64_t& below, uint64_t& right)
+	{
+		below = 0;
+		right = 0;
+
+		for (int square = 0; square < 56; square++)
+			below |= uint64_t(snapshot.walls[square / 8] >> square % 8 & 1) << square;
+
+		for (int row = 0; row < 8; row++)
+		{
+			for (int column = 0; column < 7; column++)
+			{
+				int bit = 56 + row * 7 + column;
+				right |= uint64_t(snapshot.walls[bit / 8] >> bit % 8 & 1) << (row * 8 + column);
+			}
+		}
+	}
+
+	inline void write_header(uint8_t* out, const FrameHeader& header)
+	{
+		out[0] = static_cast<uint8_t>(header.size >> 8);
+		out[1] = static_cast<uint8_t>(header.size);
+		out[2] = header.type;
+		out[3] = header.flags;
+		out[4] = static_cast<uint8_t>(header.sequence >> 24);
+		out[5] = static_cast<uint8_t>(header.sequence >> 16);
+		out[6] = static_cast<uint8_t>(header.sequence >> 8);
+		out[7] = static_cast<uint8_t>(header.sequence);
+		out[8] = static_cast<uint8_t>(header.channel >> 8);
+		out[9] = static_cast<uint8_t>(header.channel);
+	}
+
+	inline FrameHeader read_header(const uint8_t* in)
+	{
+		FrameHeader header;
+		header.size = static_cast<uint16_t>((in[0] << 8) | in[1]);
+		header.type = in[2];
+		header.flags = in[3];
+		header.sequence = (static_cast<uint32_t>(in[4]) << 24) | (static_cast<uint32_t>(in[5]) << 16) | (static_cast<uint32_t>(in[6]) << 8) | in[7];
+		header.channel = static_cast<uint16_t>((in[8] << 8) | in[9]);
+		return header;
+	}
+
+	// Moves whole frames, e.g. several events encoded back to back, onto a channel
+	inline void set_channel(uint8_t* frames, size_t size, uint16_t channel)
+	{
+		for (size_t offset = 0; offset + HeaderSize <= size;)
+		{
+			frames[offset + 8] = static_cast<uint8_t>(channel >> 8);
+			frames[offset + 9] = static_cast<uint8_t>(channel);
+			offset += HeaderSize + read_header(frames + offset).size;
+		}
+	}
+
+	template<typename T>
+	std::vector<uint8_t> encode_frame(MessageType type, const T& payload, uint32_t sequence = 0, uint8_t flags = 0)
+	{
+		static_assert(std::is_trivially_copyable_v<T> && sizeof(T) <= MaxPayloadSize);
+
+		std::vector<uint8_t> frame(HeaderSize + sizeof(T));
+		write_header(frame.data(), { static_cast<uint16_t>(sizeof(T)), type, flags, sequence });
+		std::memcpy(frame.data() + HeaderSize, &payload, sizeof(T));
+		return frame;
+	}
+
+	inline std::vector<uint8_t> encode_frame(MessageType type, uint32_t sequence = 0)
+	{
+		std::vector<uint8_t> frame(HeaderSize);
+		write_header(frame.data(), { 0, type, 0, sequence });
+		return frame;
+	}
+
+	inline FrameHeader frame_header(const std::vector<uint8_t>& frame)
+	{
+		if (frame.size() < HeaderSize)
+			return {};
+		return read_header(frame.data());
+	}
+
+	template<typename T>
+	bool decode_payload(const std::vector<uint8_t>& frame, T& out)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+
+		if (frame.size() < HeaderSize + sizeof(T))
+			return false;
+
+		std::memcpy(&out, frame.data() + HeaderSize, sizeof(T));
+		return true;
+	}
+
+	// Reassembles frames from a byte stream that may split or coalesce them
+	class FrameReader
+	{
+	public:
+		// Returns false once the stream announced an impossible frame
+		bool append(const uint8_t* data, size_t size)
+		{
+			if (_offset > 0 && _offset == _buffer.size())
+			{
+				_buffer.clear();
+				_offset = 0;
+			}
+
+			_buffer.insert(_buffer.end(), data, data + size);
+			return !_corrupt;
+		}
+
+		bool next(std::vector<uint8_t>& frame)
+		{
+			size_t available = _buffer.size() - _offset;
+			if (_corrupt || available < HeaderSize)
+				return false;
+
+			FrameHeader header = read_header(_buffer.data() + _offset);
+			if (header.size > MaxPayloadSize)
+			{
+				_corrupt = true;
+				return false;
+			}
+
+			size_t total = HeaderSize + header.size;
+			if (available < total)
+			{
+				compact();
+				return false;
+			}
+
+			frame.assign(_buffer.begin() + _offset, _buffer.begin() + _offset + total);
+			_offset += total;
+			return true;
+		}
+
+		bool corrupt() const
+		{
+			return _corrupt;
+		}
+
+		// Hands over bytes of a frame that has not fully arrived, e.g. when the stream moves elsewhere
+		std::vector<uint8_t> take_pending()
+		{
+			std::vector<uint8_t> pending(_buffer.begin() + _offset, _buffer.end());
+			_buffer.clear();
+			_offset = 0;
+			return pending;
+		}
+
+	private:
+		std::vector<uint8_t> _buffer;
+		size_t _offset = 0;
+		bool _corrupt = false;
+
+		void compact()
+		{
+			if (_offset == 0)
+				return;
+
+			_buffer.erase(_buffer.begin(), _buffer.begin() + _offset);
+			_offset = 0;
+		}
+	};
+}
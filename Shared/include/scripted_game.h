@@ -0,0 +1,12 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <utility>
+
+namespace chess
+{
+	// White opens the e-file and takes the king with the queen: e4, Qh5, Qxf7, Qxe8. Squares are
+	// from white's side, the same as on the wire. Used by bots that need games to end quickly.
+	constexpr std::array<std::pair<uint8_t, uint8_t>, 4> WhiteScript = { { { 52, 36 }, { 59, 31 }, { 31, 13 }, { 13, 4 } } };
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+namespace transport
+{
+	// Single-producer / single-consumer ring. Both push and pop are wait-free:
+	// each side only ever stores its own index and loads the other's.
+	template<typename T, size_t Capacity>
+	class SpscRing
+	{
+		static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "SpscRing capacity must be a power of two");
+		static_assert(std::is_trivially_copyable_v<T>, "SpscRing only carries trivially copyable values");
+
+	public:
+		SpscRing() = default;
+
+		SpscRing(const SpscRing&) = delete;
+		SpscRing& operator=(const SpscRing&) = delete;
+
+		// Producer side
+		bool try_push(const T& value)
+		{
+			const size_t head = _head.load(std::memory_order_relaxed);
+
+			if (head - _cachedTail == Capacity)
+			{
+				_cachedTail = _tail.load(std::memory_order_acquire);
+				if (head - _cachedTail == Capacity)
+					return false;
+			}
+
+			_slots[head & (Capacity - 1)] = value;
+			_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer side
+		bool try_pop(T& out)
+		{
+			const size_t tail = _tail.load(std::memory_order_relaxed);
+
+			if (tail == _cachedHead)
+			{
+				_cachedHead = _head.load(std::memory_order_acquire);
+				if (tail == _cachedHead)
+					return false;
+			}
+
+			out = _slots[tail & (Capacity - 1)];
+			_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Producer side, all or nothing so a frame never lands half in the ring
+		bool try_push_all(const T* values, size_t count)
+		{
+			const size_t head = _head.load(std::memory_order_relaxed);
+
+			if (Capacity - (head - _cachedTail) < count)
+			{
+				_cachedTail = _tail.load(std::memory_order_acquire);
+				if (Capacity - (head - _cachedTail) < count)
+					return false;
+			}
+
+			for (size_t i = 0; i < count; i++)
+				_slots[(head + i) & (Capacity - 1)] = values[i];
+
+			_head.store(head + count, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer side, takes up to `count` values and publishes the new tail once
+		size_t pop_some(T* out, size_t count)
+		{
+			const size_t tail = _tail.load(std::memory_order_relaxed);
+			_cachedHead = _head.load(std::memory_order_acquire);
+
+			size_t taken = std::min(count, _cachedHead - tail);
+			for (size_t i = 0; i < taken; i++)
+				out[i] = _slots[(tail + i) & (Capacity - 1)];
+
+			_tail.store(tail + taken, std::memory_order_release);
+			return taken;
+		}
+
+		// Consumer side, hands every queued value to func and publishes the new tail once.
+		template<typename Func>
+		size_t drain(Func&& func)
+		{
+			const size_t tail = _tail.load(std::memory_order_relaxed);
+			const size_t head = _head.load(std::memory_order_acquire);
+
+			for (size_t i = tail; i != head; i++)
+				func(_slots[i & (Capacity - 1)]);
+
+			_tail.store(head, std::memory_order_release);
+			_cachedHead = head;
+			return head - tail;
+		}
+
+		bool empty() const
+		{
+			return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+		}
+
+		static constexpr size_t capacity()
+		{
+			return Capacity;
+		}
+
+	private:
+		static constexpr size_t CacheLine = 64;
+
+		// Producer owned
+		alignas(CacheLine) std::atomic<size_t> _head = 0;
+		size_t _cachedTail = 0;
+
+		// Consumer owned
+		alignas(CacheLine) std::atomic<size_t> _tail = 0;
+		size_t _cachedHead = 0;
+
+		alignas(CacheLine) std::array<T, Capacity> _slots{};
+	};
+}
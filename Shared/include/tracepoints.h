@@ -0,0 +1,38 @@
+#pragma once
+
+// Static tracepoints for perf and bpftrace on Linux, compiled in with premake's --usdt option
+// (needs sys/sdt.h, e.g. from systemtap-sdt-dev). A compiled in tracepoint is a single nop
+// until a tracer attaches to the running process, so release builds can keep them; without the
+// option FC_TRACE expands to nothing and its arguments are not evaluated. Arguments are plain
+// integers, ids and enums.
+//
+//   bpftrace -p <pid> -e 'usdt:./bin/.../Server:fortchess:frame_received { @types[arg1] = count(); }'
+//   perf probe -x ./bin/.../Server sdt_fortchess:room_create && perf record -e sdt_fortchess:room_create -p <pid>
+//
+// Points, arguments in order:
+//   session_accept   client, connection (0 unless a channel)
+//   session_close    client
+//   frame_received   client, frame type, frame size
+//   frame_relayed    client, frame type, peer
+//   frame_validated  client, frame type, room's verdict, room
+//   room_create      shard, room, white, black
+//   room_destroy     shard, room
+//   move_piece_entry engine, from, to
+//   move_piece_exit  engine, from, to, MoveState
+
+#if defined(FORTCHESS_USDT) && defined(__linux__)
+
+// Asked for explicitly, so a missing header fails the build rather than silently tracing nothing
+#if !__has_include(<sys/sdt.h>)
+#error "FORTCHESS_USDT needs <sys/sdt.h>, install systemtap-sdt-dev or build without --usdt"
+#endif
+
+#include <sys/sdt.h>
+
+#define FC_TRACE(name, ...) STAP_PROBEV(fortchess, name, __VA_ARGS__)
+
+#else
+
+#define FC_TRACE(name, ...) do {} while (0)
+
+#endif
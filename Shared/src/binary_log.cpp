@@ -0,0 +1,328 @@
+#include "headers.h"
+#include "binary_log.h"
+#include "spsc_ring.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace logging
+{
+	namespace
+	{
+		// 64 KiB of records per logging thread
+		using RecordRing = transport::SpscRing<LogRecord, 1024>;
+
+		struct ThreadRing
+		{
+			RecordRing ring;
+			std::atomic<uint64_t> dropped = 0;    // written by the owning thread only
+			std::atomic<bool> abandoned = false;  // the thread is gone, free once drained
+			uint64_t reported = 0;                // drops already written out, writer thread only
+		};
+
+		struct Format
+		{
+			LogLevel level;
+			std::string text;
+		};
+
+		// Formats on a thread of its own. Logging threads only ever touch their own ring, the
+		// mutex guards registration and is taken once per thread and per format.
+		class Backend
+		{
+		public:
+			static Backend& instance()
+			{
+				static Backend backend;
+				return backend;
+			}
+
+			uint16_t add_format(LogLevel level, std::string_view text)
+			{
+				std::lock_guard lock(mutex);
+				formats.push_back({ level, std::string(text) });
+				return static_cast<uint16_t>(formats.size() - 1);
+			}
+
+			std::shared_ptr<ThreadRing> add_ring()
+			{
+				auto ring = std::make_shared<ThreadRing>();
+
+				std::lock_guard lock(mutex);
+				rings.push_back(ring);
+				return ring;
+			}
+
+			bool open(const std::string& path)
+			{
+				std::FILE* opened = std::fopen(path.c_str(), "a");
+				if (!opened)
+					return false;
+
+				std::lock_guard lock(writeMutex);
+				if (file)
+					std::fclose(file);
+				file = opened;
+				return true;
+			}
+
+			void flush()
+			{
+				std::unique_lock lock(flushMutex);
+				uint64_t wanted = ++flushRequested;
+				wake.notify_one();
+				flushed.wait(lock, [&]() { return flushDone >= wanted || stopping; });
+			}
+
+			~Backend()
+			{
+				{
+					std::lock_guard lock(flushMutex);
+					stopping = true;
+				}
+				wake.notify_one();
+
+				if (writer.joinable())
+					writer.join();
+
+				if (file)
+					std::fclose(file);
+			}
+
+		private:
+			static constexpr std::chrono::milliseconds WriteInterval{ 5 };
+
+			std::mutex mutex;
+			std::vector<Format> formats;
+			std::vector<std::shared_ptr<ThreadRing>> rings;
+
+			std::mutex writeMutex;
+			std::FILE* file = nullptr;
+
+			std::mutex flushMutex;
+			std::condition_variable wake;
+			std::condition_variable flushed;
+			uint64_t flushRequested = 0;
+			uint64_t flushDone = 0;
+			bool stopping = false;
+
+			// Writer thread only
+			std::vector<Format> known;
+			std::vector<LogRecord> batch;
+			std::string line;
+
+			std::thread writer;
+
+			Backend()
+				: writer([this]() { run(); })
+			{
+			}
+
+			void run()
+			{
+				while (true)
+				{
+					uint64_t serving;
+					bool last;
+					{
+						std::unique_lock lock(flushMutex);
+						wake.wait_for(lock, WriteInterval, [this]() { return flushRequested > flushDone || stopping; });
+						serving = flushRequested;
+						last = stopping;
+					}
+
+					write_pending();
+
+					{
+						std::lock_guard lock(flushMutex);
+						flushDone = serving;
+					}
+					flushed.notify_all();
+
+					if (last)
+						return;
+				}
+			}
+
+			void write_pending()
+			{
+				std::vector<std::shared_ptr<ThreadRing>> current;
+				uint64_t dropped = 0;
+				{
+					std::lock_guard lock(mutex);
+
+					// A finished thread's ring goes once the pass before this one emptied it, its
+					// last drops are still reported
+					std::erase_if(rings, [&dropped](const std::shared_ptr<ThreadRing>& ring)
+						{
+							if (!ring->abandoned.load(std::memory_order_acquire) || !ring->ring.empty())
+								return false;
+
+							dropped += ring->dropped.load(std::memory_order_relaxed) - ring->reported;
+							return true;
+						});
+					current = rings;
+
+					// Formats are only ever appended
+					known.insert(known.end(), formats.begin() + known.size(), formats.end());
+				}
+
+				batch.clear();
+				for (const std::shared_ptr<ThreadRing>& ring : current)
+				{
+					ring->ring.drain([this](const LogRecord& record) { batch.push_back(record); });
+
+					// Counted per ring, a thread that exits takes none of the count with it
+					uint64_t ringDropped = ring->dropped.load(std::memory_order_relaxed);
+					dropped += ringDropped - ring->reported;
+					ring->reported = ringDropped;
+				}
+
+				// Threads fill their rings independently, put them back in time order
+				std::stable_sort(batch.begin(), batch.end(), [](const LogRecord& a, const LogRecord& b) { return a.time < b.time; });
+
+				std::lock_guard lock(writeMutex);
+				for (const LogRecord& record : batch)
+					write_record(record);
+
+				if (dropped > 0)
+				{
+					line = "Log rings overflowed, " + std::to_string(dropped) + " records dropped\n";
+					std::fwrite(line.data(), 1, line.size(), file ? file : stderr);
+				}
+
+				std::fflush(file ? file : stdout);
+			}
+
+			void write_record(const LogRecord& record)
+			{
+				if (record.format >= known.size())
+					return;
+
+				const Format& format = known[record.format];
+				line.clear();
+
+				// Console output stays as it always looked, the file gets a UTC time and level
+				if (file)
+				{
+					auto time = std::chrono::system_clock::time_point(std::chrono::system_clock::duration(record.time));
+					auto sinceMidnight = std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch() % std::chrono::days(1)).count();
+
+					char stamp[32];
+					std::snprintf(stamp, sizeof(stamp), "%02lld:%02lld:%02lld.%06lld %s ", static_cast<long long>(sinceMidnight / 3600000000LL), static_cast<long long>(sinceMidnight / 60000000LL % 60),
+						static_cast<long long>(sinceMidnight / 1000000LL % 60), static_cast<long long>(sinceMidnight % 1000000LL), format.level == LL_ERROR ? "E" : "I");
+					line += stamp;
+				}
+
+				size_t offset = 0;
+				size_t arg = 0;
+				for (size_t i = 0; i < format.text.size(); i++)
+				{
+					if (format.text[i] != '{' || i + 1 >= format.text.size() || format.text[i + 1] != '}' || arg >= record.argCount)
+					{
+						line += format.text[i];
+						continue;
+					}
+
+					append_arg(record, static_cast<ArgType>((record.types >> (4 * arg)) & 0xF), offset);
+					arg++;
+					i++;
+				}
+				line += '\n';
+
+				std::fwrite(line.data(), 1, line.size(), file ? file : (format.level == LL_ERROR ? stderr : stdout));
+			}
+
+			void append_arg(const LogRecord& record, ArgType type, size_t& offset)
+			{
+				if (type == AT_STRING)
+				{
+					if (offset >= record.size)
+						return;
+
+					size_t length = record.payload[offset];
+					line.append(reinterpret_cast<const char*>(record.payload + offset + 1), length);
+					offset += 1 + length;
+					return;
+				}
+
+				// Numbers cut off by a full payload
+				if (offset + 8 > record.size)
+				{
+					line += '0';
+					return;
+				}
+
+				switch (type)
+				{
+				case AT_SIGNED:
+				{
+					int64_t value;
+					std::memcpy(&value, record.payload + offset, 8);
+					line += std::to_string(value);
+					break;
+				}
+				case AT_DOUBLE:
+				{
+					double value;
+					std::memcpy(&value, record.payload + offset, 8);
+					line += std::to_string(value);
+					break;
+				}
+				default:
+				{
+					uint64_t value;
+					std::memcpy(&value, record.payload + offset, 8);
+					line += std::to_string(value);
+					break;
+				}
+				}
+				offset += 8;
+			}
+		};
+
+		// Hands the ring back when its thread ends
+		struct RingHandle
+		{
+			std::shared_ptr<ThreadRing> ring;
+
+			~RingHandle()
+			{
+				if (ring)
+					ring->abandoned.store(true, std::memory_order_release);
+			}
+		};
+
+		thread_local RingHandle threadRing;
+	}
+
+	uint16_t register_format(LogLevel level, std::string_view text)
+	{
+		return Backend::instance().add_format(level, text);
+	}
+
+	void submit(const LogRecord& record)
+	{
+		if (!threadRing.ring)
+			threadRing.ring = Backend::instance().add_ring();
+
+		ThreadRing& ring = *threadRing.ring;
+		if (!ring.ring.try_push(record))
+			ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	bool open_file(const std::string& path)
+	{
+		return Backend::instance().open(path);
+	}
+
+	void flush()
+	{
+		Backend::instance().flush();
+	}
+}
@@ -1,5 +1,8 @@
 #include "headers.h"
 #include "engine.h"
+#include "tracepoints.h"
+
+#include <algorithm>
 
 
 
@@ -26,6 +29,64 @@ namespace chess
 		reset_board();
 	}
 
+	ChessEngine::ChessEngine(const ChessEngine& other)
+	{
+		*this = other;
+	}
+
+	ChessEngine& ChessEngine::operator=(const ChessEngine& other)
+	{
+		if (this == &other)
+			return *this;
+
+		player = other.player;
+		timeoutPerMoveMs = other.timeoutPerMoveMs;
+		chessBorders = other.chessBorders;
+		waitingForPromotion = other.waitingForPromotion;
+		enPassantOppertunities = other.enPassantOppertunities;
+		timeOutPositions = other.timeOutPositions;
+		piecesLeft = other.piecesLeft;
+		gameMovesCount = other.gameMovesCount;
+		kingMoved = other.kingMoved;
+		didOtherLose = other.didOtherLose;
+
+		for (size_t i = 0; i < boardSetup.size(); i++)
+			boardSetup[i].piece = other.boardSetup[i].piece;
+
+		bind_walls();
+
+		return *this;
+	}
+
+	ChessEngine::ChessEngine(ChessEngine&& other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	ChessEngine& ChessEngine::operator=(ChessEngine&& other) noexcept
+	{
+		if (this == &other)
+			return *this;
+
+		player = other.player;
+		timeoutPerMoveMs = other.timeoutPerMoveMs;
+		chessBorders = other.chessBorders;
+		waitingForPromotion = other.waitingForPromotion;
+		enPassantOppertunities = std::move(other.enPassantOppertunities);
+		timeOutPositions = std::move(other.timeOutPositions);
+		piecesLeft = other.piecesLeft;
+		gameMovesCount = other.gameMovesCount;
+		kingMoved = other.kingMoved;
+		didOtherLose = other.didOtherLose;
+
+		for (size_t i = 0; i < boardSetup.size(); i++)
+			boardSetup[i].piece = other.boardSetup[i].piece;
+
+		bind_walls();
+
+		return *this;
+	}
+
 	void ChessEngine::opponent_move(int from, int to)
 	{
 		move_piece_no_check(from, to);
@@ -55,12 +116,18 @@ namespace chess
 
 		chessBorders.fill(false);
 
+		for (int i = 0; i < 64; i++)
+			boardSetup[i].piece = initial[i];
+
+		bind_walls();
+	}
+
+	void ChessEngine::bind_walls()
+	{
 		size_t next = 0;
 
-		// assign pieces
 		for (int i = 0; i < 64; i++)
 		{
-			boardSetup[i].piece = initial[i];
 			int row = i / 8;
 			int col = i % 8;
 
@@ -121,7 +188,7 @@ namespace chess
 
 	void ChessEngine::check_timeouts()
 	{
-		auto now = std::chrono::steady_clock::now();
+		auto now = GameClock::now();
 		for (auto it = timeOutPositions.begin(); it != timeOutPositions.end();)
 		{
 			if (now >= it->expiry)
@@ -131,6 +198,31 @@ namespace chess
 		}
 	}
 
+	size_t ChessEngine::timeout_count() const
+	{
+		return timeOutPositions.size();
+	}
+
+	int ChessEngine::timeout_position(size_t index) const
+	{
+		return timeOutPositions[index].position;
+	}
+
+	void ChessEngine::expire_timeout(int position)
+	{
+		std::erase_if(timeOutPositions, [position](const TimeOut& timeout) { return timeout.position == position; });
+	}
+
+	std::optional<GameClock::time_point> ChessEngine::cooldown_expiry(int position) const
+	{
+		for (const TimeOut& timeout : timeOutPositions)
+		{
+			if (timeout.position == position)
+				return timeout.expiry;
+		}
+		return std::nullopt;
+	}
+
 
 	Pieces ChessEngine::piece_at(int index) const
 	{
@@ -143,6 +235,14 @@ namespace chess
 	}
 
 	MoveState ChessEngine::move_piece(int from, int to)
+	{
+		FC_TRACE(move_piece_entry, this, from, to);
+		MoveState result = dispatch_move(from, to);
+		FC_TRACE(move_piece_exit, this, from, to, static_cast<int>(result));
+		return result;
+	}
+
+	MoveState ChessEngine::dispatch_move(int from, int to)
 	{
 		if (!valid_piece(from))
 			return MOVE_INVALID;
@@ -288,6 +388,68 @@ namespace chess
 		}
 	}
 
+	void ChessEngine::mirror_board_from(const ChessEngine& other)
+	{
+		for (int i = 0; i < 64; i++)
+		{
+			int mirrored = reverse(i);
+			boardSetup[mirrored].piece = other.boardSetup[i].piece;
+
+			// Rotating the board swaps up with down and left with right
+			for (size_t j = 0; j < 4; j++)
+			{
+				const auto& source = other.boardSetup[i].walls[j];
+				auto& target = boardSetup[mirrored].walls[j ^ 1];
+				if (source && target)
+					target->get() = source->get();
+			}
+		}
+	}
+
+	void ChessEngine::load_board(const std::array<Pieces, 64>& pieces, uint64_t wallsBelow, uint64_t wallsRight)
+	{
+		ChessEngine white(PL_WHITE, timeoutPerMoveMs);
+		for (int i = 0; i < 64; i++)
+		{
+			white.boardSetup[i].piece = pieces[i];
+
+			if (auto& below = white.boardSetup[i].walls[DIR_DOWN - 1])
+				below->get() = (wallsBelow >> i & 1) != 0;
+			if (auto& right = white.boardSetup[i].walls[DIR_RIGHT - 1])
+				right->get() = (wallsRight >> i & 1) != 0;
+		}
+
+		if (player == PL_WHITE)
+		{
+			chessBorders = white.chessBorders;
+			for (int i = 0; i < 64; i++)
+				boardSetup[i].piece = white.boardSetup[i].piece;
+		}
+		else
+		{
+			mirror_board_from(white);
+		}
+
+		timeOutPositions.clear();
+		enPassantOppertunities.clear();
+		waitingForPromotion = { -1, -1 };
+
+		// Captures count down from twelve, and a king off its square may no longer castle
+		int opponentPieces = 0;
+		for (int i = 0; i < 64; i++)
+			opponentPieces += is_other_player_piece(i);
+		piecesLeft = 12 - (16 - opponentPieces);
+
+		Pieces king = player == PL_WHITE ? W_KING : B_KING;
+		int kingSquare = player == PL_WHITE ? 60 : 59;
+		kingMoved = boardSetup[kingSquare].piece != king;
+	}
+
+	void ChessEngine::start_cooldown(int position, GameClock::duration remaining)
+	{
+		expire_timeout(position);
+		timeOutPositions.emplace_back(position, GameClock::now() + remaining);
+	}
 
 	bool ChessEngine::piece_exists(int index) const
 	{
@@ -396,11 +558,6 @@ namespace chess
 
 		if (is_in_timeout(from) || to == from)
 			return MOVE_INVALID;
-		std::function<bool(const RowCol&)> move_to_right_left = [](const RowCol& rc)
-		{
-			return rc.toCol == rc.fromCol - 1 || rc.toCol == rc.fromCol + 1;
-		};
-
 		RowCol rc = get_row_col(from, to);
 
 
@@ -685,7 +842,7 @@ namespace chess
 		if (is_in_timeout(from) || to == from)
 			return MOVE_INVALID;
 
-		std::function<MoveState(Direction)> handle_straight_line_move = [this, to, from, canBreakWalls](Direction dir) -> MoveState
+		auto handle_straight_line_move = [this, to, from, canBreakWalls](Direction dir) -> MoveState
 			{
 				if (dir == DIR_NONE)
 					return MOVE_INVALID;
@@ -812,7 +969,7 @@ namespace chess
 
 	void ChessEngine::add_timeout(int position)
 	{
-		timeOutPositions.emplace_back(position, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutPerMoveMs));
+		timeOutPositions.emplace_back(position, GameClock::now() + std::chrono::milliseconds(timeoutPerMoveMs));
 	}
 
 	bool ChessEngine::can_move_straight_wall_check(int refPos, Direction dir) const
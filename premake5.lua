@@ -5,6 +5,18 @@ IncludeDir = {}
 IncludeDir["ASIO"] = "../vendors/asio/include"
 IncludeDir["RAYLIB"] = "../vendors/raylib/include"
 
+newoption
+{
+    trigger = "io-uring",
+    description = "Linux only: run the server's sockets and timers on io_uring instead of epoll (needs liburing, kernel 5.10+)"
+}
+
+newoption
+{
+    trigger = "usdt",
+    description = "Linux only: compile in the server's static tracepoints for perf and bpftrace (needs sys/sdt.h from systemtap-sdt-dev)"
+}
+
 LibDir = {}
 LibDir["RAYLIB"] = "../vendors/raylib/lib"
 
@@ -30,4 +42,5 @@ workspace "Fort-Chess-Server"
 
 
 group  "fort-chess-server"
-    include "server/fort-chess-server.lua"
\ No newline at end of file
+    include "server/fort-chess-server.lua"
+    include "loadgen/fort-chess-loadgen.lua"
\ No newline at end of file
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Runs the same load against two server builds, e.g. the default epoll one and one generated
+# with `premake5 --io-uring gmake`, and prints syscalls per relayed frame for each. The load
+# command is responsible for reporting relay latency (p50/p99).
+#
+# usage: bench_event_backend.sh <server binary> <server binary> -- <load command...>
+#
+# Needs `perf` with access to the raw_syscalls tracepoints (root or perf_event_paranoid <= 1).
+
+set -e
+
+if [ "$#" -lt 4 ] || [ "$3" != "--" ]; then
+    echo "usage: $0 <server binary> <server binary> -- <load command...>"
+    exit 1
+fi
+
+first="$1"
+second="$2"
+shift 3
+
+shards="${SHARDS:-1}"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+run_one()
+{
+    binary="$1"
+    shift
+    name="$(basename "$binary")"
+
+    mkfifo "$work/stdin"
+    "$binary" --shards "$shards" --stats < "$work/stdin" > "$work/server.log" 2>&1 &
+    server=$!
+    exec 3> "$work/stdin"
+    sleep 1
+
+    perf stat -e raw_syscalls:sys_enter -x, -p "$server" -o "$work/perf.csv" &
+    perf=$!
+    sleep 0.5
+
+    echo "== $name"
+    "$@"
+
+    kill -INT "$perf"
+    wait "$perf" || true
+
+    # The server exits after three lines on stdin and prints its totals
+    printf '\n\n\n' >&3
+    exec 3>&-
+    wait "$server" || true
+    rm -f "$work/stdin"
+
+    syscalls="$(grep raw_syscalls "$work/perf.csv" | cut -d, -f1)"
+    stats="$(grep '^backend' "$work/server.log")"
+    frames_in="$(echo "$stats" | sed -n 's/.*frames in \([0-9]*\).*/\1/p')"
+    frames_out="$(echo "$stats" | sed -n 's/.*frames out \([0-9]*\).*/\1/p')"
+    frames=$((frames_in + frames_out))
+
+    echo "$stats"
+    if [ "$frames" -gt 0 ]; then
+        echo "syscalls $syscalls, per frame $(echo "scale=3; $syscalls / $frames" | bc)"
+    else
+        echo "syscalls $syscalls, no frames relayed"
+    fi
+}
+
+run_one "$first" "$@"
+run_one "$second" "$@"